@@ -59,6 +59,650 @@ TEST_CASE("Test Matrix Multiplication-2", "[TortoiseMatrix]") {
     REQUIRE(m3(5, 5) == 5);
 }
 
+/*
+  Dot product against a naive triple loop, with shapes that leave
+  partial register tiles and cross the cache blocking boundaries
+*/
+template <typename T>
+TortoiseMatrix<T> sequence_matrix(int rows, int cols, int seed)
+{
+    TortoiseMatrix<T> mat(rows, cols);
+    for (int r = 0; r < rows; r++)
+        for (int c = 0; c < cols; c++)
+            mat.set(r, c, (T)((r * 7 + c * 13 + seed) % 11) - 5);
+    return mat;
+}
+
+template <typename T>
+TortoiseMatrix<T> naive_dot(const TortoiseMatrix<T>& a, const TortoiseMatrix<T>& b)
+{
+    TortoiseMatrix<T> result(a.rows(), b.cols(), 0);
+    for (int r = 0; r < a.rows(); r++)
+        for (int c = 0; c < b.cols(); c++) {
+            T sum = 0;
+            for (int k = 0; k < a.cols(); k++)
+                sum += a(r, k) * b(k, c);
+            result.set(r, c, sum);
+        }
+    return result;
+}
+
+template <typename T>
+bool same_matrix(const TortoiseMatrix<T>& a, const TortoiseMatrix<T>& b)
+{
+    if (a.rows() != b.rows() || a.cols() != b.cols())
+        return false;
+    for (int r = 0; r < a.rows(); r++)
+        for (int c = 0; c < a.cols(); c++)
+            if (a(r, c) != b(r, c))
+                return false;
+    return true;
+}
+
+TEST_CASE("Test Matrix Multiplication-3", "[TortoiseMatrix]") {
+    auto a = sequence_matrix<double>(37, 53, 1);
+    auto b = sequence_matrix<double>(53, 29, 2);
+    REQUIRE(same_matrix(a.dot(b), naive_dot(a, b)));
+
+    auto fa = sequence_matrix<float>(150, 300, 3);
+    auto fb = sequence_matrix<float>(300, 70, 4);
+    REQUIRE(same_matrix(fa.dot(fb), naive_dot(fa, fb)));
+
+    auto ia = sequence_matrix<int>(9, 270, 5);
+    auto ib = sequence_matrix<int>(270, 5, 6);
+    REQUIRE(same_matrix(ia.dot(ib), naive_dot(ia, ib)));
+}
+
+/*
+  dot only runs the widest microkernel of the CPU, so every kernel the CPU
+  supports is run here directly, on shapes with fringe tiles on all sides
+  and a transposed A
+*/
+template <typename T>
+bool check_microkernel(const tortoise_detail::GemmKernel<T>& kernel)
+{
+    const int shapes[][3] = { {1, 1, 1}, {7, 17, 5}, {13, 33, 300}, {50, 70, 9}, {97, 45, 260} };
+    bool same = true;
+    for (const auto& shape : shapes) {
+        const int m = shape[0], n = shape[1], k = shape[2];
+        TortoiseMatrix<T> a = sequence_matrix<T>(m, k, 1);
+        TortoiseMatrix<T> at = a.transpose();
+        TortoiseMatrix<T> b = sequence_matrix<T>(k, n, 2);
+        TortoiseMatrix<T> c = sequence_matrix<T>(m, n, 3);
+        TortoiseMatrix<T> expected = naive_dot(a, b) * T(2) + c;
+
+        TortoiseMatrix<T> result = c;
+        tortoise_detail::MatrixRef<T> out = { result.data(), m, n, n, 1 };
+        tortoise_detail::gemm_blocked(T(2), tortoise_detail::const_ref(a), tortoise_detail::const_ref(b), T(1),
+                                      out, kernel, tortoise_detail::GemmNoEpilogue());
+        same = same && same_matrix(result, expected);
+
+        result = c;
+        tortoise_detail::gemm_blocked(T(2), tortoise_detail::transposed(tortoise_detail::const_ref(at)),
+                                      tortoise_detail::const_ref(b), T(1), out, kernel, tortoise_detail::GemmNoEpilogue());
+        same = same && same_matrix(result, expected);
+    }
+    return same;
+}
+
+TEST_CASE("Test Matrix Multiplication-Microkernels", "[TortoiseMatrix]") {
+    using namespace tortoise_detail;
+    const GemmKernel<float> float_reference = { 4, 16, &gemm_ukernel_ref<float, 4, 16> };
+    const GemmKernel<double> double_reference = { 4, 8, &gemm_ukernel_ref<double, 4, 8> };
+    REQUIRE(check_microkernel(float_reference));
+    REQUIRE(check_microkernel(double_reference));
+#if defined(TT_X86_SIMD)
+    if (simd_level() >= SIMD_SSE2) {
+        const GemmKernel<float> float_sse2 = { 6, 8, &gemm_ukernel_sse2_6x8 };
+        const GemmKernel<double> double_sse2 = { 6, 4, &gemm_ukernel_sse2_6x4 };
+        REQUIRE(check_microkernel(float_sse2));
+        REQUIRE(check_microkernel(double_sse2));
+    }
+    if (simd_level() >= SIMD_AVX2) {
+        const GemmKernel<float> float_avx2 = { 6, 16, &gemm_ukernel_avx2_6x16 };
+        const GemmKernel<double> double_avx2 = { 6, 8, &gemm_ukernel_avx2_6x8 };
+        REQUIRE(check_microkernel(float_avx2));
+        REQUIRE(check_microkernel(double_avx2));
+    }
+    if (simd_level() >= SIMD_AVX512) {
+        const GemmKernel<float> float_avx512 = { 6, 32, &gemm_ukernel_avx512_6x32 };
+        const GemmKernel<double> double_avx512 = { 6, 16, &gemm_ukernel_avx512_6x16 };
+        REQUIRE(check_microkernel(float_avx512));
+        REQUIRE(check_microkernel(double_avx512));
+    }
+#endif
+}
+
+/*
+  Threaded dot must match the naive product and give bit identical
+  results for every thread count
+*/
+TEST_CASE("Test Matrix Multiplication-Threads", "[TortoiseMatrix]") {
+    auto a = sequence_matrix<float>(301, 517, 7);
+    auto b = sequence_matrix<float>(517, 203, 8);
+    for (int r = 0; r < a.rows(); r++)
+        a.set(r, r % a.cols(), 0.1f * r);
+
+    tortoiseSetThreads(1);
+    auto serial = a.dot(b);
+
+    tortoiseSetThreads(4);
+    REQUIRE(tortoiseThreads() == 4);
+    REQUIRE(same_matrix(a.dot(b), serial));
+
+    tortoiseSetThreads(7);
+    REQUIRE(same_matrix(a.dot(b), serial));
+
+    auto ta = sequence_matrix<double>(2000, 64, 9);
+    auto tb = sequence_matrix<double>(64, 3, 10);
+    REQUIRE(same_matrix(ta.dot(tb), naive_dot(ta, tb)));
+
+    // an exception thrown by a task reaches the caller, and the pool is
+    // still used by the next calls
+    tortoiseSetThreads(4);
+    auto failing = [](float v) -> float {
+        if (v > 100.0f)
+            throw std::runtime_error("activation");
+        return v;
+    };
+    REQUIRE_THROWS_AS(a.dot(b, TortoiseMatrix<float>(), 1.0f, failing), std::runtime_error);
+    REQUIRE_THROWS_AS(tortoise_detail::ThreadPool::instance().run(16, [](int) { throw 1; }), int);
+    REQUIRE(same_matrix(a.dot(b), serial));
+
+    std::mutex mutex;
+    std::vector<std::thread::id> seen;
+    tortoise_detail::ThreadPool::instance().run(64, [&](int) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(1));
+        std::lock_guard<std::mutex> lock(mutex);
+        if (std::find(seen.begin(), seen.end(), std::this_thread::get_id()) == seen.end())
+            seen.push_back(std::this_thread::get_id());
+    });
+    REQUIRE(seen.size() > 1);
+
+    tortoiseSetThreads(0);
+}
+
+/*
+  Products with transposed operands against dot of explicit transposes,
+  with fringe tiles and more than one k block
+*/
+TEST_CASE("Test Matrix Multiplication-Transposed", "[TortoiseMatrix]") {
+    auto a = sequence_matrix<float>(300, 37, 1);
+    auto b = sequence_matrix<float>(300, 53, 2);
+    auto c = sequence_matrix<float>(53, 300, 3);
+    REQUIRE(same_matrix(a.dotTN(b), a.transpose().dot(b)));
+    REQUIRE(same_matrix(b.dotNT(b), b.dot(b.transpose())));
+    REQUIRE(same_matrix(a.dotTT(c), a.transpose().dot(c.transpose())));
+
+    auto ia = sequence_matrix<int>(7, 5, 4);
+    auto ib = sequence_matrix<int>(9, 7, 5);
+    REQUIRE(same_matrix(ia.dotTT(ib), naive_dot(ia.transpose(), ib.transpose())));
+
+    auto da = sequence_matrix<double>(517, 301, 6);
+    auto db = sequence_matrix<double>(203, 301, 7);
+    tortoiseSetThreads(1);
+    auto serial = da.dotNT(db);
+    tortoiseSetThreads(4);
+    REQUIRE(same_matrix(da.dotNT(db), serial));
+    tortoiseSetThreads(0);
+    REQUIRE(same_matrix(serial, naive_dot(da, db.transpose())));
+}
+
+/*
+  Fused dot against the unfused expression, with fringe tiles, several
+  k blocks and a threaded split of the output
+*/
+template <typename T>
+bool close_matrix(const TortoiseMatrix<T>& a, const TortoiseMatrix<T>& b, T tolerance)
+{
+    if (a.rows() != b.rows() || a.cols() != b.cols())
+        return false;
+    for (int r = 0; r < a.rows(); r++)
+        for (int c = 0; c < a.cols(); c++)
+            if (std::abs(a(r, c) - b(r, c)) > tolerance * (1 + std::abs(b(r, c))))
+                return false;
+    return true;
+}
+
+TEST_CASE("Test Matrix Multiplication-Epilogue", "[TortoiseMatrix]") {
+    TortoiseMatrix<float> x = sequence_matrix<float>(131, 300, 1) * 0.01f;
+    TortoiseMatrix<float> w = sequence_matrix<float>(300, 77, 2) * 0.01f;
+    TortoiseMatrix<float> bias = sequence_matrix<float>(1, 77, 3) * 0.1f;
+    TortoiseMatrix<float> column = sequence_matrix<float>(131, 1, 4) * 0.1f;
+    const float tolerance = 4 * std::numeric_limits<float>::epsilon();
+
+    auto product = x.dot(w);
+    REQUIRE(same_matrix(x.dot(w, TortoiseMatrix<float>()), product));
+    REQUIRE(same_matrix(x.dot(w, bias), product.broadcast(bias).eval()));
+    REQUIRE(same_matrix(x.dot(w, column, 2.0f), (product * 2.0f).broadcast(column).eval()));
+    REQUIRE(same_matrix(x.dot(w, TortoiseMatrix<float>(1, 1, -1.0f)), (product - 1.0f).eval()));
+
+    TortoiseMatrix<float> relu = product.broadcast(bias);
+    for (long i = 0; i < relu.size(); i++)
+        relu.data()[i] = std::max(relu.data()[i], 0.0f);
+    REQUIRE(same_matrix(x.dot(w, bias, 1.0f, TortoiseActivationRelu), relu));
+    REQUIRE(close_matrix(x.dot(w, bias, 1.0f, TortoiseActivationTanh), product.broadcast(bias).tanh().eval(), tolerance));
+    REQUIRE(close_matrix(x.dot(w, bias, 1.0f, TortoiseActivationExp), product.broadcast(bias).exp().eval(), tolerance));
+    REQUIRE(close_matrix(x.dot(w, bias, 1.0f, TortoiseActivationSigmoid),
+                         ((product.broadcast(bias) * -1.0f).exp() + 1.0f).div(1.0).eval(), tolerance));
+    REQUIRE(same_matrix(x.dot(w, bias, 1.0f, [](float v) { return v * v; }),
+                        (product.broadcast(bias) * product.broadcast(bias)).eval()));
+
+    TortoiseMatrix<double> big = sequence_matrix<double>(300, 700, 5) * 0.01;
+    TortoiseMatrix<double> weights = sequence_matrix<double>(700, 200, 6) * 0.01;
+    TortoiseMatrix<double> big_bias = sequence_matrix<double>(1, 200, 7);
+    tortoiseSetThreads(1);
+    auto serial = big.dot(weights, big_bias, 0.5, TortoiseActivationTanh);
+    tortoiseSetThreads(7);
+    REQUIRE(same_matrix(big.dot(weights, big_bias, 0.5, TortoiseActivationTanh), serial));
+    tortoiseSetThreads(0);
+    REQUIRE(close_matrix(serial, (big.dot(weights) * 0.5).broadcast(big_bias).tanh().eval(), 4 * std::numeric_limits<double>::epsilon()));
+
+    TortoiseMatrix<double> empty(3, 0);
+    REQUIRE(same_matrix(empty.dot(TortoiseMatrix<double>(0, 2), TortoiseMatrix<double>(1, 2, 1.5)), TortoiseMatrix<double>(3, 2, 1.5)));
+}
+
+TEST_CASE("Test Matrix Multiplication-Accumulate", "[TortoiseMatrix]") {
+    auto a = sequence_matrix<int>(37, 300, 1);
+    auto b = sequence_matrix<int>(300, 53, 2);
+    auto c = sequence_matrix<int>(37, 53, 3);
+    TortoiseMatrix<int> expected = a.dot(b) * 2 + c * 3;
+    const int* storage = c.data();
+    tortoiseGemm(2, a, b, 3, c);
+    REQUIRE(c.data() == storage);
+    REQUIRE(same_matrix(c, expected));
+
+    auto at = sequence_matrix<int>(300, 37, 4);
+    auto bt = sequence_matrix<int>(53, 300, 5);
+    expected = at.dotTN(b) + c;
+    tortoiseGemm(1, at, b, 1, c, true);
+    REQUIRE(same_matrix(c, expected));
+    expected = a.dotNT(bt) - c;
+    tortoiseGemm(1, a, bt, -1, c, false, true);
+    REQUIRE(same_matrix(c, expected));
+    tortoiseGemm(1, at, bt, 0, c, true, true);
+    REQUIRE(same_matrix(c, at.dotTT(bt)));
+
+    TortoiseMatrix<float> x = sequence_matrix<float>(131, 300, 6) * 0.01f;
+    TortoiseMatrix<float> w = sequence_matrix<float>(300, 77, 7) * 0.01f;
+    TortoiseMatrix<float> y(131, 77, std::numeric_limits<float>::quiet_NaN());
+    tortoiseGemm(0.5, x, w, 0.0, y);
+    REQUIRE(close_matrix(y, (x.dot(w) * 0.5f).eval(), 4 * std::numeric_limits<float>::epsilon()));
+
+    TortoiseMatrix<double> big = sequence_matrix<double>(300, 700, 8) * 0.01;
+    TortoiseMatrix<double> weights = sequence_matrix<double>(700, 200, 9) * 0.01;
+    TortoiseMatrix<double> serial = sequence_matrix<double>(300, 200, 10);
+    TortoiseMatrix<double> threaded = serial;
+    tortoiseSetThreads(1);
+    tortoiseGemm(-0.5, big, weights, 0.25, serial);
+    tortoiseSetThreads(7);
+    tortoiseGemm(-0.5, big, weights, 0.25, threaded);
+    tortoiseSetThreads(0);
+    REQUIRE(same_matrix(threaded, serial));
+}
+
+/*
+  Matrix-vector and few row or column products, which skip the blocked
+  path, against the naive product: vector fringes, more than one block
+  of accumulated columns, transposed operands and thread counts
+*/
+template <typename T>
+void check_skinny()
+{
+    const int sizes[] = { 1, 2, 3, 5, 8 };
+    for (int size : sizes) {
+        auto a = sequence_matrix<T>(size, 517, 1);
+        auto b = sequence_matrix<T>(517, 1031, 2);
+        REQUIRE(same_matrix(a.dot(b), naive_dot(a, b)));
+        REQUIRE(same_matrix(b.dotTN(a.transpose()), naive_dot(b.transpose(), a.transpose())));
+
+        auto c = sequence_matrix<T>(301, 517, 3);
+        auto d = sequence_matrix<T>(517, size, 4);
+        REQUIRE(same_matrix(c.dot(d), naive_dot(c, d)));
+        REQUIRE(same_matrix(c.dotNT(d.transpose()), naive_dot(c, d)));
+    }
+
+    auto row = sequence_matrix<T>(1, 37, 5);
+    auto wide = sequence_matrix<T>(37, 4133, 6);
+    REQUIRE(same_matrix(row.dot(wide), naive_dot(row, wide)));
+}
+
+TEST_CASE("Test Matrix Multiplication-Skinny", "[TortoiseMatrix]") {
+    check_skinny<float>();
+    check_skinny<double>();
+    check_skinny<int>();
+
+    auto x = sequence_matrix<float>(1, 700, 1);
+    auto w = sequence_matrix<float>(700, 3001, 2);
+    auto v = sequence_matrix<float>(3001, 700, 3);
+    auto y = sequence_matrix<float>(700, 1, 4);
+    tortoiseSetThreads(1);
+    auto row_serial = x.dot(w);
+    auto column_serial = v.dot(y);
+    tortoiseSetThreads(7);
+    REQUIRE(same_matrix(x.dot(w), row_serial));
+    REQUIRE(same_matrix(v.dot(y), column_serial));
+    tortoiseSetThreads(0);
+
+    TortoiseMatrix<float> input = x * 0.01f;
+    TortoiseMatrix<float> bias = sequence_matrix<float>(1, 3001, 5) * 0.1f;
+    REQUIRE(close_matrix(input.dot(w, bias, 0.5f, TortoiseActivationTanh),
+                         (input.dot(w) * 0.5f).broadcast(bias).tanh().eval(), 4 * std::numeric_limits<float>::epsilon()));
+
+    TortoiseMatrix<double> column = sequence_matrix<double>(3001, 2, 6);
+    TortoiseMatrix<double> expected = naive_dot(sequence_matrix<double>(3001, 700, 7), sequence_matrix<double>(700, 2, 8)) * 2.0 - column;
+    tortoiseGemm(2.0, sequence_matrix<double>(3001, 700, 7), sequence_matrix<double>(700, 2, 8), -1.0, column);
+    REQUIRE(same_matrix(column, expected));
+}
+
+/*
+  Products with a packed right operand against the unpacked ones: the
+  column layout, the panel kernel of a few rows, the blocked path over
+  several k and column blocks, and the fused epilogue
+*/
+template <typename T>
+void check_packed()
+{
+    const int rows[] = { 1, 3, 8, 9, 150 };
+    for (int m : rows) {
+        auto a = sequence_matrix<T>(m, 517, 1);
+        auto b = sequence_matrix<T>(517, 70, 2);
+        auto c = sequence_matrix<T>(517, 5, 3);
+        REQUIRE(same_matrix(a.dot(b.pack()), naive_dot(a, b)));
+        REQUIRE(same_matrix(a.dot(c.pack()), naive_dot(a, c)));
+    }
+
+    auto a = sequence_matrix<T>(9, 37, 4);
+    auto wide = sequence_matrix<T>(37, 4133, 5);
+    REQUIRE(same_matrix(a.dot(wide.pack()), naive_dot(a, wide)));
+}
+
+TEST_CASE("Test Matrix Multiplication-Packed", "[TortoiseMatrix]") {
+    check_packed<float>();
+    check_packed<double>();
+    check_packed<int>();
+
+    TortoiseMatrix<float> x = sequence_matrix<float>(131, 300, 1) * 0.01f;
+    TortoiseMatrix<float> w = sequence_matrix<float>(300, 77, 2) * 0.01f;
+    TortoiseMatrix<float> bias = sequence_matrix<float>(1, 77, 3) * 0.1f;
+    TortoisePackedMatrix<float> packed = w.pack();
+    REQUIRE(packed.rows() == 300);
+    REQUIRE(packed.cols() == 77);
+    REQUIRE(same_matrix(x.dot(packed), x.dot(w)));
+    REQUIRE(same_matrix(x.dot(packed, bias, 0.5f, TortoiseActivationTanh), x.dot(w, bias, 0.5f, TortoiseActivationTanh)));
+    REQUIRE(same_matrix(x.dot(packed, bias, 1.0f, [](float v) { return v * v; }),
+                        x.dot(w, bias, 1.0f, [](float v) { return v * v; })));
+
+    TortoiseMatrix<double> big = sequence_matrix<double>(300, 700, 4) * 0.01;
+    TortoisePackedMatrix<double> weights = (sequence_matrix<double>(700, 200, 5) * 0.01).eval().pack();
+    TortoiseMatrix<double> sample = sequence_matrix<double>(1, 700, 6);
+    tortoiseSetThreads(1);
+    auto serial = big.dot(weights);
+    auto sample_serial = sample.dot(weights);
+    tortoiseSetThreads(7);
+    REQUIRE(same_matrix(big.dot(weights), serial));
+    REQUIRE(same_matrix(sample.dot(weights), sample_serial));
+    tortoiseSetThreads(0);
+
+    TortoiseMatrix<float> empty(3, 0);
+    REQUIRE(same_matrix(empty.dot(TortoiseMatrix<float>(0, 20).pack()), TortoiseMatrix<float>(3, 20, 0.0f)));
+}
+
+template <typename T>
+void check_batched(int batch, int m, int k, int n)
+{
+    std::vector<TortoiseMatrix<T>> a;
+    std::vector<TortoiseMatrix<T>> b;
+    TortoiseMatrix<T> stacked_a(batch * m, k);
+    TortoiseMatrix<T> stacked_b(batch * k, n);
+    for (int i = 0; i < batch; i++) {
+        a.push_back(sequence_matrix<T>(m, k, i));
+        b.push_back(sequence_matrix<T>(k, n, 2 * i + 1));
+        std::copy(a[i].data(), a[i].data() + m * k, stacked_a.data() + i * m * k);
+        std::copy(b[i].data(), b[i].data() + k * n, stacked_b.data() + i * k * n);
+    }
+
+    std::vector<TortoiseMatrix<T>> c = tortoiseBatchedDot(a, b);
+    TortoiseMatrix<T> stacked_c = tortoiseBatchedDot(stacked_a, stacked_b, batch);
+    REQUIRE(c.size() == (std::size_t)batch);
+    REQUIRE(stacked_c.rows() == batch * m);
+    REQUIRE(stacked_c.cols() == n);
+    bool same = true;
+    for (int i = 0; i < batch; i++) {
+        TortoiseMatrix<T> expected = naive_dot(a[i], b[i]);
+        same = same && same_matrix(c[i], expected)
+               && std::equal(expected.data(), expected.data() + m * n, stacked_c.data() + i * m * n);
+    }
+    REQUIRE(same);
+}
+
+TEST_CASE("Test Matrix Multiplication-Batched", "[TortoiseMatrix]") {
+    check_batched<float>(37, 8, 8, 8);
+    check_batched<float>(16, 5, 7, 3);
+    check_batched<float>(3, 64, 64, 64);
+    check_batched<double>(21, 13, 9, 17);
+    check_batched<double>(5, 65, 20, 30);
+    check_batched<int>(9, 4, 6, 5);
+
+    // an item comes out the same wherever it is in the batch and whatever the thread count
+    std::vector<TortoiseMatrix<float>> a(100, sequence_matrix<float>(16, 16, 1) * 0.1f);
+    std::vector<TortoiseMatrix<float>> b(100, sequence_matrix<float>(16, 16, 2) * 0.1f);
+    tortoiseSetThreads(1);
+    std::vector<TortoiseMatrix<float>> serial = tortoiseBatchedDot(a, b);
+    tortoiseSetThreads(7);
+    std::vector<TortoiseMatrix<float>> parallel = tortoiseBatchedDot(a, b);
+    tortoiseSetThreads(0);
+    bool same = true;
+    for (int i = 0; i < 100; i++)
+        same = same && same_matrix(serial[i], serial[0]) && same_matrix(parallel[i], serial[0]);
+    REQUIRE(same);
+
+    REQUIRE(tortoiseBatchedDot(std::vector<TortoiseMatrix<float>>(), std::vector<TortoiseMatrix<float>>()).empty());
+    std::vector<TortoiseMatrix<double>> empty_k(3, TortoiseMatrix<double>(4, 0));
+    std::vector<TortoiseMatrix<double>> empty_rows(3, TortoiseMatrix<double>(0, 5));
+    REQUIRE(same_matrix(tortoiseBatchedDot(empty_k, empty_rows)[2], TortoiseMatrix<double>(4, 5, 0.0)));
+}
+
+TEST_CASE("Test Matrix Multiplication-Strassen", "[TortoiseMatrix]") {
+    REQUIRE(tortoiseDotAlgorithm() == TortoiseDotClassical);
+
+    // small integers keep every Strassen sum exact; the odd sizes peel off
+    // a row, a column and a slice of k
+    TortoiseMatrix<float> a = sequence_matrix<float>(2049, 2051, 1);
+    TortoiseMatrix<float> b = sequence_matrix<float>(2051, 2050, 2);
+    TortoiseMatrix<float> bias = sequence_matrix<float>(1, 2050, 3);
+    TortoiseMatrix<float> classical = a.dot(b);
+    TortoiseMatrix<float> expected(2049, 2050);
+    for (int r = 0; r < 2049; r++)
+        for (int c = 0; c < 2050; c++)
+            expected.set(r, c, std::max(2.0f * classical(r, c) + bias(0, c), 0.0f));
+
+    tortoiseSetDotAlgorithm(TortoiseDotStrassen);
+    REQUIRE(tortoiseDotAlgorithm() == TortoiseDotStrassen);
+    REQUIRE(same_matrix(a.transpose().dotTN(b), classical));
+    REQUIRE(same_matrix(a.dot(b, bias, 2.0f, TortoiseActivationRelu), expected));
+
+    // an even k leaves alpha and the epilogue to the last additions into
+    // the quadrants, here with a bias per row
+    TortoiseMatrix<double> c = sequence_matrix<double>(2051, 2048, 4);
+    TortoiseMatrix<double> d = sequence_matrix<double>(2048, 2049, 5);
+    TortoiseMatrix<double> rows = sequence_matrix<double>(2051, 1, 6);
+    tortoiseSetDotAlgorithm(TortoiseDotClassical);
+    TortoiseMatrix<double> even = (c.dot(d) * 0.5).broadcast(rows).eval();
+    tortoiseSetDotAlgorithm(TortoiseDotStrassen);
+    REQUIRE(same_matrix(c.dot(d, rows, 0.5), even));
+    TortoiseMatrix<double> small = sequence_matrix<double>(37, 53, 4);
+    REQUIRE(same_matrix(small.dot(small.transpose()), naive_dot(small, small.transpose())));
+
+    tortoiseSetDotAlgorithm(TortoiseDotDefault);
+    REQUIRE(tortoiseDotAlgorithm() == TortoiseDotClassical);
+}
+
+TEST_CASE("Test Matrix Fixed", "[TortoiseMatrix]") {
+    TortoiseMatrix<float> a = sequence_matrix<float>(3, 4, 1);
+    TortoiseMatrix<float> b = sequence_matrix<float>(4, 5, 2);
+    TortoiseFixedMatrix<float, 3, 4> fa(a);
+    TortoiseFixedMatrix<float, 4, 5> fb(b);
+    REQUIRE(fa.rows() == 3);
+    REQUIRE(fa.cols() == 4);
+    REQUIRE(sizeof(fa) == 12 * sizeof(float));
+    REQUIRE(same_matrix(fa.matrix(), a));
+    REQUIRE(same_matrix(fa.dot(fb).matrix(), naive_dot(a, b)));
+    REQUIRE(same_matrix(fa.transpose().matrix(), a.transpose()));
+
+    TortoiseMatrix<double> m = sequence_matrix<double>(4, 4, 3);
+    TortoiseFixedMatrix<double, 4, 4> fm(m);
+    REQUIRE(same_matrix(fm.dot(fm).matrix(), naive_dot(m, m)));
+    REQUIRE(same_matrix((fm + fm * 2.0 - 1.0).matrix(), TortoiseMatrix<double>(m + m * 2.0 - 1.0)));
+    REQUIRE(same_matrix((fm / (fm * fm + 1.0)).matrix(), TortoiseMatrix<double>(m / (m * m + 1.0))));
+    REQUIRE(fm.min() == m.min());
+    REQUIRE(fm.max() == m.max());
+    REQUIRE(fm.sum() == m.sum());
+    REQUIRE(fm.mean() == m.mean());
+
+    TortoiseFixedMatrix<int, 2, 2> fi = {{1, 2}, {3, 4}};
+    TortoiseFixedMatrix<int, 2, 2> identity = {{1, 0}, {0, 1}};
+    REQUIRE(fi.dot(identity) == fi);
+    REQUIRE(fi.dot(fi) == (TortoiseFixedMatrix<int, 2, 2>{{7, 10}, {15, 22}}));
+    fi += identity;
+    fi *= 3;
+    fi(0, 1) = -1;
+    REQUIRE(fi == (TortoiseFixedMatrix<int, 2, 2>{{6, -1}, {9, 15}}));
+    REQUIRE((TortoiseFixedMatrix<int, 2, 3>().sum() == 0));
+    REQUIRE((TortoiseFixedMatrix<int, 2, 3>(7).min() == 7));
+}
+
+TEST_CASE("Test Matrix Storage", "[TortoiseMatrix]") {
+    bool aligned = true;
+    for (int n = 1; n < 70; n++) {
+        TortoiseMatrix<float> f(n, 3);
+        TortoiseMatrix<double> d = TortoiseMatrix<double>(1, n, 2.0) * 3.0;
+        aligned = aligned && (std::size_t)f.data() % 64 == 0 && (std::size_t)d.data() % 64 == 0;
+    }
+    REQUIRE(aligned);
+    REQUIRE(TortoiseMatrix<int>().data() == nullptr);
+
+    // 768 x 700 floats are over 2 MB, so each mode maps them
+    REQUIRE(tortoiseHugePages() == TortoiseHugePagesOff);
+    TortoiseMatrix<float> b = sequence_matrix<float>(700, 9, 2);
+    TortoiseHugePages modes[] = {TortoiseHugePagesTransparent, TortoiseHugePagesExplicit, TortoiseHugePagesOff};
+    for (TortoiseHugePages mode : modes) {
+        tortoiseSetHugePages(mode);
+        REQUIRE(tortoiseHugePages() == mode);
+        TortoiseMatrix<float> a = sequence_matrix<float>(768, 700, 1);
+        REQUIRE((std::size_t)a.data() % 64 == 0);
+        REQUIRE(same_matrix(a.dot(b), naive_dot(a, b)));
+        TortoiseMatrix<float> copy = a;
+        TortoiseMatrix<float> moved = std::move(copy);
+        moved.transposeInPlace();
+        REQUIRE(same_matrix(moved, a.transpose()));
+        moved = a * 2.0f - a;
+        REQUIRE(same_matrix(moved, a));
+    }
+    tortoiseSetHugePages(TortoiseHugePagesDefault);
+    REQUIRE(tortoiseHugePages() == TortoiseHugePagesOff);
+}
+
+TEST_CASE("Test Matrix Arena", "[TortoiseMatrix]") {
+    TortoiseMatrix<float> x = sequence_matrix<float>(16, 32, 1) * 0.1f;
+    TortoiseMatrix<float> w = sequence_matrix<float>(32, 24, 2) * 0.1f;
+    TortoiseMatrix<float> b = sequence_matrix<float>(1, 24, 3);
+    TortoiseMatrix<float> expected = x.dot(w).broadcast(b).tanh().transpose();
+
+    TortoiseMatrix<float> kept;
+    {
+        TortoiseMatrixArena scope;
+        REQUIRE(scope.reserved() == 0);
+        TortoiseMatrix<float> y = x.dot(w).broadcast(b).tanh().transpose();
+        REQUIRE(same_matrix(y, expected));
+        REQUIRE((std::size_t)y.data() % 64 == 0);
+        const std::size_t reserved = scope.reserved();
+        REQUIRE(reserved > 0);
+
+        // y holds on to the first chunk, so the loop moves to a second one,
+        // which its temporaries then keep reusing
+        bool same = true;
+        std::size_t steady = 0;
+        for (int i = 0; i < 2000; i++) {
+            TortoiseMatrix<float> h = x.dot(w).broadcast(b).tanh().transpose();
+            same = same && same_matrix(h, expected);
+            if (i == 999)
+                steady = scope.reserved();
+        }
+        REQUIRE(same);
+        REQUIRE(steady == 2 * reserved);
+        REQUIRE(scope.reserved() == steady);
+
+        {
+            TortoiseMatrixArena inner(1 << 16);
+            TortoiseMatrix<double> small(50, 50, 1.0);
+            REQUIRE(inner.reserved() >= 50 * 50 * sizeof(double));
+            REQUIRE(small.sum() == 2500.0);
+        }
+        REQUIRE(scope.reserved() == steady);
+
+        // large temporaries get chunks of their own, which are pooled when
+        // freed, so the loop keeps reusing one instead of piling them up
+        TortoiseMatrix<float> large(1024, 1024, 1.0f);
+        const float* first = 0;
+        bool reused = true;
+        for (int i = 0; i < 50; i++) {
+            TortoiseMatrix<float> t = large * 2.0f;
+            reused = reused && t(1023, 1023) == 2.0f && (i == 0 || t.data() == first);
+            first = t.data();
+        }
+        REQUIRE(reused);
+        REQUIRE(scope.reserved() == steady);
+        kept = y * 2.0f;
+    }
+    // a matrix that outlives its arena stays valid, also on another thread
+    REQUIRE(same_matrix(kept, TortoiseMatrix<float>(expected * 2.0f)));
+    std::thread([&kept] { TortoiseMatrix<float> moved = std::move(kept); }).join();
+    REQUIRE(kept.size() == 0);
+}
+
+TEST_CASE("Test Matrix Math-InPlace", "[TortoiseMatrix]") {
+    TortoiseMatrix<float> a = sequence_matrix<float>(33, 41, 1) * 0.1f;
+    TortoiseMatrix<float> positive = a.abs() + 0.5f;
+    TortoiseMatrix<float> unit = a * 0.1f;
+
+    TortoiseMatrix<float> out(33, 41);
+    const float* buffer = out.data();
+    REQUIRE(same_matrix(a.exp(out), TortoiseMatrix<float>(a.exp())));
+    REQUIRE(same_matrix(positive.log(out, TortoisePrecisionFast), TortoiseMatrix<float>(positive.log(TortoisePrecisionFast))));
+    REQUIRE(same_matrix(unit.asin(out), TortoiseMatrix<float>(unit.asin())));
+    REQUIRE(same_matrix(positive.pow(out, 1.5), TortoiseMatrix<float>(positive.pow(1.5))));
+    REQUIRE(same_matrix((a * 2.0f).tanh(out), TortoiseMatrix<float>((a * 2.0f).tanh())));
+    REQUIRE(out.data() == buffer);
+
+    TortoiseMatrix<float> m = a;
+    REQUIRE(same_matrix(m.tanhInPlace(), TortoiseMatrix<float>(a.tanh())));
+    m = positive;
+    REQUIRE(same_matrix(m.sqrtInPlace().log10InPlace(), TortoiseMatrix<float>(positive.sqrt().log10())));
+    m = unit;
+    REQUIRE(same_matrix(m.acosInPlace().cosInPlace(TortoisePrecisionFast),
+                        TortoiseMatrix<float>(unit.acos().cos(TortoisePrecisionFast))));
+    m = a;
+    REQUIRE(same_matrix(m.sinInPlace().sinhInPlace().coshInPlace(), TortoiseMatrix<float>(a.sin().sinh().cosh())));
+    m = unit;
+    REQUIRE(same_matrix(m.tanInPlace().atanInPlace().expInPlace(), TortoiseMatrix<float>(unit.tan().atan().exp())));
+    m = a;
+    REQUIRE(same_matrix(m.absInPlace().powInPlace(2.0).logInPlace(), TortoiseMatrix<float>(a.abs().pow(2.0).log())));
+    m = unit;
+    REQUIRE(same_matrix(m.asinInPlace(), TortoiseMatrix<float>(unit.asin())));
+
+    // the output can be an operand, and nothing is allocated
+    TortoiseMatrix<double> d = sequence_matrix<double>(20, 30, 2);
+    TortoiseMatrix<double> expected = (d * 0.5).tanh();
+    {
+        TortoiseMatrixArena scope;
+        (d * 0.5).tanh(d);
+        d.expInPlace().logInPlace();
+        REQUIRE(scope.reserved() == 0);
+    }
+    REQUIRE(close_matrix(d, expected, 1e-12));
+}
+
 TEST_CASE("Test Matrix Operator+", "[TortoiseMatrix]") {
     TortoiseMatrix<int> m1(2, 2, 1);
     TortoiseMatrix<int> m2(2, 2, 1);
@@ -308,6 +952,328 @@ TEST_CASE("Test Matrix Normalize)", "[TortoiseMatrix]") {
     REQUIRE(mat(1, 1) == 0.0);
 }
 
+TEST_CASE("Test Matrix Normalize-Large)", "[TortoiseMatrix]") {
+    auto mat = sequence_matrix<float>(517, 1031, 3);
+    mat.set(300, 17, -40.0f);
+    mat.set(12, 1030, 60.0f);
+    auto expected = mat;
+    for (int r = 0; r < mat.rows(); r++)
+        for (int c = 0; c < mat.cols(); c++)
+            expected.set(r, c, (mat(r, c) + 40.0f) * (1.0f / 100.0f));
+    mat.normalize();
+    REQUIRE(same_matrix(mat, expected));
+
+    TortoiseMatrix<int> ints(3, 3, 7);
+    ints.set(1, 1, 9);
+    ints.normalize();
+    REQUIRE(ints.sum() == 1);
+    REQUIRE(ints(1, 1) == 1);
+
+    TortoiseMatrix<double> constant(4, 4, 2.5);
+    constant.normalize();
+    REQUIRE(constant.max() == 0.0);
+
+    TortoiseMatrix<float> wide(0, 5), tall(3, 0);
+    wide.normalize();
+    tall.normalize();
+    REQUIRE(wide.rows() == 0);
+    REQUIRE(wide.cols() == 5);
+    REQUIRE(tall.rows() == 3);
+    REQUIRE(tall.cols() == 0);
+}
+
+/*
+  Per column normalization on a matrix split into several bands of rows
+*/
+TEST_CASE("Test Matrix normalizeColumns)", "[TortoiseMatrix]") {
+    auto mat = sequence_matrix<double>(700, 300, 5);
+    for (int r = 0; r < mat.rows(); r++) {
+        mat.set(r, 7, r * 0.5);
+        mat.set(r, 299, 3.0);
+    }
+    auto expected = mat;
+    for (int c = 0; c < mat.cols(); c++) {
+        auto column = mat.extract(c);
+        const double low = column.min(), high = column.max();
+        for (int r = 0; r < mat.rows(); r++)
+            expected.set(r, c, high == low ? 0.0 : (mat(r, c) - low) * (1.0 / (high - low)));
+    }
+    mat.normalizeColumns();
+    REQUIRE(same_matrix(mat, expected));
+    REQUIRE(mat(699, 7) == 1.0);
+    REQUIRE(mat.viewColumn(299).max() == 0.0);
+
+    std::valarray<std::valarray<int>> mock_data = {
+        {1, 10, 5},
+        {3, 20, 5},
+        {2, 30, 5},
+    };
+    TortoiseMatrix<int> ints(3, 3, mock_data);
+    ints.normalizeColumns();
+    REQUIRE(ints.sumCols()(0, 0) == 1);
+    REQUIRE(ints(1, 0) == 1);
+    REQUIRE(ints(2, 1) == 1);
+    REQUIRE(ints.sumCols()(0, 2) == 0);
+
+    TortoiseMatrix<float> wide(0, 5), tall(3, 0);
+    wide.normalizeColumns();
+    tall.normalizeColumns();
+    REQUIRE(wide.cols() == 5);
+    REQUIRE(tall.rows() == 3);
+    REQUIRE(tall.size() == 0);
+}
+
+/*
+  Dispatched kernels on sizes that leave vector and tile remainders
+*/
+TEST_CASE("Test Matrix Transpose-Large)", "[TortoiseMatrix]") {
+    auto f = sequence_matrix<float>(37, 53, 1);
+    auto d = sequence_matrix<double>(53, 37, 2);
+    auto ft = f.transpose();
+    auto dt = d.transpose();
+
+    REQUIRE(ft.rows() == 53);
+    REQUIRE(ft.cols() == 37);
+    bool same = true;
+    for (int r = 0; r < f.rows(); r++)
+        for (int c = 0; c < f.cols(); c++)
+            same = same && ft(c, r) == f(r, c);
+    for (int r = 0; r < d.rows(); r++)
+        for (int c = 0; c < d.cols(); c++)
+            same = same && dt(c, r) == d(r, c);
+    REQUIRE(same);
+}
+
+/*
+  Transposes beyond the cache sizes, with a column fringe and rows that
+  are not a multiple of the streamed panel height
+*/
+template <typename T>
+bool check_transpose(int rows, int cols)
+{
+    TortoiseMatrix<T> mat(rows, cols);
+    for (long i = 0; i < mat.size(); i++)
+        mat.data()[i] = (T)i;
+    auto t = mat.transpose();
+    if (t.rows() != cols || t.cols() != rows)
+        return false;
+    for (int r = 0; r < rows; r++)
+        for (int c = 0; c < cols; c++)
+            if (t(c, r) != mat(r, c))
+                return false;
+    return true;
+}
+
+TEST_CASE("Test Matrix Transpose-Huge)", "[TortoiseMatrix]") {
+    REQUIRE(check_transpose<float>(1040, 1100));
+    REQUIRE(check_transpose<float>(1100, 1037));
+    REQUIRE(check_transpose<double>(1032, 1030));
+    REQUIRE(check_transpose<double>(1027, 1031));
+    REQUIRE(check_transpose<int>(1030, 1029));
+}
+
+template <typename T>
+bool check_transpose_in_place(int rows, int cols)
+{
+    TortoiseMatrix<T> mat(rows, cols);
+    for (long i = 0; i < mat.size(); i++)
+        mat.data()[i] = (T)i;
+    TortoiseMatrix<T> t = mat;
+    t.transposeInPlace();
+    return same_matrix(t, mat.transpose());
+}
+
+TEST_CASE("Test Matrix TransposeInPlace)", "[TortoiseMatrix]") {
+    REQUIRE(check_transpose_in_place<float>(1, 1));
+    REQUIRE(check_transpose_in_place<float>(3, 3));
+    REQUIRE(check_transpose_in_place<float>(77, 77));
+    REQUIRE(check_transpose_in_place<double>(64, 64));
+    REQUIRE(check_transpose_in_place<double>(101, 101));
+    REQUIRE(check_transpose_in_place<int>(45, 45));
+    REQUIRE(check_transpose_in_place<float>(1, 17));
+    REQUIRE(check_transpose_in_place<float>(37, 53));
+    REQUIRE(check_transpose_in_place<double>(120, 7));
+    REQUIRE(check_transpose_in_place<int>(64, 32));
+    REQUIRE(check_transpose_in_place<float>(2, 1));
+    REQUIRE(check_transpose_in_place<double>(1000, 3));
+    REQUIRE(check_transpose_in_place<float>(211, 389));
+    REQUIRE(check_transpose_in_place<int>(6, 4));
+    REQUIRE(check_transpose_in_place<double>(12, 18));
+    REQUIRE(check_transpose_in_place<float>(96, 40));
+    REQUIRE(check_transpose_in_place<float>(1024, 3072));
+
+    // empty shapes only swap their dimensions
+    REQUIRE(check_transpose_in_place<float>(0, 5));
+    REQUIRE(check_transpose_in_place<float>(5, 0));
+    REQUIRE(check_transpose_in_place<double>(0, 0));
+    TortoiseMatrix<float> empty(0, 5);
+    empty.transposeInPlace();
+    REQUIRE(empty.rows() == 5);
+    REQUIRE(empty.cols() == 0);
+
+    TortoiseMatrix<double> mat(2, 3);
+    mat.set(0, 2, 5.0);
+    mat.transposeInPlace();
+    REQUIRE(mat.rows() == 3);
+    REQUIRE(mat.cols() == 2);
+    REQUIRE(mat(2, 0) == 5.0);
+}
+
+TEST_CASE("Test Matrix Reductions-Large)", "[TortoiseMatrix]") {
+    TortoiseMatrix<float> mat(13, 11, 1.0f);
+    mat.set(12, 10, -4.0f);
+    mat.set(12, 9, 9.0f);
+
+    REQUIRE(mat.sum() == 143 - 5 + 8);
+    REQUIRE(mat.min() == -4.0f);
+    REQUIRE(mat.max() == 9.0f);
+
+    auto root = (mat * mat).sqrt();
+    REQUIRE(root(12, 10) == 4.0f);
+    REQUIRE(mat.abs()(12, 10) == 4.0f);
+    REQUIRE(mat.div(2.0)(12, 9) == 2.0f / 9.0f);
+}
+
+/*
+  Reductions over many chunks: pairwise float sums stay accurate where a
+  running sum drifts, and every thread count gives the same bits
+*/
+TEST_CASE("Test Matrix Reductions-Parallel)", "[TortoiseMatrix]") {
+    TortoiseMatrix<float> mat(1000, 4099);
+    for (int r = 0; r < mat.rows(); r++)
+        for (int c = 0; c < mat.cols(); c++)
+            mat.set(r, c, 0.1f + (float)((r * 31 + c * 17) % 97) / 97.0f);
+    mat.set(517, 2049, -3.0f);
+    mat.set(999, 4098, 7.0f);
+    double exact = 0;
+    float running = 0;
+    for (int r = 0; r < mat.rows(); r++)
+        for (int c = 0; c < mat.cols(); c++) {
+            exact += mat(r, c);
+            running += mat(r, c);
+        }
+
+    tortoiseSetThreads(1);
+    const float sum = mat.sum();
+    const float min = mat.min();
+    const float max = mat.max();
+    const float expression_sum = (mat * 2.0f).sum();
+    REQUIRE(std::abs(sum - exact) < 1e-6 * exact);
+    REQUIRE(std::abs(sum - exact) < std::abs(running - exact));
+    REQUIRE(std::abs(expression_sum - 2 * exact) < 2e-6 * exact);
+    REQUIRE(min == -3.0f);
+    REQUIRE(max == 7.0f);
+    REQUIRE(mat.mean() == (double)sum / mat.size());
+
+    for (int threads = 2; threads <= 7; threads += 5) {
+        tortoiseSetThreads(threads);
+        REQUIRE(mat.sum() == sum);
+        REQUIRE((mat * 2.0f).sum() == expression_sum);
+        REQUIRE(mat.min() == min);
+        REQUIRE((mat * 2.0f).max() == 2 * max);
+    }
+    tortoiseSetThreads(0);
+
+    TortoiseMatrix<int> empty;
+    REQUIRE(empty.sum() == 0);
+}
+
+/*
+  Axis reductions against naive loops, with shapes that split the
+  columns into several panels and the rows into several bands
+*/
+TEST_CASE("Test Matrix Axis reductions)", "[TortoiseMatrix]") {
+    std::valarray<std::valarray<int>> mock_data = {
+        {3, 1, 3},
+        {4, 9, 2},
+        {0, 9, 0},
+    };
+    TortoiseMatrix<int> small(3, 3, mock_data);
+
+    auto rows = small.sumRows();
+    REQUIRE(rows.rows() == 3);
+    REQUIRE(rows.cols() == 1);
+    REQUIRE(rows(0, 0) == 7);
+    REQUIRE(rows(1, 0) == 15);
+    REQUIRE(rows(2, 0) == 9);
+    auto cols = small.sumCols();
+    REQUIRE(cols.rows() == 1);
+    REQUIRE(cols.cols() == 3);
+    REQUIRE(cols(0, 0) == 7);
+    REQUIRE(cols(0, 1) == 19);
+    REQUIRE(cols(0, 2) == 5);
+    REQUIRE(small.minAxis(TortoiseAxisCols)(0, 1) == 1);
+    REQUIRE(small.maxAxis(TortoiseAxisRows)(1, 0) == 9);
+    REQUIRE(small.meanAxis(TortoiseAxisRows)(1, 0) == 5);
+    // ties give the first index
+    REQUIRE(small.argmax(TortoiseAxisRows)(0, 0) == 0);
+    REQUIRE(small.argmax(TortoiseAxisCols)(0, 1) == 1);
+    REQUIRE(small.argmin(TortoiseAxisRows)(2, 0) == 0);
+    REQUIRE(small.argmin(TortoiseAxisCols)(0, 2) == 2);
+
+    TortoiseMatrix<double> mat(700, 1500);
+    for (int r = 0; r < mat.rows(); r++)
+        for (int c = 0; c < mat.cols(); c++)
+            mat.set(r, c, (double)((r * 37 + c * 11) % 1009) - 500);
+
+    tortoiseSetThreads(1);
+    auto sum_rows = (mat * 2.0).sumRows();
+    auto sum_cols = (mat * 2.0).sumCols();
+    auto mean_cols = mat.meanAxis(TortoiseAxisCols);
+    auto min_cols = mat.minAxis(TortoiseAxisCols);
+    auto max_rows = mat.maxAxis(TortoiseAxisRows);
+    auto argmin_cols = mat.argmin(TortoiseAxisCols);
+    auto argmax_rows = (mat * -1.0).argmax(TortoiseAxisRows);
+
+    TortoiseMatrix<double> expected_rows(mat.rows(), 1), expected_max(mat.rows(), 1);
+    TortoiseMatrix<int> expected_argmax(mat.rows(), 1);
+    for (int r = 0; r < mat.rows(); r++) {
+        double sum = 0;
+        int at = 0;
+        for (int c = 0; c < mat.cols(); c++) {
+            sum += 2 * mat(r, c);
+            if (-mat(r, c) > -mat(r, at))
+                at = c;
+        }
+        expected_rows.set(r, 0, sum);
+        expected_max.set(r, 0, mat.viewRows(r, 1).max());
+        expected_argmax.set(r, 0, at);
+    }
+    REQUIRE(same_matrix(sum_rows, expected_rows));
+    REQUIRE(same_matrix(max_rows, expected_max));
+    REQUIRE(same_matrix(argmax_rows, expected_argmax));
+
+    TortoiseMatrix<double> expected_cols(1, mat.cols()), expected_mean(1, mat.cols()), expected_min(1, mat.cols());
+    TortoiseMatrix<int> expected_argmin(1, mat.cols());
+    for (int c = 0; c < mat.cols(); c++) {
+        double sum = 0;
+        int at = 0;
+        for (int r = 0; r < mat.rows(); r++) {
+            sum += mat(r, c);
+            if (mat(r, c) < mat(at, c))
+                at = r;
+        }
+        expected_cols.set(0, c, 2 * sum);
+        expected_mean.set(0, c, sum / mat.rows());
+        expected_min.set(0, c, mat(at, c));
+        expected_argmin.set(0, c, at);
+    }
+    REQUIRE(same_matrix(sum_cols, expected_cols));
+    REQUIRE(same_matrix(mean_cols, expected_mean));
+    REQUIRE(same_matrix(min_cols, expected_min));
+    REQUIRE(same_matrix(argmin_cols, expected_argmin));
+
+    tortoiseSetThreads(7);
+    REQUIRE(same_matrix((mat * 2.0).sumCols(), sum_cols));
+    REQUIRE(same_matrix(mat.argmin(TortoiseAxisCols), argmin_cols));
+    REQUIRE(same_matrix((mat * -1.0).argmax(TortoiseAxisRows), argmax_rows));
+    tortoiseSetThreads(0);
+
+    TortoiseMatrix<float> empty(0, 4);
+    REQUIRE(empty.sumCols().cols() == 4);
+    REQUIRE(empty.sumCols()(0, 3) == 0);
+}
+
 TEST_CASE("Test Matrix broadcast add)", "[TortoiseMatrix]") {
     TortoiseMatrix<int> mat1(2, 2, 2);
     TortoiseMatrix<int> mat2(1, 2, 5);
@@ -341,6 +1307,165 @@ TEST_CASE("Test Matrix broadcast multiply)", "[TortoiseMatrix]") {
     REQUIRE(result(1, 1) == 10);
 }
 
+TEST_CASE("Test Matrix broadcast divide)", "[TortoiseMatrix]") {
+    TortoiseMatrix<int> mat1(2, 2, 10);
+    TortoiseMatrix<int> mat2(1, 2, 5);
+    mat2.set(0, 1, 2);
+    auto result = mat1.bDivide(mat2);
+
+    REQUIRE(result(0, 0) == 2);
+    REQUIRE(result(0, 1) == 5);
+    REQUIRE(result(1, 0) == 2);
+    REQUIRE(result(1, 1) == 5);
+}
+
+/*
+  Column and [1, 1] operands, and the in place variants on a matrix with
+  rows longer than one expression block
+*/
+TEST_CASE("Test Matrix broadcast column and in place)", "[TortoiseMatrix]") {
+    TortoiseMatrix<int> mat(2, 3, 6);
+    TortoiseMatrix<int> column(2, 1, 1);
+    column.set(1, 0, 3);
+    TortoiseMatrix<int> result = mat.bDivide(column);
+    REQUIRE(result(0, 2) == 6);
+    REQUIRE(result(1, 0) == 2);
+    result = mat.bSubtract(TortoiseMatrix<int>(1, 1, 4));
+    REQUIRE(result.min() == 2);
+    REQUIRE(result.max() == 2);
+
+    auto a = sequence_matrix<float>(300, 1100, 1);
+    TortoiseMatrix<float> row = sequence_matrix<float>(1, 1100, 2) + 7.0f;
+    TortoiseMatrix<float> col = sequence_matrix<float>(300, 1, 3) + 7.0f;
+    TortoiseMatrix<float> expected(300, 1100);
+    for (int r = 0; r < a.rows(); r++)
+        for (int c = 0; c < a.cols(); c++)
+            expected.set(r, c, (a(r, c) + row(0, c)) * col(r, 0) - 0.5f);
+    REQUIRE(same_matrix(a.broadcast(row).bMultiply(col).bSubtract(TortoiseMatrix<float>(1, 1, 0.5f)).eval(), expected));
+
+    auto b = a;
+    b.broadcastInPlace(row).bMultiplyInPlace(col).bSubtractInPlace(TortoiseMatrix<float>(1, 1, 0.5f));
+    REQUIRE(same_matrix(b, expected));
+    b.bDivideInPlace(col);
+    REQUIRE(same_matrix(b, a.broadcast(row).bMultiply(col).bSubtract(TortoiseMatrix<float>(1, 1, 0.5f)).bDivide(col).eval()));
+}
+
+/*
+  The broadcast operand can be a view of the matrix assigned to
+*/
+TEST_CASE("Test Matrix broadcast of a view)", "[TortoiseMatrix]") {
+    auto m = sequence_matrix<double>(600, 3, 1);
+    TortoiseMatrix<double> expected = m.bSubtract(m.extract(0, 1));
+    m = m.bSubtract(m.viewRows(0, 1));
+    REQUIRE(same_matrix(m, expected));
+
+    m = sequence_matrix<double>(600, 3, 1);
+    expected = (m * 2.0).broadcast(m.viewRows(599, 1)).exp();
+    m = (m * 2.0).broadcast(m.viewRows(599, 1)).exp();
+    REQUIRE(same_matrix(m, expected));
+
+    // a column view is strided, and a block ends inside a row
+    TortoiseMatrix<double> n = sequence_matrix<double>(600, 3, 2) + 11.0;
+    expected = n.bDivide(n.extract(0));
+    REQUIRE(same_matrix(n.bDivide(n.viewColumn(0)).eval(), expected));
+    n = n.bDivide(n.viewColumn(0));
+    REQUIRE(same_matrix(n, expected));
+
+    m = sequence_matrix<double>(600, 3, 1);
+    expected = m + m.broadcast(m.extract(0, 1));
+    m += m.broadcast(m.viewRows(0, 1));
+    REQUIRE(same_matrix(m, expected));
+
+    n = sequence_matrix<double>(600, 3, 2) + 11.0;
+    expected = n * n.bMultiply(n.extract(2));
+    n *= n.bMultiply(n.viewColumn(2));
+    REQUIRE(same_matrix(n, expected));
+    expected = n - n.bSubtract(n.extract(1)) / 2.0;
+    n -= n.bSubtract(n.viewColumn(1)) / 2.0;
+    REQUIRE(same_matrix(n, expected));
+    expected = n / n.bDivide(n.extract(599, 1)).abs();
+    n /= n.bDivide(n.viewRows(599, 1)).abs();
+    REQUIRE(same_matrix(n, expected));
+}
+
+/*
+  Chained operators are fused into one lazy expression
+*/
+TEST_CASE("Test Matrix Expression)", "[TortoiseMatrix]") {
+    auto a = sequence_matrix<double>(41, 37, 1);
+    auto b = sequence_matrix<double>(41, 37, 2);
+    auto c = sequence_matrix<double>(41, 37, 3);
+    TortoiseMatrix<double> d(41, 37, 4.0);
+    auto bias = sequence_matrix<double>(1, 37, 5);
+
+    TortoiseMatrix<double> result = ((a * b + c) / d).broadcast(bias).tanh() * 2.0;
+
+    REQUIRE(result.rows() == 41);
+    REQUIRE(result.cols() == 37);
+    bool same = true;
+    for (int r = 0; r < a.rows(); r++)
+        for (int k = 0; k < a.cols(); k++) {
+            double expected = std::tanh((a(r, k) * b(r, k) + c(r, k)) / 4.0 + bias(0, k)) * 2.0;
+            same = same && result(r, k) == Approx(expected);
+        }
+    REQUIRE(same);
+
+    auto lazy = a - b;
+    REQUIRE(lazy(3, 4) == a(3, 4) - b(3, 4));
+    REQUIRE(lazy.sum() == Approx(a.sum() - b.sum()));
+
+    // the destination appears on the right hand side
+    TortoiseMatrix<double> acc = a;
+    acc = b * c + acc;
+    REQUIRE(acc(40, 36) == b(40, 36) * c(40, 36) + a(40, 36));
+
+    acc += a * 2.0;
+    REQUIRE(acc(7, 8) == Approx(b(7, 8) * c(7, 8) + 3 * a(7, 8)));
+}
+
+TEST_CASE("Test Matrix Move)", "[TortoiseMatrix]") {
+    auto x = sequence_matrix<double>(29, 17, 1);
+    auto w = sequence_matrix<double>(17, 23, 2);
+    auto b = sequence_matrix<double>(29, 23, 3);
+    auto bias = sequence_matrix<double>(1, 23, 4);
+
+    TortoiseMatrix<double> xw = x.dot(w);
+
+    // the expressions own the dot results, nothing dangles
+    auto lazy = (x.dot(w) + b).tanh();
+    auto row = (x.dot(w) * 0.5).broadcast(bias.transpose().transpose());
+    TortoiseMatrix<double> y = lazy;
+    TortoiseMatrix<double> z = std::move(row);
+
+    bool same = true;
+    for (int r = 0; r < xw.rows(); r++)
+        for (int k = 0; k < xw.cols(); k++) {
+            same = same && y(r, k) == Approx(std::tanh(xw(r, k) + b(r, k)));
+            same = same && z(r, k) == Approx(xw(r, k) * 0.5 + bias(0, k));
+        }
+    REQUIRE(same);
+
+    // materializing a temporary expression writes over the owned result
+    TortoiseMatrix<double> fused = (x.dot(w) + b).tanh();
+    REQUIRE(same_matrix(fused, y));
+    TortoiseMatrix<double> owned = x.dot(w);
+    const double* storage = owned.data();
+    TortoiseMatrix<double> reused = (std::move(owned) + b).tanh();
+    REQUIRE(reused.data() == storage);
+    REQUIRE(same_matrix(reused, y));
+    fused = (x.dot(w) - b).eval();
+    REQUIRE(fused(5, 6) == Approx(xw(5, 6) - b(5, 6)));
+
+    TortoiseMatrix<double> moved = std::move(fused);
+    REQUIRE(moved.rows() == 29);
+    REQUIRE(moved.cols() == 23);
+    REQUIRE(fused.size() == 0);
+
+    fused = std::move(moved);
+    REQUIRE(fused(5, 6) == Approx(xw(5, 6) - b(5, 6)));
+    REQUIRE(moved.size() == 0);
+}
+
 TEST_CASE("Test Matrix abs)", "[TortoiseMatrix]") {
     TortoiseMatrix<int> mat(2, 2, 2);
     mat.set(0, 0, -1);
@@ -373,6 +1498,103 @@ TEST_CASE("Test Matrix sqrt)", "[TortoiseMatrix]") {
     REQUIRE(result(1, 1) == 4);
 }
 
+/*
+  Vectorized math against libm across the polynomial ranges, vector
+  tails and the special values handed back to libm
+*/
+template <typename T>
+TortoiseMatrix<T> range_matrix(T lo, T hi)
+{
+    TortoiseMatrix<T> mat(5, 67);
+    const long n = mat.size() - 1;
+    for (int r = 0; r < mat.rows(); r++)
+        for (int c = 0; c < mat.cols(); c++)
+            mat.set(r, c, lo + (hi - lo) * (T)(r * mat.cols() + c) / (T)n);
+    return mat;
+}
+
+template <typename T>
+TortoiseMatrix<T> special_matrix()
+{
+    const T values[] = { std::numeric_limits<T>::quiet_NaN(), std::numeric_limits<T>::infinity(),
+                         -std::numeric_limits<T>::infinity(), 0, -(T)0, std::numeric_limits<T>::denorm_min(),
+                         std::numeric_limits<T>::min() / 2, std::numeric_limits<T>::max(), (T)1e30, (T)-1e30,
+                         (T)1e6, (T)-1e6, 100, -100, 1000, -1000, 1, -1 };
+    const int n = sizeof(values) / sizeof(values[0]);
+    TortoiseMatrix<T> mat(1, n);
+    for (int c = 0; c < n; c++)
+        mat.set(0, c, values[c]);
+    return mat;
+}
+
+template <int Function, typename T>
+bool matches_libm(const TortoiseMatrix<T>& result, const TortoiseMatrix<T>& mat, T tolerance)
+{
+    for (int r = 0; r < mat.rows(); r++)
+        for (int c = 0; c < mat.cols(); c++) {
+            const T value = result(r, c);
+            const T expected = tortoise_detail::scalar_math<Function>(mat(r, c));
+            if (std::isnan(expected) ? !std::isnan(value) :
+                std::isinf(expected) || expected == 0 ? value != expected :
+                std::abs(value - expected) > tolerance * std::abs(expected))
+                return false;
+        }
+    return true;
+}
+
+template <typename T>
+void check_math(TortoisePrecision precision, T tolerance)
+{
+    using namespace tortoise_detail;
+    const TortoiseMatrix<T> wide = range_matrix<T>(-80, 80);
+    const TortoiseMatrix<T> narrow = range_matrix<T>(-3, 3);
+    const TortoiseMatrix<T> positive = range_matrix<T>((T)1e-3, (T)1e3);
+    const TortoiseMatrix<T> special = special_matrix<T>();
+
+    REQUIRE(matches_libm<MATH_EXP>(wide.exp(precision).eval(), wide, tolerance));
+    REQUIRE(matches_libm<MATH_EXP>(special.exp(precision).eval(), special, tolerance));
+    REQUIRE(matches_libm<MATH_LOG>(positive.log(precision).eval(), positive, tolerance));
+    REQUIRE(matches_libm<MATH_LOG>(special.log(precision).eval(), special, tolerance));
+    REQUIRE(matches_libm<MATH_LOG10>(positive.log10(precision).eval(), positive, tolerance));
+    REQUIRE(matches_libm<MATH_LOG10>(special.log10(precision).eval(), special, tolerance));
+    REQUIRE(matches_libm<MATH_SIN>(wide.sin(precision).eval(), wide, tolerance));
+    REQUIRE(matches_libm<MATH_SIN>(special.sin(precision).eval(), special, tolerance));
+    REQUIRE(matches_libm<MATH_COS>(wide.cos(precision).eval(), wide, tolerance));
+    REQUIRE(matches_libm<MATH_COS>(special.cos(precision).eval(), special, tolerance));
+    REQUIRE(matches_libm<MATH_SINH>(wide.sinh(precision).eval(), wide, tolerance));
+    REQUIRE(matches_libm<MATH_SINH>(narrow.sinh(precision).eval(), narrow, tolerance));
+    REQUIRE(matches_libm<MATH_SINH>(special.sinh(precision).eval(), special, tolerance));
+    REQUIRE(matches_libm<MATH_COSH>(wide.cosh(precision).eval(), wide, tolerance));
+    REQUIRE(matches_libm<MATH_COSH>(special.cosh(precision).eval(), special, tolerance));
+    REQUIRE(matches_libm<MATH_TANH>(narrow.tanh(precision).eval(), narrow, tolerance));
+    REQUIRE(matches_libm<MATH_TANH>(special.tanh(precision).eval(), special, tolerance));
+}
+
+TEST_CASE("Test Matrix math functions)", "[TortoiseMatrix]") {
+    check_math<float>(TortoisePrecisionAccurate, 4 * std::numeric_limits<float>::epsilon());
+    check_math<float>(TortoisePrecisionFast, 16 * std::numeric_limits<float>::epsilon());
+    check_math<double>(TortoisePrecisionAccurate, 4 * std::numeric_limits<double>::epsilon());
+    check_math<double>(TortoisePrecisionFast, 32 * std::numeric_limits<double>::epsilon());
+
+    // in place and through an expression chain
+    TortoiseMatrix<double> mat = range_matrix<double>(-3, 3);
+    const TortoiseMatrix<double> expected = (mat * 2.0).tanh();
+    mat = (mat * 2.0).tanh();
+    REQUIRE(same_matrix(mat, expected));
+
+    REQUIRE(tortoisePrecision() == TortoisePrecisionAccurate);
+    const TortoiseMatrix<float> wide = range_matrix<float>(-80, 80);
+    const TortoiseMatrix<float> fast = wide.exp(TortoisePrecisionFast);
+    const TortoiseMatrix<float> accurate = wide.exp(TortoisePrecisionAccurate);
+    REQUIRE(same_matrix<float>(wide.exp(), accurate));
+    tortoiseSetPrecision(TortoisePrecisionFast);
+    REQUIRE(tortoisePrecision() == TortoisePrecisionFast);
+    REQUIRE(same_matrix<float>(wide.exp(), fast));
+    REQUIRE(same_matrix<float>(wide.exp(TortoisePrecisionAccurate), accurate));
+    tortoiseSetPrecision(TortoisePrecisionDefault);
+    REQUIRE(tortoisePrecision() == TortoisePrecisionAccurate);
+}
+
 TEST_CASE("Test Matrix extract row)", "[TortoiseMatrix]") {
     TortoiseMatrix<int> mat(2, 2, 2);
     auto row1 = mat.extract(0, 1);
@@ -421,3 +1643,44 @@ TEST_CASE("Test Matrix extract column)", "[TortoiseMatrix]") {
     REQUIRE(col2(0, 0) == 2);
     REQUIRE(col2(1, 0) == 4);
 }
+
+/*
+  Test row, column and block views
+*/
+TEST_CASE("Test Matrix views)", "[TortoiseMatrix]") {
+    auto mat = sequence_matrix<double>(40, 30, 1);
+    auto w = sequence_matrix<double>(30, 20, 2);
+
+    auto batch = mat.viewRows(8, 16);
+    REQUIRE(batch.rows() == 16);
+    REQUIRE(batch.cols() == 30);
+    REQUIRE(batch.data() == mat.data() + 8 * 30);
+    REQUIRE(batch(3, 4) == mat(11, 4));
+    REQUIRE(same_matrix(batch.dot(w), mat.extract(8, 16).dot(w)));
+    REQUIRE(batch.sum() == Approx(mat.extract(8, 16).sum()));
+
+    auto col = mat.viewColumn(7);
+    REQUIRE(col.rows() == 40);
+    REQUIRE(col.cols() == 1);
+    REQUIRE(col(39, 0) == mat(39, 7));
+    REQUIRE(same_matrix(col.copy(), mat.extract(7)));
+    REQUIRE(col.max() == mat.extract(7).max());
+
+    auto block = mat.viewBlock(5, 3, 17, 13);
+    auto copied = block.copy();
+    REQUIRE(copied.rows() == 17);
+    REQUIRE(copied.cols() == 13);
+    bool same = true;
+    for (int r = 0; r < 17; r++)
+        for (int k = 0; k < 13; k++)
+            same = same && copied(r, k) == mat(r + 5, k + 3);
+    REQUIRE(same);
+
+    // strided operands of dot and elementwise expressions
+    auto wblock = w.viewBlock(2, 1, 13, 9);
+    REQUIRE(same_matrix(block.dot(wblock), copied.dot(wblock.copy())));
+    REQUIRE(same_matrix(copied.dot(wblock), copied.dot(wblock.copy())));
+    TortoiseMatrix<double> result = block * 2.0 + copied;
+    REQUIRE(result(16, 12) == Approx(3 * mat(21, 15)));
+    REQUIRE(block.mean() == Approx(copied.mean()));
+}
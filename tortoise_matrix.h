@@ -4,685 +4,7382 @@
 #include <valarray>
 #include <algorithm>
 #include <string>
+#include <cstddef>
+#include <cstdlib>
+#include <cmath>
+#include <vector>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <atomic>
+#include <functional>
+#include <exception>
+#include <type_traits>
+#include <utility>
+#include <new>
+#include <initializer_list>
+#include <limits>
 #include <assert.h>
 
+/*
+ * Large matrices can be backed by huge pages on Linux, see
+ * TortoiseHugePages
+ */
+#if defined(__linux__)
+#define TT_HUGE_PAGES
+#include <sys/mman.h>
+#endif
+
+/*
+ * x86 SIMD kernels are compiled for every ISA through target attributes
+ * and picked at first use from cpuid, independent of the -m flags of the
+ * including translation unit. Define TT_NO_SIMD to build only the
+ * portable scalar kernels.
+ */
+#if (defined(__GNUC__) || defined(__clang__)) && (defined(__x86_64__) || defined(__i386__)) && !defined(TT_NO_SIMD)
+#define TT_X86_SIMD
+#include <immintrin.h>
+#define TT_TARGET_SSE2 __attribute__((target("sse2")))
+#define TT_TARGET_AVX2 __attribute__((target("avx2,fma")))
+#define TT_TARGET_AVX512 __attribute__((target("avx512f,avx2,fma")))
+#define TT_SIMD_INLINE inline __attribute__((always_inline))
+#endif
+
+#if defined(__GNUC__)
+#define TT_UNROLL _Pragma("GCC unroll 16")
+#define TT_ALIGN(n) __attribute__((aligned(n)))
+#else
+#define TT_UNROLL
+#define TT_ALIGN(n) __declspec(align(n))
+#endif
+
+namespace tortoise_detail {
+
+/*
+ * Strided view over row-major (or any) storage used by the kernels.
+ * Element (r, c) lives at data[r * rs + c * cs].
+ */
+template <typename T>
+struct ConstMatrixRef
+{
+	const T* data;
+	int rows;
+	int cols;
+	long rs;
+	long cs;
+};
+
+template <typename T>
+struct MatrixRef
+{
+	T* data;
+	int rows;
+	int cols;
+	long rs;
+	long cs;
+};
+
+/*
+ * 64 byte aligned scratch memory for the packed GEMM panels
+ */
 template <typename T>
-class TortoiseMatrix
+class PackBuffer
 {
 public:
-	TortoiseMatrix<T>();
-	TortoiseMatrix<T>(int rows, int cols);
-	TortoiseMatrix<T>(int rows, int cols, const T&);
-	TortoiseMatrix<T>(int rows, int cols, const std::valarray<std::valarray<T>>& mat);
-	TortoiseMatrix<T>(const TortoiseMatrix<T>& mat);
+	explicit PackBuffer(std::size_t count)
+	: m_raw(new char[count * sizeof(T) + 64])
+	{
+		std::size_t address = reinterpret_cast<std::size_t>(m_raw);
+		m_data = reinterpret_cast<T*>((address + 63) & ~std::size_t(63));
+	}
+	~PackBuffer() { delete[] m_raw; }
 
-	/*
-	 * Access specific element by row and column
-	 */
-	T operator()(int row, int col) const;
+	T* data() { return m_data; }
 
-	long size() const;
+private:
+	PackBuffer(const PackBuffer&);
+	PackBuffer& operator=(const PackBuffer&);
 
-	TortoiseMatrix<T>& operator=(const TortoiseMatrix<T>& mat);
-	TortoiseMatrix<T>& operator=(const T& value);
+	char* m_raw;
+	T* m_data;
+};
 
-	TortoiseMatrix<T> operator+(const TortoiseMatrix<T>& mat);
-	TortoiseMatrix<T> operator-(const TortoiseMatrix<T>& mat);
-	TortoiseMatrix<T> operator*(const TortoiseMatrix<T>& mat);
-	TortoiseMatrix<T> operator/(const TortoiseMatrix<T>& mat);
+/*
+ * Persistent worker threads shared by every parallel kernel.
+ *
+ * run() hands out task indices through an atomic counter; the calling
+ * thread works alongside the pool and returns once every task is done.
+ * Workers are started lazily on the first parallel call. Calls made from
+ * inside a task, or while another thread owns the pool, run inline. The
+ * first exception thrown by a task cancels the tasks not yet started and
+ * is rethrown by run() once the others are done.
+ */
+class ThreadPool
+{
+public:
+	static ThreadPool& instance()
+	{
+		static ThreadPool pool;
+		return pool;
+	}
 
-	TortoiseMatrix<T> operator+(const T& value);
-	TortoiseMatrix<T> operator-(const T& value);
-	TortoiseMatrix<T> operator*(const T& value);
-	TortoiseMatrix<T> operator/(const T& value);
+	~ThreadPool() { stop(); }
 
 	/*
-	  Adds the row of the mat to all rows of this matrix
-	*/
-	TortoiseMatrix<T> broadcast(TortoiseMatrix<T>& mat);
-	/*
-	  Subtracts the row of the mat from all rows of this matrix
-	*/
-	TortoiseMatrix<T> bSubtract(TortoiseMatrix<T>& mat);
+	 * Number of threads taking part in run(), including the caller
+	 */
+	int threads() const { return m_threads; }
+
 	/*
-	  Multiplies the row of the mat with all rows of this matrix
-	*/
-	TortoiseMatrix<T> bMultiply(TortoiseMatrix<T>& mat);
+	 * 0 picks std::thread::hardware_concurrency()
+	 */
+	void setThreads(int threads)
+	{
+		std::lock_guard<std::mutex> submit(m_submit);
+		stop();
+		m_threads = (threads > 0) ? threads : defaultThreads();
+	}
 
-	// reverse order divide (eg. value / matrix)
-	TortoiseMatrix<T> div(double);
+	template <typename F>
+	void run(int tasks, const F& f)
+	{
+		if (tasks <= 0)
+			return;
+
+		std::unique_lock<std::mutex> submit(m_submit, std::try_to_lock);
+		if (tasks == 1 || m_threads <= 1 || insideTask() || !submit.owns_lock()) {
+			for (int i = 0; i < tasks; i++)
+				f(i);
+			return;
+		}
 
-	TortoiseMatrix<T>& operator+=(const TortoiseMatrix<T>& mat);
-	TortoiseMatrix<T>& operator-=(const TortoiseMatrix<T>& mat);
-	TortoiseMatrix<T>& operator*=(const TortoiseMatrix<T>& mat);
-	TortoiseMatrix<T>& operator/=(const TortoiseMatrix<T>& mat);
+		start();
 
-	void resize(int rows, int cols);
+		const std::function<void(int)> job(std::cref(f));
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_job = &job;
+			m_tasks = tasks;
+			m_next = 0;
+			m_active = (int)m_workers.size();
+			m_generation++;
+		}
+		m_wake.notify_all();
+
+		work(job, tasks);
+
+		std::unique_lock<std::mutex> lock(m_mutex);
+		m_done.wait(lock, [this] { return m_active == 0; });
+		m_job = 0;
+		std::exception_ptr error = m_error;
+		m_error = std::exception_ptr();
+		lock.unlock();
+		if (error)
+			std::rethrow_exception(error);
+	}
+
+private:
+	ThreadPool()
+	: m_threads(defaultThreads()), m_job(0), m_tasks(0), m_next(0), m_active(0),
+	  m_generation(0), m_stop(false)
+	{
+	}
+
+	ThreadPool(const ThreadPool&);
+	ThreadPool& operator=(const ThreadPool&);
+
+	static int defaultThreads()
+	{
+		const char* env = std::getenv("TORTOISE_NUM_THREADS");
+		if (env && std::atoi(env) > 0)
+			return std::atoi(env);
+		const unsigned hardware = std::thread::hardware_concurrency();
+		return hardware ? (int)hardware : 1;
+	}
+
+	static bool& insideTask()
+	{
+		static thread_local bool inside = false;
+		return inside;
+	}
 
 	/*
-	 * Set value to the individual position in the matrix
+	 * Marks the thread as running tasks until the end of the scope
 	 */
-	void set(int row, int col, const T&);
+	struct TaskScope
+	{
+		TaskScope() { insideTask() = true; }
+		~TaskScope() { insideTask() = false; }
+	};
+
+	void start()
+	{
+		if ((int)m_workers.size() == m_threads - 1)
+			return;
+		for (int i = (int)m_workers.size(); i < m_threads - 1; i++)
+			m_workers.push_back(std::thread(&ThreadPool::loop, this, m_generation));
+	}
+
+	void stop()
+	{
+		{
+			std::lock_guard<std::mutex> lock(m_mutex);
+			m_stop = true;
+		}
+		m_wake.notify_all();
+		for (std::size_t i = 0; i < m_workers.size(); i++)
+			m_workers[i].join();
+		m_workers.clear();
+		m_stop = false;
+	}
+
+	void work(const std::function<void(int)>& job, int tasks)
+	{
+		TaskScope scope;
+		for (int i = m_next++; i < tasks; i = m_next++) {
+			try {
+				job(i);
+			}
+			catch (...) {
+				m_next = tasks;
+				std::lock_guard<std::mutex> lock(m_mutex);
+				if (!m_error)
+					m_error = std::current_exception();
+			}
+		}
+	}
+
+	void loop(unsigned seen)
+	{
+		for (;;) {
+			std::unique_lock<std::mutex> lock(m_mutex);
+			m_wake.wait(lock, [&] { return m_stop || m_generation != seen; });
+			if (m_stop)
+				return;
+			seen = m_generation;
+			const std::function<void(int)>* job = m_job;
+			const int tasks = m_tasks;
+			lock.unlock();
+
+			work(*job, tasks);
+
+			lock.lock();
+			if (--m_active == 0)
+				m_done.notify_all();
+		}
+	}
+
+	std::atomic<int> m_threads;
+	std::vector<std::thread> m_workers;
+
+	std::mutex m_submit;
+	std::mutex m_mutex;
+	std::condition_variable m_wake;
+	std::condition_variable m_done;
+
+	const std::function<void(int)>* m_job;
+	int m_tasks;
+	std::atomic<int> m_next;
+	int m_active;
+	unsigned m_generation;
+	bool m_stop;
+	std::exception_ptr m_error;
+};
 
 /*
-	 * Set value to the all positions in the matrix
-	 */
-	void set(const T&);
+ * Instruction sets the dispatched kernels are built for
+ */
+enum SimdLevel
+{
+	SIMD_SCALAR = 0,
+	SIMD_SSE2,
+	SIMD_AVX2,
+	SIMD_AVX512
+};
 
-	/*
-	 * Transpose of the matrix
-	 */
-	TortoiseMatrix<T> transpose() const;
+/*
+ * Probes cpuid once. TORTOISE_SIMD=scalar|sse2|avx2|avx512 caps the
+ * result, which is handy to compare kernels on one machine.
+ */
+inline SimdLevel detect_simd_level()
+{
+	SimdLevel level = SIMD_SCALAR;
+#if defined(TT_X86_SIMD)
+	__builtin_cpu_init();
+	if (__builtin_cpu_supports("sse2"))
+		level = SIMD_SSE2;
+	if (level == SIMD_SSE2 && __builtin_cpu_supports("avx2") && __builtin_cpu_supports("fma"))
+		level = SIMD_AVX2;
+	if (level == SIMD_AVX2 && __builtin_cpu_supports("avx512f"))
+		level = SIMD_AVX512;
+#endif
 
-	/*
-	 * Dot product
-	 */
-	TortoiseMatrix<T> dot(const TortoiseMatrix<T>& mat) const;
-	TortoiseMatrix<T> dot2(const TortoiseMatrix<T>& mat);
+	const char* env = std::getenv("TORTOISE_SIMD");
+	if (env) {
+		const std::string name(env);
+		SimdLevel cap = SIMD_AVX512;
+		if (name == "scalar")
+			cap = SIMD_SCALAR;
+		else if (name == "sse2")
+			cap = SIMD_SSE2;
+		else if (name == "avx2")
+			cap = SIMD_AVX2;
+		level = std::min(level, cap);
+	}
+	return level;
+}
 
-	// experimental only! 4 times slower than dot 
-	TortoiseMatrix<T> dotTemp(const TortoiseMatrix<T>& mat);
+inline SimdLevel simd_level()
+{
+	static const SimdLevel level = detect_simd_level();
+	return level;
+}
 
-	TortoiseMatrix<T> abs() const;
-	TortoiseMatrix<T> exp() const;
-	TortoiseMatrix<T> log() const;
-	TortoiseMatrix<T> log10() const;
+enum ElementOp
+{
+	OP_ADD,
+	OP_SUB,
+	OP_MUL,
+	OP_DIV,
+	OP_MIN,
+	OP_MAX,
+	OP_ABS,
+	OP_SQRT
+};
 
-	TortoiseMatrix<T> pow(double) const;
-	TortoiseMatrix<T> sqrt() const;
+template <int Op, typename T>
+inline T scalar_op(T a, T b)
+{
+	switch (Op) {
+	case OP_ADD: return a + b;
+	case OP_SUB: return a - b;
+	case OP_MUL: return a * b;
+	case OP_DIV: return a / b;
+	case OP_MIN: return b < a ? b : a;
+	default: return a < b ? b : a;
+	}
+}
 
-	TortoiseMatrix<T> sin() const;
-	TortoiseMatrix<T> cos() const;
-	TortoiseMatrix<T> tan() const;
-	TortoiseMatrix<T> asin() const;
-	TortoiseMatrix<T> acos() const;
-	TortoiseMatrix<T> atan() const;
-	TortoiseMatrix<T> atan2() const;
+template <int Op, typename T>
+inline T scalar_op(T a)
+{
+	if (Op == OP_ABS)
+		return std::abs(a);
+	return (T)std::sqrt(a);
+}
 
-	TortoiseMatrix<T> sinh() const;
-	TortoiseMatrix<T> cosh() const;
-	TortoiseMatrix<T> tanh() const;
+/*
+ * Portable kernels, the fallback for every dispatched entry
+ */
+template <typename T, int Op>
+void portable_binary(const T* a, const T* b, T* dst, long n)
+{
+	for (long i = 0; i < n; i++)
+		dst[i] = scalar_op<Op>(a[i], b[i]);
+}
 
-	/*
-	  Extracts sub matrix from row_begin to row_end (including)
-	  returns [row_count, m_cols] matrix
-	*/
-	TortoiseMatrix<T> extract(int row_begin, int row_count) const;
+template <typename T, int Op, bool Reverse>
+void portable_scalar(const T* a, T value, T* dst, long n)
+{
+	for (long i = 0; i < n; i++)
+		dst[i] = Reverse ? scalar_op<Op>(value, a[i]) : scalar_op<Op>(a[i], value);
+}
 
-	/*
-	  Extracts single column
-	  returns [m_rows, 1] matrix
-	*/
-	TortoiseMatrix<T> extract(int col) const;
+template <typename T, int Op>
+void portable_unary(const T* a, T* dst, long n)
+{
+	for (long i = 0; i < n; i++)
+		dst[i] = scalar_op<Op>(a[i]);
+}
 
-	/*
-	 * Normalizes the matrix elements by:
-	 * value - min / max - min
-	 */
-	void normalize();
+template <typename T, int Op>
+T portable_reduce(const T* a, long n)
+{
+	if (n == 0)
+		return T();
+	T result = a[0];
+	for (long i = 1; i < n; i++)
+		result = scalar_op<Op>(result, a[i]);
+	return result;
+}
 
-	/*
-	 * Swaps the rows of the matrix
-	 */
-	void swap(int row1, int row2);
+/*
+ * Transcendental functions with vector kernels
+ */
+enum ElementMath
+{
+	MATH_EXP,
+	MATH_LOG,
+	MATH_LOG10,
+	MATH_SIN,
+	MATH_COS,
+	MATH_SINH,
+	MATH_COSH,
+	MATH_TANH,
+	MATH_FUNCTIONS
+};
 
-	/*
-	 * minimum value in the matrix
-	 */
-	T min() const;
+template <int Function, typename T>
+inline T scalar_math(T a)
+{
+	switch (Function) {
+	case MATH_EXP: return (T)std::exp(a);
+	case MATH_LOG: return (T)std::log(a);
+	case MATH_LOG10: return (T)std::log10(a);
+	case MATH_SIN: return (T)std::sin(a);
+	case MATH_COS: return (T)std::cos(a);
+	case MATH_SINH: return (T)std::sinh(a);
+	case MATH_COSH: return (T)std::cosh(a);
+	default: return (T)std::tanh(a);
+	}
+}
+
+template <typename T, int Function>
+void portable_math(const T* a, T* dst, long n)
+{
+	for (long i = 0; i < n; i++)
+		dst[i] = scalar_math<Function>(a[i]);
+}
+
+template <typename T, int Tile>
+void transpose_tile_ref(const T* src, long rs_src, T* dst, long rs_dst)
+{
+	for (int r = 0; r < Tile; r++)
+		for (int c = 0; c < Tile; c++)
+			dst[c * rs_dst + r] = src[r * rs_src + c];
+}
+
+/*
+ * Cache oblivious transpose of a rows x cols block: the longer side is
+ * halved (at a multiple of Tile) until the block fits in L1, which is
+ * then covered with Tile x Tile kernels; fringes fall back to scalar
+ * copies.
+ */
+template <typename T, int Tile, void (*Kernel)(const T*, long, T*, long)>
+void transpose_block(const T* src, long rs_src, T* dst, long rs_dst, int rows, int cols)
+{
+	const int leaf = 32;
+	if (rows > leaf && rows >= cols) {
+		const int half = rows / 2 / Tile * Tile;
+		transpose_block<T, Tile, Kernel>(src, rs_src, dst, rs_dst, half, cols);
+		transpose_block<T, Tile, Kernel>(src + half * rs_src, rs_src, dst + half, rs_dst, rows - half, cols);
+		return;
+	}
+	if (cols > leaf) {
+		const int half = cols / 2 / Tile * Tile;
+		transpose_block<T, Tile, Kernel>(src, rs_src, dst, rs_dst, rows, half);
+		transpose_block<T, Tile, Kernel>(src + half, rs_src, dst + half * rs_dst, rs_dst, rows, cols - half);
+		return;
+	}
+
+	int r = 0;
+	for (; r + Tile <= rows; r += Tile) {
+		int c = 0;
+		for (; c + Tile <= cols; c += Tile)
+			Kernel(src + r * rs_src + c, rs_src, dst + c * rs_dst + r, rs_dst);
+		for (; c < cols; c++)
+			for (int i = 0; i < Tile; i++)
+				dst[c * rs_dst + r + i] = src[(r + i) * rs_src + c];
+	}
+	for (; r < rows; r++)
+		for (int c = 0; c < cols; c++)
+			dst[c * rs_dst + r] = src[r * rs_src + c];
+}
+
+/*
+ * Transposes a row major rows x cols source into dst. Large matrices are
+ * cut into bands of source columns (contiguous rows of dst) that are
+ * spread over the thread pool.
+ */
+template <typename T, int Tile, void (*Kernel)(const T*, long, T*, long)>
+void transpose_tiled(const T* src, int rows, int cols, T* dst)
+{
+	const long parallel_size = 1L << 18;
+	const int band = 256;
+	const int bands = (cols + band - 1) / band;
+	if ((long)rows * cols < parallel_size || bands < 2) {
+		transpose_block<T, Tile, Kernel>(src, cols, dst, rows, rows, cols);
+		return;
+	}
+
+	ThreadPool::instance().run(bands, [&](int task) {
+		const int c0 = task * band;
+		const int count = std::min(band, cols - c0);
+		transpose_block<T, Tile, Kernel>(src + c0, cols, dst + (long)c0 * rows, rows, rows, count);
+	});
+}
+
+
+/*
+ * In-place transpose of a square n x n matrix: pairs of 32x32 blocks
+ * mirrored across the diagonal are transposed into two local buffers and
+ * written back swapped. Block rows are spread over the thread pool.
+ */
+template <typename T, int Tile, void (*Kernel)(const T*, long, T*, long)>
+void transpose_square(T* a, int n)
+{
+	const int block = 32;
+	const int blocks = (n + block - 1) / block;
+	ThreadPool::instance().run(blocks, [&](int bi) {
+		T upper[block * block];
+		T lower[block * block];
+		const int r0 = bi * block;
+		const int rows = std::min(block, n - r0);
+		for (int bj = bi; bj < blocks; bj++) {
+			const int c0 = bj * block;
+			const int cols = std::min(block, n - c0);
+			T* above = a + (long)r0 * n + c0;
+			T* below = a + (long)c0 * n + r0;
+			transpose_block<T, Tile, Kernel>(above, n, upper, block, rows, cols);
+			if (bj != bi)
+				transpose_block<T, Tile, Kernel>(below, n, lower, block, cols, rows);
+			for (int i = 0; i < cols; i++)
+				std::copy(upper + i * block, upper + i * block + rows, below + (long)i * n);
+			if (bj != bi)
+				for (int i = 0; i < rows; i++)
+					std::copy(lower + i * block, lower + i * block + cols, above + (long)i * n);
+		}
+	});
+}
+
+/*
+ * In-place transpose of a rows x cols matrix, as three passes that each
+ * move elements within their row or their column only (Catanzaro, Keller
+ * and Garland, "A decomposition for in-place matrix transposition"):
+ * column j is rotated down by j / (cols / g) rows, g = gcd(rows, cols),
+ * then the element of row r from column j goes to column (j * rows + i)
+ * mod cols, i its original row, and last every column is gathered into
+ * the transposed order. Bands of rows or columns are spread over the
+ * thread pool, each with a buffer of at most 32 columns or one row.
+ */
+template <typename T>
+void transpose_rectangular(T* a, int rows, int cols)
+{
+	if ((long)rows * cols < 2 || rows == 1 || cols == 1)
+		return;
+	const long m = rows;
+	const long n = cols;
+	long g = m;
+	for (long r = n; r;) {
+		const long rest = g % r;
+		g = r;
+		r = rest;
+	}
+	const long b = n / g;
+	const int group = 32;
+	const int row_band = 64;
+	const int col_band = 8 * group;
+	const int col_bands = (int)((n + col_band - 1) / col_band);
+
+	if (g > 1) {
+		ThreadPool::instance().run(col_bands, [&](int task) {
+			std::vector<T> buffer(m * group);
+			const long end = std::min(n, (long)(task + 1) * col_band);
+			for (long s0 = std::max(b, (long)task * col_band); s0 < end; s0 += group) {
+				const long count = std::min((long)group, end - s0);
+				for (long r = 0; r < m; r++)
+					for (long s = 0; s < count; s++) {
+						long to = r + (s0 + s) / b;
+						if (to >= m)
+							to -= m;
+						buffer[to * group + s] = a[r * n + s0 + s];
+					}
+				for (long r = 0; r < m; r++)
+					std::copy(&buffer[r * group], &buffer[r * group] + count, a + r * n + s0);
+			}
+		});
+	}
+
+	ThreadPool::instance().run((int)((m + row_band - 1) / row_band), [&](int task) {
+		std::vector<T> buffer(n);
+		const long step = m % n;
+		for (long r = (long)task * row_band; r < std::min(m, (long)(task + 1) * row_band); r++) {
+			T* row = a + r * n;
+			for (long k = 0; k < g; k++) {
+				const long i = (r - k + m) % m;
+				long to = (long)(((unsigned long long)k * b * m + i) % n);
+				for (long j = k * b; j < (k + 1) * b; j++) {
+					buffer[to] = row[j];
+					to += step;
+					if (to >= n)
+						to -= n;
+				}
+			}
+			std::copy(buffer.begin(), buffer.end(), row);
+		}
+	});
+
+	ThreadPool::instance().run(col_bands, [&](int task) {
+		std::vector<T> buffer(m * group);
+		const long end = std::min(n, (long)(task + 1) * col_band);
+		for (long s0 = (long)task * col_band; s0 < end; s0 += group) {
+			const long count = std::min((long)group, end - s0);
+			for (long r = 0; r < m; r++) {
+				const unsigned long long first = (unsigned long long)r * n + s0;
+				long i = (long)(first % m);
+				long j = (long)(first / m);
+				long k = j / b;
+				j %= b;
+				for (long s = 0; s < count; s++) {
+					long from = i + k;
+					if (from >= m)
+						from -= m;
+					buffer[r * group + s] = a[from * n + s0 + s];
+					if (++i == m) {
+						i = 0;
+						if (++j == b) {
+							j = 0;
+							k++;
+						}
+					}
+				}
+			}
+			for (long r = 0; r < m; r++)
+				std::copy(&buffer[r * group], &buffer[r * group] + count, a + r * n + s0);
+		}
+	});
+}
+
+#if defined(TT_X86_SIMD)
+/*
+ * Per ISA vector traits. Every member carries the target attribute of
+ * its ISA so the algorithms below can inline them.
+ */
+struct Sse2Float
+{
+	typedef float T;
+	typedef __m128 V;
+	enum { W = 4 };
+
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V load(const T* p) { return _mm_loadu_ps(p); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static void store(T* p, V v) { _mm_storeu_ps(p, v); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V set1(T value) { return _mm_set1_ps(value); }
+
+	template <int Op>
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V apply(V a, V b)
+	{
+		switch (Op) {
+		case OP_ADD: return _mm_add_ps(a, b);
+		case OP_SUB: return _mm_sub_ps(a, b);
+		case OP_MUL: return _mm_mul_ps(a, b);
+		case OP_DIV: return _mm_div_ps(a, b);
+		case OP_MIN: return _mm_min_ps(a, b);
+		default: return _mm_max_ps(a, b);
+		}
+	}
+
+	template <int Op>
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V apply(V a)
+	{
+		if (Op == OP_ABS)
+			return _mm_andnot_ps(_mm_set1_ps(-0.0f), a);
+		return _mm_sqrt_ps(a);
+	}
 
 	/*
-	 * maximum value in the matrix
+	 * Building blocks of the math kernels. Integer valued vectors (round)
+	 * are decoded through the 1.5 * 2^23 magic: its sum with n carries n in
+	 * the low mantissa bits.
 	 */
-	T max() const;
+	typedef V M;
+
+	// not fused; the kernels keep the products that must be exact exact
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V fma(V a, V b, V c) { return _mm_add_ps(_mm_mul_ps(a, b), c); }
+	// rows[i][j] becomes rows[j][i]
+	TT_TARGET_SSE2 TT_SIMD_INLINE static void transpose(V* rows) { _MM_TRANSPOSE4_PS(rows[0], rows[1], rows[2], rows[3]); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V round(V a) { return _mm_cvtepi32_ps(_mm_cvtps_epi32(a)); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static __m128i integer(V n) { return _mm_castps_si128(_mm_add_ps(n, _mm_set1_ps(12582912.0f))); }
+	// p * 2^n for integer valued n in [-126, 127]
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V ldexp(V p, V n)
+	{
+		const __m128i e = _mm_slli_epi32(_mm_add_epi32(integer(n), _mm_set1_epi32(127)), 23);
+		return _mm_mul_ps(p, _mm_castsi128_ps(e));
+	}
+	// mantissa in [1, 2) and exponent of a positive normal x
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V frexp(V x, V& e)
+	{
+		const __m128i i = _mm_castps_si128(x);
+		e = _mm_cvtepi32_ps(_mm_sub_epi32(_mm_srli_epi32(i, 23), _mm_set1_epi32(127)));
+		return _mm_castsi128_ps(_mm_or_si128(_mm_and_si128(i, _mm_set1_epi32(0x007fffff)), _mm_set1_epi32(0x3f800000)));
+	}
+	TT_TARGET_SSE2 TT_SIMD_INLINE static M lt(V a, V b) { return _mm_cmplt_ps(a, b); }
+	// lanes not in [lo, hi], NaN included
+	TT_TARGET_SSE2 TT_SIMD_INLINE static M outside(V x, V lo, V hi) { return _mm_or_ps(_mm_cmpnge_ps(x, lo), _mm_cmpnle_ps(x, hi)); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V select(M m, V a, V b) { return _mm_or_ps(_mm_and_ps(m, a), _mm_andnot_ps(m, b)); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static int bits(M m) { return _mm_movemask_ps(m); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V band(V a, V b) { return _mm_and_ps(a, b); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V bxor(V a, V b) { return _mm_xor_ps(a, b); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static M odd(V q)
+	{
+		const __m128i one = _mm_set1_epi32(1);
+		return _mm_castsi128_ps(_mm_cmpeq_epi32(_mm_and_si128(integer(q), one), one));
+	}
+	// sign bit set where bit 1 of the integer valued q is
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V sign_of_bit1(V q)
+	{
+		return _mm_castsi128_ps(_mm_slli_epi32(_mm_and_si128(integer(q), _mm_set1_epi32(2)), 30));
+	}
+};
+
+struct Sse2Double
+{
+	typedef double T;
+	typedef __m128d V;
+	enum { W = 2 };
+
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V load(const T* p) { return _mm_loadu_pd(p); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static void store(T* p, V v) { _mm_storeu_pd(p, v); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V set1(T value) { return _mm_set1_pd(value); }
+
+	template <int Op>
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V apply(V a, V b)
+	{
+		switch (Op) {
+		case OP_ADD: return _mm_add_pd(a, b);
+		case OP_SUB: return _mm_sub_pd(a, b);
+		case OP_MUL: return _mm_mul_pd(a, b);
+		case OP_DIV: return _mm_div_pd(a, b);
+		case OP_MIN: return _mm_min_pd(a, b);
+		default: return _mm_max_pd(a, b);
+		}
+	}
+
+	template <int Op>
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V apply(V a)
+	{
+		if (Op == OP_ABS)
+			return _mm_andnot_pd(_mm_set1_pd(-0.0), a);
+		return _mm_sqrt_pd(a);
+	}
+
+	typedef V M;
+
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V fma(V a, V b, V c) { return _mm_add_pd(_mm_mul_pd(a, b), c); }
+	// rows[i][j] becomes rows[j][i]
+	TT_TARGET_SSE2 TT_SIMD_INLINE static void transpose(V* rows)
+	{
+		const V low = _mm_unpacklo_pd(rows[0], rows[1]);
+		rows[1] = _mm_unpackhi_pd(rows[0], rows[1]);
+		rows[0] = low;
+	}
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V round(V a) { return _mm_cvtepi32_pd(_mm_cvtpd_epi32(a)); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static __m128i integer(V n) { return _mm_castpd_si128(_mm_add_pd(n, _mm_set1_pd(6755399441055744.0))); }
+	// p * 2^n for integer valued n in [-1022, 1023]
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V ldexp(V p, V n)
+	{
+		const __m128i e = _mm_add_epi64(_mm_slli_epi64(integer(n), 52), _mm_set1_epi64x(1023LL << 52));
+		return _mm_mul_pd(p, _mm_castsi128_pd(e));
+	}
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V frexp(V x, V& e)
+	{
+		const __m128i i = _mm_castpd_si128(x);
+		const __m128i biased = _mm_or_si128(_mm_srli_epi64(i, 52), _mm_set1_epi64x(0x4330000000000000LL));
+		e = _mm_sub_pd(_mm_castsi128_pd(biased), _mm_set1_pd(4503599627371519.0));
+		return _mm_castsi128_pd(_mm_or_si128(_mm_and_si128(i, _mm_set1_epi64x(0x000fffffffffffffLL)),
+		                                     _mm_set1_epi64x(0x3ff0000000000000LL)));
+	}
+	TT_TARGET_SSE2 TT_SIMD_INLINE static M lt(V a, V b) { return _mm_cmplt_pd(a, b); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static M outside(V x, V lo, V hi) { return _mm_or_pd(_mm_cmpnge_pd(x, lo), _mm_cmpnle_pd(x, hi)); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V select(M m, V a, V b) { return _mm_or_pd(_mm_and_pd(m, a), _mm_andnot_pd(m, b)); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static int bits(M m) { return _mm_movemask_pd(m); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V band(V a, V b) { return _mm_and_pd(a, b); }
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V bxor(V a, V b) { return _mm_xor_pd(a, b); }
+	// no 64 bit compare in SSE2: 0 - (q & 1) is all ones for odd q
+	TT_TARGET_SSE2 TT_SIMD_INLINE static M odd(V q)
+	{
+		return _mm_castsi128_pd(_mm_sub_epi64(_mm_setzero_si128(), _mm_and_si128(integer(q), _mm_set1_epi64x(1))));
+	}
+	TT_TARGET_SSE2 TT_SIMD_INLINE static V sign_of_bit1(V q)
+	{
+		return _mm_castsi128_pd(_mm_slli_epi64(_mm_and_si128(integer(q), _mm_set1_epi64x(2)), 62));
+	}
+};
+
+struct Avx2Float
+{
+	typedef float T;
+	typedef __m256 V;
+	enum { W = 8 };
+
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V load(const T* p) { return _mm256_loadu_ps(p); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static void store(T* p, V v) { _mm256_storeu_ps(p, v); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V set1(T value) { return _mm256_set1_ps(value); }
+
+	template <int Op>
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V apply(V a, V b)
+	{
+		switch (Op) {
+		case OP_ADD: return _mm256_add_ps(a, b);
+		case OP_SUB: return _mm256_sub_ps(a, b);
+		case OP_MUL: return _mm256_mul_ps(a, b);
+		case OP_DIV: return _mm256_div_ps(a, b);
+		case OP_MIN: return _mm256_min_ps(a, b);
+		default: return _mm256_max_ps(a, b);
+		}
+	}
+
+	template <int Op>
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V apply(V a)
+	{
+		if (Op == OP_ABS)
+			return _mm256_andnot_ps(_mm256_set1_ps(-0.0f), a);
+		return _mm256_sqrt_ps(a);
+	}
+
+	typedef V M;
+
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V fma(V a, V b, V c) { return _mm256_fmadd_ps(a, b, c); }
+	// rows[i][j] becomes rows[j][i]
+	TT_TARGET_AVX2 TT_SIMD_INLINE static void transpose(V* rows)
+	{
+		const V t0 = _mm256_unpacklo_ps(rows[0], rows[1]);
+		const V t1 = _mm256_unpackhi_ps(rows[0], rows[1]);
+		const V t2 = _mm256_unpacklo_ps(rows[2], rows[3]);
+		const V t3 = _mm256_unpackhi_ps(rows[2], rows[3]);
+		const V t4 = _mm256_unpacklo_ps(rows[4], rows[5]);
+		const V t5 = _mm256_unpackhi_ps(rows[4], rows[5]);
+		const V t6 = _mm256_unpacklo_ps(rows[6], rows[7]);
+		const V t7 = _mm256_unpackhi_ps(rows[6], rows[7]);
+
+		const V s0 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(1, 0, 1, 0));
+		const V s1 = _mm256_shuffle_ps(t0, t2, _MM_SHUFFLE(3, 2, 3, 2));
+		const V s2 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(1, 0, 1, 0));
+		const V s3 = _mm256_shuffle_ps(t1, t3, _MM_SHUFFLE(3, 2, 3, 2));
+		const V s4 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(1, 0, 1, 0));
+		const V s5 = _mm256_shuffle_ps(t4, t6, _MM_SHUFFLE(3, 2, 3, 2));
+		const V s6 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(1, 0, 1, 0));
+		const V s7 = _mm256_shuffle_ps(t5, t7, _MM_SHUFFLE(3, 2, 3, 2));
+
+		rows[0] = _mm256_permute2f128_ps(s0, s4, 0x20);
+		rows[1] = _mm256_permute2f128_ps(s1, s5, 0x20);
+		rows[2] = _mm256_permute2f128_ps(s2, s6, 0x20);
+		rows[3] = _mm256_permute2f128_ps(s3, s7, 0x20);
+		rows[4] = _mm256_permute2f128_ps(s0, s4, 0x31);
+		rows[5] = _mm256_permute2f128_ps(s1, s5, 0x31);
+		rows[6] = _mm256_permute2f128_ps(s2, s6, 0x31);
+		rows[7] = _mm256_permute2f128_ps(s3, s7, 0x31);
+	}
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V round(V a) { return _mm256_round_ps(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static __m256i integer(V n) { return _mm256_castps_si256(_mm256_add_ps(n, _mm256_set1_ps(12582912.0f))); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V ldexp(V p, V n)
+	{
+		const __m256i e = _mm256_slli_epi32(_mm256_add_epi32(integer(n), _mm256_set1_epi32(127)), 23);
+		return _mm256_mul_ps(p, _mm256_castsi256_ps(e));
+	}
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V frexp(V x, V& e)
+	{
+		const __m256i i = _mm256_castps_si256(x);
+		e = _mm256_cvtepi32_ps(_mm256_sub_epi32(_mm256_srli_epi32(i, 23), _mm256_set1_epi32(127)));
+		return _mm256_castsi256_ps(_mm256_or_si256(_mm256_and_si256(i, _mm256_set1_epi32(0x007fffff)),
+		                                           _mm256_set1_epi32(0x3f800000)));
+	}
+	TT_TARGET_AVX2 TT_SIMD_INLINE static M lt(V a, V b) { return _mm256_cmp_ps(a, b, _CMP_LT_OQ); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static M outside(V x, V lo, V hi)
+	{
+		return _mm256_or_ps(_mm256_cmp_ps(x, lo, _CMP_NGE_UQ), _mm256_cmp_ps(x, hi, _CMP_NLE_UQ));
+	}
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V select(M m, V a, V b) { return _mm256_blendv_ps(b, a, m); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static int bits(M m) { return _mm256_movemask_ps(m); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V band(V a, V b) { return _mm256_and_ps(a, b); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V bxor(V a, V b) { return _mm256_xor_ps(a, b); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static M odd(V q)
+	{
+		const __m256i one = _mm256_set1_epi32(1);
+		return _mm256_castsi256_ps(_mm256_cmpeq_epi32(_mm256_and_si256(integer(q), one), one));
+	}
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V sign_of_bit1(V q)
+	{
+		return _mm256_castsi256_ps(_mm256_slli_epi32(_mm256_and_si256(integer(q), _mm256_set1_epi32(2)), 30));
+	}
+};
+
+struct Avx2Double
+{
+	typedef double T;
+	typedef __m256d V;
+	enum { W = 4 };
+
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V load(const T* p) { return _mm256_loadu_pd(p); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static void store(T* p, V v) { _mm256_storeu_pd(p, v); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V set1(T value) { return _mm256_set1_pd(value); }
+
+	template <int Op>
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V apply(V a, V b)
+	{
+		switch (Op) {
+		case OP_ADD: return _mm256_add_pd(a, b);
+		case OP_SUB: return _mm256_sub_pd(a, b);
+		case OP_MUL: return _mm256_mul_pd(a, b);
+		case OP_DIV: return _mm256_div_pd(a, b);
+		case OP_MIN: return _mm256_min_pd(a, b);
+		default: return _mm256_max_pd(a, b);
+		}
+	}
+
+	template <int Op>
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V apply(V a)
+	{
+		if (Op == OP_ABS)
+			return _mm256_andnot_pd(_mm256_set1_pd(-0.0), a);
+		return _mm256_sqrt_pd(a);
+	}
+
+	typedef V M;
+
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V fma(V a, V b, V c) { return _mm256_fmadd_pd(a, b, c); }
+	// rows[i][j] becomes rows[j][i]
+	TT_TARGET_AVX2 TT_SIMD_INLINE static void transpose(V* rows)
+	{
+		const V t0 = _mm256_unpacklo_pd(rows[0], rows[1]);
+		const V t1 = _mm256_unpackhi_pd(rows[0], rows[1]);
+		const V t2 = _mm256_unpacklo_pd(rows[2], rows[3]);
+		const V t3 = _mm256_unpackhi_pd(rows[2], rows[3]);
+
+		rows[0] = _mm256_permute2f128_pd(t0, t2, 0x20);
+		rows[1] = _mm256_permute2f128_pd(t1, t3, 0x20);
+		rows[2] = _mm256_permute2f128_pd(t0, t2, 0x31);
+		rows[3] = _mm256_permute2f128_pd(t1, t3, 0x31);
+	}
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V round(V a) { return _mm256_round_pd(a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static __m256i integer(V n) { return _mm256_castpd_si256(_mm256_add_pd(n, _mm256_set1_pd(6755399441055744.0))); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V ldexp(V p, V n)
+	{
+		const __m256i e = _mm256_add_epi64(_mm256_slli_epi64(integer(n), 52), _mm256_set1_epi64x(1023LL << 52));
+		return _mm256_mul_pd(p, _mm256_castsi256_pd(e));
+	}
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V frexp(V x, V& e)
+	{
+		const __m256i i = _mm256_castpd_si256(x);
+		const __m256i biased = _mm256_or_si256(_mm256_srli_epi64(i, 52), _mm256_set1_epi64x(0x4330000000000000LL));
+		e = _mm256_sub_pd(_mm256_castsi256_pd(biased), _mm256_set1_pd(4503599627371519.0));
+		return _mm256_castsi256_pd(_mm256_or_si256(_mm256_and_si256(i, _mm256_set1_epi64x(0x000fffffffffffffLL)),
+		                                           _mm256_set1_epi64x(0x3ff0000000000000LL)));
+	}
+	TT_TARGET_AVX2 TT_SIMD_INLINE static M lt(V a, V b) { return _mm256_cmp_pd(a, b, _CMP_LT_OQ); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static M outside(V x, V lo, V hi)
+	{
+		return _mm256_or_pd(_mm256_cmp_pd(x, lo, _CMP_NGE_UQ), _mm256_cmp_pd(x, hi, _CMP_NLE_UQ));
+	}
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V select(M m, V a, V b) { return _mm256_blendv_pd(b, a, m); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static int bits(M m) { return _mm256_movemask_pd(m); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V band(V a, V b) { return _mm256_and_pd(a, b); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V bxor(V a, V b) { return _mm256_xor_pd(a, b); }
+	TT_TARGET_AVX2 TT_SIMD_INLINE static M odd(V q)
+	{
+		const __m256i one = _mm256_set1_epi64x(1);
+		return _mm256_castsi256_pd(_mm256_cmpeq_epi64(_mm256_and_si256(integer(q), one), one));
+	}
+	TT_TARGET_AVX2 TT_SIMD_INLINE static V sign_of_bit1(V q)
+	{
+		return _mm256_castsi256_pd(_mm256_slli_epi64(_mm256_and_si256(integer(q), _mm256_set1_epi64x(2)), 62));
+	}
+};
+
+/*
+ * min, max, sqrt and the other intrinsics with an undefined source use
+ * the all-ones mask forms: the unmasked GCC 12 intrinsics trip
+ * -Wmaybe-uninitialized on that source.
+ */
+struct Avx512Float
+{
+	typedef float T;
+	typedef __m512 V;
+	enum { W = 16 };
+
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V load(const T* p) { return _mm512_loadu_ps(p); }
+	TT_TARGET_AVX512 TT_SIMD_INLINE static void store(T* p, V v) { _mm512_storeu_ps(p, v); }
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V set1(T value) { return _mm512_set1_ps(value); }
+
+	template <int Op>
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V apply(V a, V b)
+	{
+		switch (Op) {
+		case OP_ADD: return _mm512_add_ps(a, b);
+		case OP_SUB: return _mm512_sub_ps(a, b);
+		case OP_MUL: return _mm512_mul_ps(a, b);
+		case OP_DIV: return _mm512_div_ps(a, b);
+		case OP_MIN: return _mm512_mask_min_ps(a, (__mmask16)-1, a, b);
+		default: return _mm512_mask_max_ps(a, (__mmask16)-1, a, b);
+		}
+	}
+
+	template <int Op>
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V apply(V a)
+	{
+		if (Op == OP_ABS)
+			return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(a), _mm512_set1_epi32(0x7fffffff)));
+		return _mm512_mask_sqrt_ps(a, (__mmask16)-1, a);
+	}
+
+	typedef __mmask16 M;
+
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V fma(V a, V b, V c) { return _mm512_fmadd_ps(a, b, c); }
+	/*
+	 * rows[i][j] becomes rows[j][i]: 2x2 blocks of floats, then of pairs,
+	 * within the 128 bit lanes, then a 4x4 transpose of the lanes
+	 */
+	TT_TARGET_AVX512 TT_SIMD_INLINE static void transpose(V* rows)
+	{
+		V t[16];
+		TT_UNROLL
+		for (int i = 0; i < 16; i += 2) {
+			t[i] = _mm512_mask_unpacklo_ps(rows[i], (M)-1, rows[i], rows[i + 1]);
+			t[i + 1] = _mm512_mask_unpackhi_ps(rows[i], (M)-1, rows[i], rows[i + 1]);
+		}
+		V u[16];
+		TT_UNROLL
+		for (int i = 0; i < 16; i += 4) {
+			const __m512d t0 = _mm512_castps_pd(t[i]);
+			const __m512d t1 = _mm512_castps_pd(t[i + 1]);
+			const __m512d t2 = _mm512_castps_pd(t[i + 2]);
+			const __m512d t3 = _mm512_castps_pd(t[i + 3]);
+			u[i] = _mm512_castpd_ps(_mm512_mask_unpacklo_pd(t0, (__mmask8)-1, t0, t2));
+			u[i + 1] = _mm512_castpd_ps(_mm512_mask_unpackhi_pd(t0, (__mmask8)-1, t0, t2));
+			u[i + 2] = _mm512_castpd_ps(_mm512_mask_unpacklo_pd(t1, (__mmask8)-1, t1, t3));
+			u[i + 3] = _mm512_castpd_ps(_mm512_mask_unpackhi_pd(t1, (__mmask8)-1, t1, t3));
+		}
+		TT_UNROLL
+		for (int c = 0; c < 4; c++) {
+			const V v0 = _mm512_mask_shuffle_f32x4(u[c], (M)-1, u[c], u[4 + c], 0x44);
+			const V v1 = _mm512_mask_shuffle_f32x4(u[c], (M)-1, u[c], u[4 + c], 0xee);
+			const V v2 = _mm512_mask_shuffle_f32x4(u[8 + c], (M)-1, u[8 + c], u[12 + c], 0x44);
+			const V v3 = _mm512_mask_shuffle_f32x4(u[8 + c], (M)-1, u[8 + c], u[12 + c], 0xee);
+			rows[c] = _mm512_mask_shuffle_f32x4(v0, (M)-1, v0, v2, 0x88);
+			rows[4 + c] = _mm512_mask_shuffle_f32x4(v0, (M)-1, v0, v2, 0xdd);
+			rows[8 + c] = _mm512_mask_shuffle_f32x4(v1, (M)-1, v1, v3, 0x88);
+			rows[12 + c] = _mm512_mask_shuffle_f32x4(v1, (M)-1, v1, v3, 0xdd);
+		}
+	}
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V round(V a)
+	{
+		return _mm512_mask_roundscale_ps(a, (M)-1, a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	}
+	TT_TARGET_AVX512 TT_SIMD_INLINE static __m512i integer(V n) { return _mm512_castps_si512(_mm512_add_ps(n, _mm512_set1_ps(12582912.0f))); }
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V ldexp(V p, V n) { return _mm512_mask_scalef_ps(p, (M)-1, p, n); }
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V frexp(V x, V& e)
+	{
+		e = _mm512_mask_getexp_ps(x, (M)-1, x);
+		return _mm512_mask_getmant_ps(x, (M)-1, x, _MM_MANT_NORM_1_2, _MM_MANT_SIGN_src);
+	}
+	TT_TARGET_AVX512 TT_SIMD_INLINE static M lt(V a, V b) { return _mm512_cmp_ps_mask(a, b, _CMP_LT_OQ); }
+	TT_TARGET_AVX512 TT_SIMD_INLINE static M outside(V x, V lo, V hi)
+	{
+		return (M)(_mm512_cmp_ps_mask(x, lo, _CMP_NGE_UQ) | _mm512_cmp_ps_mask(x, hi, _CMP_NLE_UQ));
+	}
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V select(M m, V a, V b) { return _mm512_mask_blend_ps(m, b, a); }
+	TT_TARGET_AVX512 TT_SIMD_INLINE static int bits(M m) { return m; }
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V band(V a, V b)
+	{
+		return _mm512_castsi512_ps(_mm512_and_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));
+	}
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V bxor(V a, V b)
+	{
+		return _mm512_castsi512_ps(_mm512_xor_si512(_mm512_castps_si512(a), _mm512_castps_si512(b)));
+	}
+	TT_TARGET_AVX512 TT_SIMD_INLINE static M odd(V q) { return _mm512_test_epi32_mask(integer(q), _mm512_set1_epi32(1)); }
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V sign_of_bit1(V q)
+	{
+		const __m512i bit = _mm512_and_si512(integer(q), _mm512_set1_epi32(2));
+		return _mm512_castsi512_ps(_mm512_mask_slli_epi32(bit, (M)-1, bit, 30));
+	}
+};
+
+struct Avx512Double
+{
+	typedef double T;
+	typedef __m512d V;
+	enum { W = 8 };
+
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V load(const T* p) { return _mm512_loadu_pd(p); }
+	TT_TARGET_AVX512 TT_SIMD_INLINE static void store(T* p, V v) { _mm512_storeu_pd(p, v); }
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V set1(T value) { return _mm512_set1_pd(value); }
+
+	template <int Op>
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V apply(V a, V b)
+	{
+		switch (Op) {
+		case OP_ADD: return _mm512_add_pd(a, b);
+		case OP_SUB: return _mm512_sub_pd(a, b);
+		case OP_MUL: return _mm512_mul_pd(a, b);
+		case OP_DIV: return _mm512_div_pd(a, b);
+		case OP_MIN: return _mm512_mask_min_pd(a, (__mmask8)-1, a, b);
+		default: return _mm512_mask_max_pd(a, (__mmask8)-1, a, b);
+		}
+	}
+
+	template <int Op>
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V apply(V a)
+	{
+		if (Op == OP_ABS)
+			return _mm512_castsi512_pd(_mm512_and_si512(_mm512_castpd_si512(a), _mm512_set1_epi64(0x7fffffffffffffffLL)));
+		return _mm512_mask_sqrt_pd(a, (__mmask8)-1, a);
+	}
+
+	typedef __mmask8 M;
+
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V fma(V a, V b, V c) { return _mm512_fmadd_pd(a, b, c); }
+	/*
+	 * rows[i][j] becomes rows[j][i]: 2x2 blocks within the 128 bit lanes,
+	 * then a 4x4 transpose of the lanes
+	 */
+	TT_TARGET_AVX512 TT_SIMD_INLINE static void transpose(V* rows)
+	{
+		V t[8];
+		TT_UNROLL
+		for (int i = 0; i < 8; i += 2) {
+			t[i] = _mm512_mask_unpacklo_pd(rows[i], (M)-1, rows[i], rows[i + 1]);
+			t[i + 1] = _mm512_mask_unpackhi_pd(rows[i], (M)-1, rows[i], rows[i + 1]);
+		}
+		TT_UNROLL
+		for (int c = 0; c < 2; c++) {
+			const V v0 = _mm512_mask_shuffle_f64x2(t[c], (M)-1, t[c], t[2 + c], 0x44);
+			const V v1 = _mm512_mask_shuffle_f64x2(t[c], (M)-1, t[c], t[2 + c], 0xee);
+			const V v2 = _mm512_mask_shuffle_f64x2(t[4 + c], (M)-1, t[4 + c], t[6 + c], 0x44);
+			const V v3 = _mm512_mask_shuffle_f64x2(t[4 + c], (M)-1, t[4 + c], t[6 + c], 0xee);
+			rows[c] = _mm512_mask_shuffle_f64x2(v0, (M)-1, v0, v2, 0x88);
+			rows[2 + c] = _mm512_mask_shuffle_f64x2(v0, (M)-1, v0, v2, 0xdd);
+			rows[4 + c] = _mm512_mask_shuffle_f64x2(v1, (M)-1, v1, v3, 0x88);
+			rows[6 + c] = _mm512_mask_shuffle_f64x2(v1, (M)-1, v1, v3, 0xdd);
+		}
+	}
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V round(V a)
+	{
+		return _mm512_mask_roundscale_pd(a, (M)-1, a, _MM_FROUND_TO_NEAREST_INT | _MM_FROUND_NO_EXC);
+	}
+	TT_TARGET_AVX512 TT_SIMD_INLINE static __m512i integer(V n) { return _mm512_castpd_si512(_mm512_add_pd(n, _mm512_set1_pd(6755399441055744.0))); }
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V ldexp(V p, V n) { return _mm512_mask_scalef_pd(p, (M)-1, p, n); }
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V frexp(V x, V& e)
+	{
+		e = _mm512_mask_getexp_pd(x, (M)-1, x);
+		return _mm512_mask_getmant_pd(x, (M)-1, x, _MM_MANT_NORM_1_2, _MM_MANT_SIGN_src);
+	}
+	TT_TARGET_AVX512 TT_SIMD_INLINE static M lt(V a, V b) { return _mm512_cmp_pd_mask(a, b, _CMP_LT_OQ); }
+	TT_TARGET_AVX512 TT_SIMD_INLINE static M outside(V x, V lo, V hi)
+	{
+		return (M)(_mm512_cmp_pd_mask(x, lo, _CMP_NGE_UQ) | _mm512_cmp_pd_mask(x, hi, _CMP_NLE_UQ));
+	}
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V select(M m, V a, V b) { return _mm512_mask_blend_pd(m, b, a); }
+	TT_TARGET_AVX512 TT_SIMD_INLINE static int bits(M m) { return m; }
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V band(V a, V b)
+	{
+		return _mm512_castsi512_pd(_mm512_and_si512(_mm512_castpd_si512(a), _mm512_castpd_si512(b)));
+	}
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V bxor(V a, V b)
+	{
+		return _mm512_castsi512_pd(_mm512_xor_si512(_mm512_castpd_si512(a), _mm512_castpd_si512(b)));
+	}
+	TT_TARGET_AVX512 TT_SIMD_INLINE static M odd(V q) { return _mm512_test_epi64_mask(integer(q), _mm512_set1_epi64(1)); }
+	TT_TARGET_AVX512 TT_SIMD_INLINE static V sign_of_bit1(V q)
+	{
+		const __m512i bit = _mm512_and_si512(integer(q), _mm512_set1_epi64(2));
+		return _mm512_castsi512_pd(_mm512_mask_slli_epi64(bit, (M)-1, bit, 62));
+	}
+};
+
+/*
+ * The vector loops, stamped out once per ISA so that each copy carries
+ * its target attribute. S is one of the traits above.
+ */
+#define TT_SIMD_ALGORITHMS(NAME, TARGET)                                                   \
+struct NAME                                                                                \
+{                                                                                          \
+	template <typename S, int Op>                                                          \
+	TARGET static void binary(const typename S::T* a, const typename S::T* b,              \
+	                          typename S::T* dst, long n)                                  \
+	{                                                                                      \
+		long i = 0;                                                                        \
+		for (; i + S::W <= n; i += S::W)                                                   \
+			S::store(dst + i, S::template apply<Op>(S::load(a + i), S::load(b + i)));      \
+		for (; i < n; i++)                                                                 \
+			dst[i] = scalar_op<Op>(a[i], b[i]);                                            \
+	}                                                                                      \
+                                                                                           \
+	template <typename S, int Op, bool Reverse>                                            \
+	TARGET static void scalar(const typename S::T* a, typename S::T value,                 \
+	                          typename S::T* dst, long n)                                  \
+	{                                                                                      \
+		const typename S::V v = S::set1(value);                                            \
+		long i = 0;                                                                        \
+		for (; i + S::W <= n; i += S::W) {                                                 \
+			const typename S::V x = S::load(a + i);                                        \
+			S::store(dst + i, Reverse ? S::template apply<Op>(v, x)                        \
+			                          : S::template apply<Op>(x, v));                      \
+		}                                                                                  \
+		for (; i < n; i++)                                                                 \
+			dst[i] = Reverse ? scalar_op<Op>(value, a[i]) : scalar_op<Op>(a[i], value);    \
+	}                                                                                      \
+                                                                                           \
+	template <typename S, int Op>                                                          \
+	TARGET static void unary(const typename S::T* a, typename S::T* dst, long n)           \
+	{                                                                                      \
+		long i = 0;                                                                        \
+		for (; i + S::W <= n; i += S::W)                                                   \
+			S::store(dst + i, S::template apply<Op>(S::load(a + i)));                      \
+		for (; i < n; i++)                                                                 \
+			dst[i] = scalar_op<Op>(a[i]);                                                  \
+	}                                                                                      \
+                                                                                           \
+	/* four independent accumulators hide the add/min/max latency */                       \
+	template <typename S, int Op>                                                          \
+	TARGET static typename S::T reduce(const typename S::T* a, long n)                     \
+	{                                                                                      \
+		typedef typename S::T T;                                                           \
+		typedef typename S::V V;                                                           \
+		if (n < 4 * S::W)                                                                  \
+			return portable_reduce<T, Op>(a, n);                                           \
+                                                                                           \
+		V acc0 = S::load(a);                                                               \
+		V acc1 = S::load(a + S::W);                                                        \
+		V acc2 = S::load(a + 2 * S::W);                                                    \
+		V acc3 = S::load(a + 3 * S::W);                                                    \
+		long i = 4 * S::W;                                                                 \
+		for (; i + 4 * S::W <= n; i += 4 * S::W) {                                         \
+			acc0 = S::template apply<Op>(acc0, S::load(a + i));                            \
+			acc1 = S::template apply<Op>(acc1, S::load(a + i + S::W));                     \
+			acc2 = S::template apply<Op>(acc2, S::load(a + i + 2 * S::W));                 \
+			acc3 = S::template apply<Op>(acc3, S::load(a + i + 3 * S::W));                 \
+		}                                                                                  \
+		acc0 = S::template apply<Op>(S::template apply<Op>(acc0, acc1),                    \
+		                             S::template apply<Op>(acc2, acc3));                   \
+                                                                                           \
+		T lanes[S::W];                                                                     \
+		S::store(lanes, acc0);                                                             \
+		T result = lanes[0];                                                               \
+		for (int l = 1; l < S::W; l++)                                                     \
+			result = scalar_op<Op>(result, lanes[l]);                                      \
+		for (; i < n; i++)                                                                 \
+			result = scalar_op<Op>(result, a[i]);                                          \
+		return result;                                                                     \
+	}                                                                                      \
+};
+
+TT_SIMD_ALGORITHMS(Sse2Algorithms, TT_TARGET_SSE2)
+TT_SIMD_ALGORITHMS(Avx2Algorithms, TT_TARGET_AVX2)
+TT_SIMD_ALGORITHMS(Avx512Algorithms, TT_TARGET_AVX512)
+
+#undef TT_SIMD_ALGORITHMS
+
+/*
+ * Coefficients of the math kernels, highest degree first. The exp and
+ * log polynomials have a shorter *_FAST variant; sin and cos have no
+ * cheaper form that keeps float in a few ulp, so both modes share them.
+ * lower() and upper() bound the arguments a kernel handles, lanes
+ * outside (or NaN) are recomputed with libm.
+ */
+template <typename T>
+struct MathTables;
+
+template <>
+struct MathTables<float>
+{
+	enum { EXP = 6, EXP_FAST = 4, LOG = 4, LOG_FAST = 2, SIN = 3, COS = 3, TANH_P = 5, TANH_Q = 0, SINH_P = 3, SINH_Q = 0 };
+
+	static const float* exp()
+	{
+		static const float c[] = { 1.9875691500e-4f, 1.3981999507e-3f, 8.3334519073e-3f, 4.1665795894e-2f,
+		                           1.6666665459e-1f, 5.0000001201e-1f };
+		return c;
+	}
+	static const float* exp_fast()
+	{
+		static const float c[] = { 8.3572001485e-3f, 4.1833804078e-2f, 1.6666630825e-1f, 4.9999748990e-1f };
+		return c;
+	}
+	static const float* log()
+	{
+		static const float c[] = { 2.4279078841e-1f, 2.8498786688e-1f, 4.0000972152e-1f, 6.6666662693e-1f };
+		return c;
+	}
+	static const float* log_fast()
+	{
+		static const float c[] = { 4.0858269359e-1f, 6.6663499455e-1f };
+		return c;
+	}
+	static const float* sin()
+	{
+		static const float c[] = { -1.9515295891e-4f, 8.3321608736e-3f, -1.6666654611e-1f };
+		return c;
+	}
+	static const float* cos()
+	{
+		static const float c[] = { 2.443315711809948e-5f, -1.388731625493765e-3f, 4.166664568298827e-2f };
+		return c;
+	}
+	static const float* tanh_p()
+	{
+		static const float c[] = { -5.70498872745e-3f, 2.06390887954e-2f, -5.37397155531e-2f, 1.33314422036e-1f,
+		                           -3.33332819422e-1f };
+		return c;
+	}
+	static const float* tanh_q() { return 0; }
+	static const float* sinh_p()
+	{
+		static const float c[] = { 2.03721912945e-4f, 8.33028376239e-3f, 1.66667160211e-1f };
+		return c;
+	}
+	static const float* sinh_q() { return 0; }
+
+	static float log2e() { return 1.44269504088896341f; }
+	// ln2 = ln2_hi + ln2_lo, n * ln2_hi is exact for the exponents in range
+	static float ln2_hi() { return 0.693359375f; }
+	static float ln2_lo() { return -2.12194440e-4f; }
+	static float ivln10() { return 4.34294481903251827651e-1f; }
+	static float two_over_pi() { return 0.636619772367581343076f; }
+	// pi / 2 = pio2_1 + .. + pio2_4, j * pio2_1 .. j * pio2_3 are exact
+	static float pio2_1() { return 1.5703125f; }
+	static float pio2_2() { return 4.837512969970703125e-4f; }
+	static float pio2_3() { return 7.549533620476723e-8f; }
+	static float pio2_4() { return 2.5633440682570896e-12f; }
+	// tanh(x) rounds to +-1 from here on
+	static float tanh_limit() { return 9.0f; }
+
+	static float lower(int function)
+	{
+		switch (function) {
+		case MATH_EXP: return -87.0f;
+		case MATH_LOG: case MATH_LOG10: return std::numeric_limits<float>::min();
+		case MATH_SIN: case MATH_COS: return -8192.0f;
+		case MATH_SINH: case MATH_COSH: return -88.0f;
+		default: return -std::numeric_limits<float>::max();
+		}
+	}
+	static float upper(int function)
+	{
+		switch (function) {
+		case MATH_EXP: case MATH_SINH: case MATH_COSH: return 88.0f;
+		case MATH_SIN: case MATH_COS: return 8192.0f;
+		default: return std::numeric_limits<float>::max();
+		}
+	}
+};
+
+template <>
+struct MathTables<double>
+{
+	enum { EXP = 12, EXP_FAST = 9, LOG = 7, LOG_FAST = 6, SIN = 6, COS = 6, TANH_P = 3, TANH_Q = 4, SINH_P = 4, SINH_Q = 4 };
+
+	// Taylor series, 1 / 13! .. 1 / 2!
+	static const double* exp()
+	{
+		static const double c[] = { 1.6059043836821613e-10, 2.08767569878681e-09, 2.505210838544172e-08,
+		                            2.755731922398589e-07, 2.7557319223985893e-06, 2.48015873015873e-05,
+		                            1.984126984126984e-04, 1.388888888888889e-03, 8.333333333333333e-03,
+		                            4.1666666666666664e-02, 1.6666666666666666e-01, 0.5 };
+		return c;
+	}
+	static const double* exp_fast()
+	{
+		static const double c[] = { 2.761379555451986e-07, 2.7625102005388108e-06, 2.4801536409064087e-05,
+		                            1.984120875699232e-04, 1.3888888905871347e-03, 8.333333353717156e-03,
+		                            4.1666666666651364e-02, 1.6666666666648303e-01, 0.5 };
+		return c;
+	}
+	static const double* log()
+	{
+		static const double c[] = { 1.479819860511658591e-01, 1.531383769920937332e-01, 1.818357216161805012e-01,
+		                            2.222219843214978396e-01, 2.857142874366239149e-01, 3.999999999940941908e-01,
+		                            6.666666666666735130e-01 };
+		return c;
+	}
+	static const double* log_fast()
+	{
+		static const double c[] = { 1.6621817152858928e-01, 1.8140193802865992e-01, 2.2222862280108716e-01,
+		                            2.857142413832416e-01, 4.0000000011206505e-01, 6.666666666666208e-01 };
+		return c;
+	}
+	static const double* sin()
+	{
+		static const double c[] = { 1.58969099521155010221e-10, -2.50507602534068634195e-08, 2.75573137070700676789e-06,
+		                            -1.98412698298579493134e-04, 8.33333333332248946124e-03, -1.66666666666666324348e-01 };
+		return c;
+	}
+	static const double* cos()
+	{
+		static const double c[] = { -1.13596475577881948265e-11, 2.08757232129817482790e-09, -2.75573143513906633035e-07,
+		                            2.48015872894767294178e-05, -1.38888888888741095749e-03, 4.16666666666666019037e-02 };
+		return c;
+	}
+	static const double* tanh_p()
+	{
+		static const double c[] = { -9.64399179425052238628e-1, -9.92877231001918586564e1, -1.61468768441708447952e3 };
+		return c;
+	}
+	static const double* tanh_q()
+	{
+		static const double c[] = { 1.0, 1.12811678491632931402e2, 2.23548839060100448583e3, 4.84406305325125486048e3 };
+		return c;
+	}
+	static const double* sinh_p()
+	{
+		static const double c[] = { -7.89474443963537015605e-1, -1.63725857525983828727e2, -1.15614435765005216044e4,
+		                            -3.51754964808151394800e5 };
+		return c;
+	}
+	static const double* sinh_q()
+	{
+		static const double c[] = { 1.0, -2.77711081420602794433e2, 3.61578279834431989373e4, -2.11052978884890840399e6 };
+		return c;
+	}
+
+	static double log2e() { return 1.44269504088896338700e+00; }
+	static double ln2_hi() { return 6.93147180369123816490e-01; }
+	static double ln2_lo() { return 1.90821492927058770002e-10; }
+	static double ivln10() { return 4.34294481903251816668e-01; }
+	static double two_over_pi() { return 6.36619772367581382433e-01; }
+	static double pio2_1() { return 1.57079632673412561417e+00; }
+	static double pio2_2() { return 6.07710050630396597660e-11; }
+	static double pio2_3() { return 2.02226624871116645580e-21; }
+	static double pio2_4() { return 8.47842766036889956997e-32; }
+	static double tanh_limit() { return 22.0; }
+
+	static double lower(int function)
+	{
+		switch (function) {
+		case MATH_EXP: return -708.0;
+		case MATH_LOG: case MATH_LOG10: return std::numeric_limits<double>::min();
+		case MATH_SIN: case MATH_COS: return -1e5;
+		case MATH_SINH: case MATH_COSH: return -709.0;
+		default: return -std::numeric_limits<double>::max();
+		}
+	}
+	static double upper(int function)
+	{
+		switch (function) {
+		case MATH_EXP: case MATH_SINH: case MATH_COSH: return 709.0;
+		case MATH_SIN: case MATH_COS: return 1e5;
+		default: return std::numeric_limits<double>::max();
+		}
+	}
+};
+
+/*
+ * Vector exp, log, log10, sin, cos, sinh, cosh and tanh, stamped out per
+ * ISA like the algorithms above. Fast selects the shorter polynomials.
+ */
+#define TT_SIMD_MATH(NAME, TARGET)                                                                    \
+struct NAME                                                                                           \
+{                                                                                                     \
+	/* shorthands for the arithmetic of S */                                                          \
+	template <typename S>                                                                             \
+	TARGET TT_SIMD_INLINE static typename S::V add(typename S::V a, typename S::V b)                  \
+	{                                                                                                 \
+		return S::template apply<OP_ADD>(a, b);                                                       \
+	}                                                                                                 \
+	template <typename S>                                                                             \
+	TARGET TT_SIMD_INLINE static typename S::V sub(typename S::V a, typename S::V b)                  \
+	{                                                                                                 \
+		return S::template apply<OP_SUB>(a, b);                                                       \
+	}                                                                                                 \
+	template <typename S>                                                                             \
+	TARGET TT_SIMD_INLINE static typename S::V mul(typename S::V a, typename S::V b)                  \
+	{                                                                                                 \
+		return S::template apply<OP_MUL>(a, b);                                                       \
+	}                                                                                                 \
+	template <typename S>                                                                             \
+	TARGET TT_SIMD_INLINE static typename S::V div(typename S::V a, typename S::V b)                  \
+	{                                                                                                 \
+		return S::template apply<OP_DIV>(a, b);                                                       \
+	}                                                                                                 \
+                                                                                                      \
+	template <typename S, int N>                                                                      \
+	TARGET TT_SIMD_INLINE static typename S::V horner(typename S::V x, const typename S::T* c)        \
+	{                                                                                                 \
+		if (N == 0)                                                                                   \
+			return S::set1(1);                                                                        \
+		typename S::V p = S::set1(c[0]);                                                              \
+		TT_UNROLL                                                                                     \
+		for (int i = 1; i < N; i++)                                                                   \
+			p = S::fma(p, x, S::set1(c[i]));                                                          \
+		return p;                                                                                     \
+	}                                                                                                 \
+                                                                                                      \
+	/* 2^n * exp(r), |r| <= ln2 / 2 */                                                                \
+	template <typename S, bool Fast>                                                                  \
+	TARGET TT_SIMD_INLINE static typename S::V exp(typename S::V x)                                   \
+	{                                                                                                 \
+		typedef typename S::V V;                                                                      \
+		typedef MathTables<typename S::T> C;                                                          \
+		const V n = S::round(mul<S>(x, S::set1(C::log2e())));                                         \
+		V r = S::fma(n, S::set1(-C::ln2_hi()), x);                                                    \
+		r = S::fma(n, S::set1(-C::ln2_lo()), r);                                                      \
+		const V p = Fast ? horner<S, C::EXP_FAST>(r, C::exp_fast()) : horner<S, C::EXP>(r, C::exp()); \
+		const V e = add<S>(S::fma(p, mul<S>(r, r), r), S::set1(1));                                   \
+		return S::ldexp(e, n);                                                                        \
+	}                                                                                                 \
+                                                                                                      \
+	/* e * ln2 + log(1 + f), 1 + f in [sqrt(2) / 2, sqrt(2)], as fdlibm */                            \
+	template <typename S, bool Fast>                                                                  \
+	TARGET TT_SIMD_INLINE static typename S::V log(typename S::V x)                                   \
+	{                                                                                                 \
+		typedef typename S::V V;                                                                      \
+		typedef MathTables<typename S::T> C;                                                          \
+		const V one = S::set1(1);                                                                     \
+		V e;                                                                                          \
+		V m = S::frexp(x, e);                                                                         \
+		const typename S::M big = S::lt(S::set1(1.41421356237309504880), m);                          \
+		m = S::select(big, mul<S>(m, S::set1(0.5)), m);                                               \
+		e = S::select(big, add<S>(e, one), e);                                                        \
+                                                                                                      \
+		const V f = sub<S>(m, one);                                                                   \
+		const V s = div<S>(f, add<S>(f, S::set1(2)));                                                 \
+		const V z = mul<S>(s, s);                                                                     \
+		const V p = Fast ? horner<S, C::LOG_FAST>(z, C::log_fast()) : horner<S, C::LOG>(z, C::log()); \
+		const V R = mul<S>(z, p);                                                                     \
+		const V hfsq = mul<S>(S::set1(0.5), mul<S>(f, f));                                            \
+		const V t = S::fma(s, add<S>(hfsq, R), mul<S>(e, S::set1(C::ln2_lo())));                      \
+		return S::fma(e, S::set1(C::ln2_hi()), sub<S>(f, sub<S>(hfsq, t)));                           \
+	}                                                                                                 \
+                                                                                                      \
+	/* x = j * pi / 2 + r, the quadrant picks sin(r) or cos(r) and the sign */                        \
+	template <typename S, bool Cosine>                                                                \
+	TARGET TT_SIMD_INLINE static typename S::V sincos(typename S::V x)                                \
+	{                                                                                                 \
+		typedef typename S::V V;                                                                      \
+		typedef MathTables<typename S::T> C;                                                          \
+		const V j = S::round(mul<S>(x, S::set1(C::two_over_pi())));                                   \
+		V r = S::fma(j, S::set1(-C::pio2_1()), x);                                                    \
+		r = S::fma(j, S::set1(-C::pio2_2()), r);                                                      \
+		r = S::fma(j, S::set1(-C::pio2_3()), r);                                                      \
+		r = S::fma(j, S::set1(-C::pio2_4()), r);                                                      \
+                                                                                                      \
+		const V z = mul<S>(r, r);                                                                     \
+		const V sin_r = S::fma(mul<S>(r, z), horner<S, C::SIN>(z, C::sin()), r);                      \
+		const V cos_r = S::fma(mul<S>(z, z), horner<S, C::COS>(z, C::cos()),                          \
+		                       S::fma(z, S::set1(-0.5), S::set1(1)));                                 \
+		const V q = Cosine ? add<S>(j, S::set1(1)) : j;                                               \
+		return S::bxor(S::select(S::odd(q), cos_r, sin_r), S::sign_of_bit1(q));                       \
+	}                                                                                                 \
+                                                                                                      \
+	/* x + x^3 * P(x^2) / Q(x^2), the small argument branch of tanh and sinh */                       \
+	template <typename S, int NP, int NQ>                                                             \
+	TARGET TT_SIMD_INLINE static typename S::V odd_rational(typename S::V x, const typename S::T* p,  \
+	                                                        const typename S::T* q)                   \
+	{                                                                                                 \
+		typedef typename S::V V;                                                                      \
+		const V z = mul<S>(x, x);                                                                     \
+		V r = horner<S, NP>(z, p);                                                                    \
+		if (NQ)                                                                                       \
+			r = div<S>(r, horner<S, NQ>(z, q));                                                       \
+		return S::fma(mul<S>(x, z), r, x);                                                            \
+	}                                                                                                 \
+                                                                                                      \
+	template <typename S, bool Fast>                                                                  \
+	TARGET TT_SIMD_INLINE static typename S::V tanh(typename S::V x)                                  \
+	{                                                                                                 \
+		typedef typename S::V V;                                                                      \
+		typedef MathTables<typename S::T> C;                                                          \
+		const V sign = S::band(x, S::set1(-0.0));                                                     \
+		const V a = S::template apply<OP_ABS>(x);                                                     \
+		const V small = odd_rational<S, C::TANH_P, C::TANH_Q>(x, C::tanh_p(), C::tanh_q());           \
+		const V clamped = S::template apply<OP_MIN>(a, S::set1(C::tanh_limit()));                     \
+		const V e = exp<S, Fast>(add<S>(clamped, clamped));                                           \
+		const V large = sub<S>(S::set1(1), div<S>(S::set1(2), add<S>(e, S::set1(1))));                \
+		return S::select(S::lt(a, S::set1(0.625)), small, S::bxor(large, sign));                      \
+	}                                                                                                 \
+                                                                                                      \
+	/* e^|x| / 2 -+ e^-|x| / 2, small |x| of sinh through its series */                               \
+	template <typename S, bool Fast, bool Cosh>                                                       \
+	TARGET TT_SIMD_INLINE static typename S::V hyperbolic(typename S::V x)                            \
+	{                                                                                                 \
+		typedef typename S::V V;                                                                      \
+		typedef MathTables<typename S::T> C;                                                          \
+		const V a = S::template apply<OP_ABS>(x);                                                     \
+		const V e = exp<S, Fast>(a);                                                                  \
+		const V half = mul<S>(S::set1(0.5), e);                                                       \
+		const V inverse = div<S>(S::set1(0.5), e);                                                    \
+		if (Cosh)                                                                                     \
+			return add<S>(half, inverse);                                                             \
+		const V large = S::bxor(sub<S>(half, inverse), S::band(x, S::set1(-0.0)));                    \
+		const V small = odd_rational<S, C::SINH_P, C::SINH_Q>(x, C::sinh_p(), C::sinh_q());           \
+		return S::select(S::lt(a, S::set1(1)), small, large);                                         \
+	}                                                                                                 \
+                                                                                                      \
+	template <typename S, int Function, bool Fast>                                                    \
+	TARGET TT_SIMD_INLINE static typename S::V kernel(typename S::V x)                                \
+	{                                                                                                 \
+		typedef MathTables<typename S::T> C;                                                          \
+		switch (Function) {                                                                           \
+		case MATH_EXP: return exp<S, Fast>(x);                                                        \
+		case MATH_LOG: return log<S, Fast>(x);                                                        \
+		case MATH_LOG10: return mul<S>(log<S, Fast>(x), S::set1(C::ivln10()));                        \
+		case MATH_SIN: return sincos<S, false>(x);                                                    \
+		case MATH_COS: return sincos<S, true>(x);                                                     \
+		case MATH_SINH: return hyperbolic<S, Fast, false>(x);                                         \
+		case MATH_COSH: return hyperbolic<S, Fast, true>(x);                                          \
+		default: return tanh<S, Fast>(x);                                                             \
+		}                                                                                             \
+	}                                                                                                 \
+                                                                                                      \
+	/* lanes outside the kernel's domain are patched with libm, dst may be a */                       \
+	template <typename S, int Function, bool Fast>                                                    \
+	TARGET static void math(const typename S::T* a, typename S::T* dst, long n)                       \
+	{                                                                                                 \
+		typedef typename S::T T;                                                                      \
+		typedef typename S::V V;                                                                      \
+		const V lo = S::set1(MathTables<T>::lower(Function));                                         \
+		const V hi = S::set1(MathTables<T>::upper(Function));                                         \
+		T lanes[S::W];                                                                                \
+		long i = 0;                                                                                   \
+		for (; i < n; i += S::W) {                                                                    \
+			const int count = n - i < S::W ? (int)(n - i) : (int)S::W;                                \
+			V x;                                                                                      \
+			if (count == S::W) {                                                                      \
+				x = S::load(a + i);                                                                   \
+			}                                                                                         \
+			else {                                                                                    \
+				for (int l = 0; l < S::W; l++)                                                        \
+					lanes[l] = l < count ? a[i + l] : T(1);                                           \
+				x = S::load(lanes);                                                                   \
+			}                                                                                         \
+			const int outside = S::bits(S::outside(x, lo, hi));                                       \
+			if (outside)                                                                              \
+				S::store(lanes, x);                                                                   \
+			const V y = kernel<S, Function, Fast>(x);                                                 \
+			if (count == S::W && !outside) {                                                          \
+				S::store(dst + i, y);                                                                 \
+				continue;                                                                             \
+			}                                                                                         \
+			T result[S::W];                                                                           \
+			S::store(result, y);                                                                      \
+			for (int l = 0; l < count; l++)                                                           \
+				dst[i + l] = outside >> l & 1 ? scalar_math<Function>(lanes[l]) : result[l];          \
+		}                                                                                             \
+	}                                                                                                 \
+};
+
+TT_SIMD_MATH(Sse2Math, TT_TARGET_SSE2)
+TT_SIMD_MATH(Avx2Math, TT_TARGET_AVX2)
+TT_SIMD_MATH(Avx512Math, TT_TARGET_AVX512)
+
+#undef TT_SIMD_MATH
+
+/*
+ * In-register 4x4 float and 2x2 double transposes
+ */
+TT_TARGET_SSE2
+inline void transpose_tile_sse2(const float* src, long rs_src, float* dst, long rs_dst)
+{
+	__m128 r0 = _mm_loadu_ps(src);
+	__m128 r1 = _mm_loadu_ps(src + rs_src);
+	__m128 r2 = _mm_loadu_ps(src + 2 * rs_src);
+	__m128 r3 = _mm_loadu_ps(src + 3 * rs_src);
+	_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+	_mm_storeu_ps(dst, r0);
+	_mm_storeu_ps(dst + rs_dst, r1);
+	_mm_storeu_ps(dst + 2 * rs_dst, r2);
+	_mm_storeu_ps(dst + 3 * rs_dst, r3);
+}
+
+TT_TARGET_SSE2
+inline void transpose_tile_sse2(const double* src, long rs_src, double* dst, long rs_dst)
+{
+	const __m128d r0 = _mm_loadu_pd(src);
+	const __m128d r1 = _mm_loadu_pd(src + rs_src);
+	_mm_storeu_pd(dst, _mm_unpacklo_pd(r0, r1));
+	_mm_storeu_pd(dst + rs_dst, _mm_unpackhi_pd(r0, r1));
+}
+
+/*
+ * Four tiles stacked on top of each other, streamed as full cache lines
+ */
+TT_TARGET_SSE2
+inline void transpose_panel_sse2(const float* src, long rs_src, float* dst, long rs_dst)
+{
+	for (int q = 0; q < 4; q++) {
+		const float* s = src + 4 * q * rs_src;
+		__m128 r0 = _mm_loadu_ps(s);
+		__m128 r1 = _mm_loadu_ps(s + rs_src);
+		__m128 r2 = _mm_loadu_ps(s + 2 * rs_src);
+		__m128 r3 = _mm_loadu_ps(s + 3 * rs_src);
+		_MM_TRANSPOSE4_PS(r0, r1, r2, r3);
+		_mm_stream_ps(dst + 4 * q, r0);
+		_mm_stream_ps(dst + rs_dst + 4 * q, r1);
+		_mm_stream_ps(dst + 2 * rs_dst + 4 * q, r2);
+		_mm_stream_ps(dst + 3 * rs_dst + 4 * q, r3);
+	}
+}
+
+TT_TARGET_SSE2
+inline void transpose_panel_sse2(const double* src, long rs_src, double* dst, long rs_dst)
+{
+	for (int q = 0; q < 4; q++) {
+		const __m128d r0 = _mm_loadu_pd(src + 2 * q * rs_src);
+		const __m128d r1 = _mm_loadu_pd(src + (2 * q + 1) * rs_src);
+		_mm_stream_pd(dst + 2 * q, _mm_unpacklo_pd(r0, r1));
+		_mm_stream_pd(dst + rs_dst + 2 * q, _mm_unpackhi_pd(r0, r1));
+	}
+}
+
+/*
+ * In-register 8x8 float and 4x4 double transposes, also used on AVX-512
+ * machines (the 16 wide tiles would no longer fit an L1 leaf). The panel
+ * versions transpose two tiles stacked on top of each other and stream
+ * the resulting full cache lines.
+ */
+TT_TARGET_AVX2 TT_SIMD_INLINE
+void transpose_registers_avx2(const float* src, long rs_src, __m256* out)
+{
+	TT_UNROLL
+	for (int i = 0; i < 8; i++)
+		out[i] = _mm256_loadu_ps(src + i * rs_src);
+	Avx2Float::transpose(out);
+}
+
+TT_TARGET_AVX2 TT_SIMD_INLINE
+void transpose_registers_avx2(const double* src, long rs_src, __m256d* out)
+{
+	TT_UNROLL
+	for (int i = 0; i < 4; i++)
+		out[i] = _mm256_loadu_pd(src + i * rs_src);
+	Avx2Double::transpose(out);
+}
+
+TT_TARGET_AVX2
+inline void transpose_tile_avx2(const float* src, long rs_src, float* dst, long rs_dst)
+{
+	__m256 out[8];
+	transpose_registers_avx2(src, rs_src, out);
+	TT_UNROLL
+	for (int i = 0; i < 8; i++)
+		_mm256_storeu_ps(dst + i * rs_dst, out[i]);
+}
+
+TT_TARGET_AVX2
+inline void transpose_tile_avx2(const double* src, long rs_src, double* dst, long rs_dst)
+{
+	__m256d out[4];
+	transpose_registers_avx2(src, rs_src, out);
+	TT_UNROLL
+	for (int i = 0; i < 4; i++)
+		_mm256_storeu_pd(dst + i * rs_dst, out[i]);
+}
+
+TT_TARGET_AVX2
+inline void transpose_panel_avx2(const float* src, long rs_src, float* dst, long rs_dst)
+{
+	__m256 top[8], bottom[8];
+	transpose_registers_avx2(src, rs_src, top);
+	transpose_registers_avx2(src + 8 * rs_src, rs_src, bottom);
+	TT_UNROLL
+	for (int i = 0; i < 8; i++) {
+		_mm256_stream_ps(dst + i * rs_dst, top[i]);
+		_mm256_stream_ps(dst + i * rs_dst + 8, bottom[i]);
+	}
+}
+
+TT_TARGET_AVX2
+inline void transpose_panel_avx2(const double* src, long rs_src, double* dst, long rs_dst)
+{
+	__m256d top[4], bottom[4];
+	transpose_registers_avx2(src, rs_src, top);
+	transpose_registers_avx2(src + 4 * rs_src, rs_src, bottom);
+	TT_UNROLL
+	for (int i = 0; i < 4; i++) {
+		_mm256_stream_pd(dst + i * rs_dst, top[i]);
+		_mm256_stream_pd(dst + i * rs_dst + 4, bottom[i]);
+	}
+}
+
+TT_TARGET_SSE2
+inline void stream_fence()
+{
+	_mm_sfence();
+}
+
+/*
+ * Transpose for matrices well beyond the caches. Rows of the source are
+ * taken a cache line worth at a time (16 float or 8 double rows), so every
+ * Tile columns come out as Tile complete lines of dst which Panel writes
+ * with non temporal (streaming) stores: no read for ownership and no eviction of the
+ * source. Needs each dst row to start at the same offset in a cache line;
+ * rows before the first aligned line and the remainder go through
+ * transpose_block.
+ */
+template <typename T, int Tile, void (*Kernel)(const T*, long, T*, long), void (*Panel)(const T*, long, T*, long)>
+void transpose_streamed(const T* src, int rows, int cols, T* dst)
+{
+	const int line = 64 / sizeof(T);
+	const long stream_size = 1L << 20;
+	const std::size_t misaligned = (std::size_t)dst % 64;
+	if ((long)rows * cols < stream_size || (rows * sizeof(T)) % 64 != 0 || misaligned % sizeof(T) != 0) {
+		transpose_tiled<T, Tile, Kernel>(src, rows, cols, dst);
+		return;
+	}
+
+	const int lead = (int)(((64 - misaligned) % 64) / sizeof(T));
+	const int panels = (rows - lead) / line;
+	const int end = lead + panels * line;
+	transpose_block<T, Tile, Kernel>(src, cols, dst, rows, lead, cols);
+	transpose_block<T, Tile, Kernel>(src + (long)end * cols, cols, dst + end, rows, rows - end, cols);
+
+	const int band = 512;
+	const int bands = (cols + band - 1) / band;
+	ThreadPool::instance().run(bands, [&](int task) {
+		const int c0 = task * band;
+		const int c1 = std::min(cols, c0 + band);
+		for (int r = lead; r < end; r += line) {
+			int c = c0;
+			for (; c + Tile <= c1; c += Tile)
+				Panel(src + (long)r * cols + c, cols, dst + (long)c * rows + r, rows);
+			for (; c < c1; c++)
+				for (int i = 0; i < line; i++)
+					dst[(long)c * rows + r + i] = src[(long)(r + i) * cols + c];
+		}
+		// order the streaming stores before the task is reported done
+		stream_fence();
+	});
+}
+#endif
+
+/*
+ * Function table behind the elementwise operators, reductions and
+ * transpose. abs, sqrt and math are only filled in for float and double.
+ */
+template <typename T>
+struct ElementKernels
+{
+	typedef void (*Binary)(const T* a, const T* b, T* dst, long n);
+	typedef void (*Scalar)(const T* a, T value, T* dst, long n);
+	typedef void (*Unary)(const T* a, T* dst, long n);
+	typedef T (*Reduce)(const T* a, long n);
+	typedef void (*Transpose)(const T* src, int rows, int cols, T* dst);
+	typedef void (*TransposeSquare)(T* a, int n);
+
+	Binary add;
+	Binary sub;
+	Binary mul;
+	Binary div;
+	// elementwise min(a[i], b[i]) and max(a[i], b[i])
+	Binary minimum;
+	Binary maximum;
+
+	Scalar add_scalar;
+	Scalar sub_scalar;
+	Scalar mul_scalar;
+	Scalar div_scalar;
+	// value / a[i]
+	Scalar rdiv_scalar;
+
+	Unary abs;
+	Unary sqrt;
+	// indexed by ElementMath, then accurate (0) or fast (1)
+	Unary math[MATH_FUNCTIONS][2];
+
+	Reduce sum;
+	Reduce min;
+	Reduce max;
+
+	Transpose transpose;
+	TransposeSquare transpose_square;
+};
+
+template <typename T>
+ElementKernels<T> portable_element_kernels()
+{
+	ElementKernels<T> k;
+	k.add = &portable_binary<T, OP_ADD>;
+	k.sub = &portable_binary<T, OP_SUB>;
+	k.mul = &portable_binary<T, OP_MUL>;
+	k.div = &portable_binary<T, OP_DIV>;
+	k.minimum = &portable_binary<T, OP_MIN>;
+	k.maximum = &portable_binary<T, OP_MAX>;
+	k.add_scalar = &portable_scalar<T, OP_ADD, false>;
+	k.sub_scalar = &portable_scalar<T, OP_SUB, false>;
+	k.mul_scalar = &portable_scalar<T, OP_MUL, false>;
+	k.div_scalar = &portable_scalar<T, OP_DIV, false>;
+	k.rdiv_scalar = &portable_scalar<T, OP_DIV, true>;
+	k.abs = 0;
+	k.sqrt = 0;
+	for (int f = 0; f < MATH_FUNCTIONS; f++)
+		k.math[f][0] = k.math[f][1] = 0;
+	k.sum = &portable_reduce<T, OP_ADD>;
+	k.min = &portable_reduce<T, OP_MIN>;
+	k.max = &portable_reduce<T, OP_MAX>;
+	k.transpose = &transpose_tiled<T, 4, &transpose_tile_ref<T, 4> >;
+	k.transpose_square = &transpose_square<T, 4, &transpose_tile_ref<T, 4> >;
+	return k;
+}
+
+template <typename T, int Function>
+void fill_portable_math_kernel(ElementKernels<T>& k)
+{
+	k.math[Function][0] = k.math[Function][1] = &portable_math<T, Function>;
+}
+
+template <typename T>
+void fill_portable_math_kernels(ElementKernels<T>& k)
+{
+	fill_portable_math_kernel<T, MATH_EXP>(k);
+	fill_portable_math_kernel<T, MATH_LOG>(k);
+	fill_portable_math_kernel<T, MATH_LOG10>(k);
+	fill_portable_math_kernel<T, MATH_SIN>(k);
+	fill_portable_math_kernel<T, MATH_COS>(k);
+	fill_portable_math_kernel<T, MATH_SINH>(k);
+	fill_portable_math_kernel<T, MATH_COSH>(k);
+	fill_portable_math_kernel<T, MATH_TANH>(k);
+}
+
+#if defined(TT_X86_SIMD)
+template <typename A, typename S, int Function>
+void fill_simd_math_kernel(ElementKernels<typename S::T>& k)
+{
+	k.math[Function][0] = &A::template math<S, Function, false>;
+	k.math[Function][1] = &A::template math<S, Function, true>;
+}
+
+template <typename A, typename S>
+void fill_simd_math_kernels(ElementKernels<typename S::T>& k)
+{
+	fill_simd_math_kernel<A, S, MATH_EXP>(k);
+	fill_simd_math_kernel<A, S, MATH_LOG>(k);
+	fill_simd_math_kernel<A, S, MATH_LOG10>(k);
+	fill_simd_math_kernel<A, S, MATH_SIN>(k);
+	fill_simd_math_kernel<A, S, MATH_COS>(k);
+	fill_simd_math_kernel<A, S, MATH_SINH>(k);
+	fill_simd_math_kernel<A, S, MATH_COSH>(k);
+	fill_simd_math_kernel<A, S, MATH_TANH>(k);
+}
+
+template <typename A, typename S>
+void fill_simd_element_kernels(ElementKernels<typename S::T>& k)
+{
+	k.add = &A::template binary<S, OP_ADD>;
+	k.sub = &A::template binary<S, OP_SUB>;
+	k.mul = &A::template binary<S, OP_MUL>;
+	k.div = &A::template binary<S, OP_DIV>;
+	k.minimum = &A::template binary<S, OP_MIN>;
+	k.maximum = &A::template binary<S, OP_MAX>;
+	k.add_scalar = &A::template scalar<S, OP_ADD, false>;
+	k.sub_scalar = &A::template scalar<S, OP_SUB, false>;
+	k.mul_scalar = &A::template scalar<S, OP_MUL, false>;
+	k.div_scalar = &A::template scalar<S, OP_DIV, false>;
+	k.rdiv_scalar = &A::template scalar<S, OP_DIV, true>;
+	k.abs = &A::template unary<S, OP_ABS>;
+	k.sqrt = &A::template unary<S, OP_SQRT>;
+	k.sum = &A::template reduce<S, OP_ADD>;
+	k.min = &A::template reduce<S, OP_MIN>;
+	k.max = &A::template reduce<S, OP_MAX>;
+}
+#endif
+
+template <typename T>
+ElementKernels<T> select_element_kernels()
+{
+	return portable_element_kernels<T>();
+}
+
+template <>
+inline ElementKernels<float> select_element_kernels<float>()
+{
+	ElementKernels<float> k = portable_element_kernels<float>();
+	k.abs = &portable_unary<float, OP_ABS>;
+	k.sqrt = &portable_unary<float, OP_SQRT>;
+	fill_portable_math_kernels(k);
+#if defined(TT_X86_SIMD)
+	switch (simd_level()) {
+	case SIMD_AVX512:
+		fill_simd_element_kernels<Avx512Algorithms, Avx512Float>(k);
+		fill_simd_math_kernels<Avx512Math, Avx512Float>(k);
+		break;
+	case SIMD_AVX2:
+		fill_simd_element_kernels<Avx2Algorithms, Avx2Float>(k);
+		fill_simd_math_kernels<Avx2Math, Avx2Float>(k);
+		break;
+	case SIMD_SSE2:
+		fill_simd_element_kernels<Sse2Algorithms, Sse2Float>(k);
+		fill_simd_math_kernels<Sse2Math, Sse2Float>(k);
+		break;
+	default: break;
+	}
+	if (simd_level() >= SIMD_AVX2) {
+		k.transpose = &transpose_streamed<float, 8, &transpose_tile_avx2, &transpose_panel_avx2>;
+		k.transpose_square = &transpose_square<float, 8, &transpose_tile_avx2>;
+	}
+	else if (simd_level() >= SIMD_SSE2) {
+		k.transpose = &transpose_streamed<float, 4, &transpose_tile_sse2, &transpose_panel_sse2>;
+		k.transpose_square = &transpose_square<float, 4, &transpose_tile_sse2>;
+	}
+#endif
+	return k;
+}
+
+template <>
+inline ElementKernels<double> select_element_kernels<double>()
+{
+	ElementKernels<double> k = portable_element_kernels<double>();
+	k.abs = &portable_unary<double, OP_ABS>;
+	k.sqrt = &portable_unary<double, OP_SQRT>;
+	fill_portable_math_kernels(k);
+#if defined(TT_X86_SIMD)
+	switch (simd_level()) {
+	case SIMD_AVX512:
+		fill_simd_element_kernels<Avx512Algorithms, Avx512Double>(k);
+		fill_simd_math_kernels<Avx512Math, Avx512Double>(k);
+		break;
+	case SIMD_AVX2:
+		fill_simd_element_kernels<Avx2Algorithms, Avx2Double>(k);
+		fill_simd_math_kernels<Avx2Math, Avx2Double>(k);
+		break;
+	case SIMD_SSE2:
+		fill_simd_element_kernels<Sse2Algorithms, Sse2Double>(k);
+		fill_simd_math_kernels<Sse2Math, Sse2Double>(k);
+		break;
+	default: break;
+	}
+	if (simd_level() >= SIMD_AVX2) {
+		k.transpose = &transpose_streamed<double, 4, &transpose_tile_avx2, &transpose_panel_avx2>;
+		k.transpose_square = &transpose_square<double, 4, &transpose_tile_avx2>;
+	}
+	else if (simd_level() >= SIMD_SSE2) {
+		k.transpose = &transpose_streamed<double, 2, &transpose_tile_sse2, &transpose_panel_sse2>;
+		k.transpose_square = &transpose_square<double, 2, &transpose_tile_sse2>;
+	}
+#endif
+	return k;
+}
+
+/*
+ * Kernels for T, resolved against the host CPU on first use
+ */
+template <typename T>
+const ElementKernels<T>& element_kernels()
+{
+	static const ElementKernels<T> kernels = select_element_kernels<T>();
+	return kernels;
+}
+
+/*
+ * abs and sqrt for arbitrary element types; float and double dispatch
+ */
+template <typename T>
+void elementwise_abs(const T* a, T* dst, long n)
+{
+	portable_unary<T, OP_ABS>(a, dst, n);
+}
+
+inline void elementwise_abs(const float* a, float* dst, long n) { element_kernels<float>().abs(a, dst, n); }
+inline void elementwise_abs(const double* a, double* dst, long n) { element_kernels<double>().abs(a, dst, n); }
+
+template <typename T>
+void elementwise_sqrt(const T* a, T* dst, long n)
+{
+	portable_unary<T, OP_SQRT>(a, dst, n);
+}
+
+inline void elementwise_sqrt(const float* a, float* dst, long n) { element_kernels<float>().sqrt(a, dst, n); }
+inline void elementwise_sqrt(const double* a, double* dst, long n) { element_kernels<double>().sqrt(a, dst, n); }
+
+/*
+ * ElementMath Function for arbitrary element types; float and double
+ * dispatch, fast selects the shorter polynomials
+ */
+template <int Function, typename T>
+void elementwise_math(const T* a, T* dst, long n, bool)
+{
+	portable_math<T, Function>(a, dst, n);
+}
+
+template <int Function>
+void elementwise_math(const float* a, float* dst, long n, bool fast)
+{
+	element_kernels<float>().math[Function][fast](a, dst, n);
+}
+
+template <int Function>
+void elementwise_math(const double* a, double* dst, long n, bool fast)
+{
+	element_kernels<double>().math[Function][fast](a, dst, n);
+}
+
+/*
+ * Cache blocking of the GEMM loops:
+ *   KC x NR sliver of B stays in L1,
+ *   MC x KC block of A stays in L2,
+ *   KC x NC panel of B stays in L3.
+ */
+template <typename T>
+struct GemmBlocking
+{
+	enum { MC = 96, KC = 256, NC = 4096 };
+};
+
+template <>
+struct GemmBlocking<float>
+{
+	enum { MC = 144, KC = 256, NC = 4096 };
+};
+
+/*
+ * Microkernel computes C[mr x nr] = alpha * A_panel * B_panel + beta * C
+ * over kc packed columns. C is not read when beta is zero.
+ */
+template <typename T>
+struct GemmKernel
+{
+	typedef void (*Function)(int kc, T alpha, const T* a, const T* b, T beta, T* c, long rs_c, long cs_c);
+
+	int mr;
+	int nr;
+	Function run;
+};
+
+template <typename T, int MR, int NR>
+void gemm_ukernel_ref(int kc, T alpha, const T* a, const T* b, T beta, T* c, long rs_c, long cs_c)
+{
+	T ab[MR * NR];
+	for (int i = 0; i < MR * NR; i++)
+		ab[i] = T(0);
+
+	for (int p = 0; p < kc; p++) {
+		for (int i = 0; i < MR; i++) {
+			const T a_value = a[i];
+			for (int j = 0; j < NR; j++)
+				ab[i * NR + j] += a_value * b[j];
+		}
+		a += MR;
+		b += NR;
+	}
+
+	for (int i = 0; i < MR; i++) {
+		for (int j = 0; j < NR; j++) {
+			T& dst = c[i * rs_c + j * cs_c];
+			if (beta == T(0))
+				dst = alpha * ab[i * NR + j];
+			else
+				dst = beta * dst + alpha * ab[i * NR + j];
+		}
+	}
+}
+
+#if defined(TT_X86_SIMD)
+/*
+ * Writes a spilled mr x nr register tile to C when C is not row contiguous
+ */
+template <typename T>
+inline void gemm_store_tile(int mr, int nr, T alpha, const T* ab, T beta, T* c, long rs_c, long cs_c)
+{
+	for (int i = 0; i < mr; i++) {
+		for (int j = 0; j < nr; j++) {
+			T& dst = c[i * rs_c + j * cs_c];
+			if (beta == T(0))
+				dst = alpha * ab[i * nr + j];
+			else
+				dst = beta * dst + alpha * ab[i * nr + j];
+		}
+	}
+}
+
+/*
+ * SSE2 tiles (no FMA): 6x8 float and 6x4 double, 12 xmm accumulators
+ */
+TT_TARGET_SSE2
+inline void gemm_ukernel_sse2_6x8(int kc, float alpha, const float* a, const float* b, float beta,
+                                  float* c, long rs_c, long cs_c)
+{
+	__m128 ab[6][2];
+	TT_UNROLL
+	for (int i = 0; i < 6; i++) {
+		ab[i][0] = _mm_setzero_ps();
+		ab[i][1] = _mm_setzero_ps();
+	}
+
+	for (int p = 0; p < kc; p++) {
+		const __m128 b0 = _mm_loadu_ps(b);
+		const __m128 b1 = _mm_loadu_ps(b + 4);
+		TT_UNROLL
+		for (int i = 0; i < 6; i++) {
+			const __m128 a_value = _mm_set1_ps(a[i]);
+			ab[i][0] = _mm_add_ps(ab[i][0], _mm_mul_ps(a_value, b0));
+			ab[i][1] = _mm_add_ps(ab[i][1], _mm_mul_ps(a_value, b1));
+		}
+		a += 6;
+		b += 8;
+	}
+
+	TT_ALIGN(64) float tile[6 * 8];
+	for (int i = 0; i < 6; i++) {
+		_mm_store_ps(tile + i * 8, ab[i][0]);
+		_mm_store_ps(tile + i * 8 + 4, ab[i][1]);
+	}
+	gemm_store_tile(6, 8, alpha, tile, beta, c, rs_c, cs_c);
+}
+
+TT_TARGET_SSE2
+inline void gemm_ukernel_sse2_6x4(int kc, double alpha, const double* a, const double* b, double beta,
+                                  double* c, long rs_c, long cs_c)
+{
+	__m128d ab[6][2];
+	TT_UNROLL
+	for (int i = 0; i < 6; i++) {
+		ab[i][0] = _mm_setzero_pd();
+		ab[i][1] = _mm_setzero_pd();
+	}
+
+	for (int p = 0; p < kc; p++) {
+		const __m128d b0 = _mm_loadu_pd(b);
+		const __m128d b1 = _mm_loadu_pd(b + 2);
+		TT_UNROLL
+		for (int i = 0; i < 6; i++) {
+			const __m128d a_value = _mm_set1_pd(a[i]);
+			ab[i][0] = _mm_add_pd(ab[i][0], _mm_mul_pd(a_value, b0));
+			ab[i][1] = _mm_add_pd(ab[i][1], _mm_mul_pd(a_value, b1));
+		}
+		a += 6;
+		b += 4;
+	}
+
+	TT_ALIGN(64) double tile[6 * 4];
+	for (int i = 0; i < 6; i++) {
+		_mm_store_pd(tile + i * 4, ab[i][0]);
+		_mm_store_pd(tile + i * 4 + 2, ab[i][1]);
+	}
+	gemm_store_tile(6, 4, alpha, tile, beta, c, rs_c, cs_c);
+}
+
+/*
+ * 6x16 float tile: 12 ymm accumulators, two ymm loads of B and one
+ * broadcast of A per row and k step.
+ */
+TT_TARGET_AVX2
+inline void gemm_ukernel_avx2_6x16(int kc, float alpha, const float* a, const float* b, float beta,
+                                   float* c, long rs_c, long cs_c)
+{
+	__m256 ab[6][2];
+	TT_UNROLL
+	for (int i = 0; i < 6; i++) {
+		ab[i][0] = _mm256_setzero_ps();
+		ab[i][1] = _mm256_setzero_ps();
+	}
+
+	for (int p = 0; p < kc; p++) {
+		const __m256 b0 = _mm256_loadu_ps(b);
+		const __m256 b1 = _mm256_loadu_ps(b + 8);
+		TT_UNROLL
+		for (int i = 0; i < 6; i++) {
+			const __m256 a_value = _mm256_broadcast_ss(a + i);
+			ab[i][0] = _mm256_fmadd_ps(a_value, b0, ab[i][0]);
+			ab[i][1] = _mm256_fmadd_ps(a_value, b1, ab[i][1]);
+		}
+		a += 6;
+		b += 16;
+	}
+
+	const __m256 alpha_v = _mm256_set1_ps(alpha);
+	if (cs_c != 1) {
+		TT_ALIGN(64) float tile[6 * 16];
+		for (int i = 0; i < 6; i++) {
+			_mm256_store_ps(tile + i * 16, ab[i][0]);
+			_mm256_store_ps(tile + i * 16 + 8, ab[i][1]);
+		}
+		gemm_store_tile(6, 16, alpha, tile, beta, c, rs_c, cs_c);
+		return;
+	}
+
+	const __m256 beta_v = _mm256_set1_ps(beta);
+	TT_UNROLL
+	for (int i = 0; i < 6; i++) {
+		float* row = c + i * rs_c;
+		__m256 r0 = _mm256_mul_ps(alpha_v, ab[i][0]);
+		__m256 r1 = _mm256_mul_ps(alpha_v, ab[i][1]);
+		if (beta != 0.0f) {
+			r0 = _mm256_fmadd_ps(beta_v, _mm256_loadu_ps(row), r0);
+			r1 = _mm256_fmadd_ps(beta_v, _mm256_loadu_ps(row + 8), r1);
+		}
+		_mm256_storeu_ps(row, r0);
+		_mm256_storeu_ps(row + 8, r1);
+	}
+}
+
+/*
+ * 6x8 double tile, same register layout as the float kernel
+ */
+TT_TARGET_AVX2
+inline void gemm_ukernel_avx2_6x8(int kc, double alpha, const double* a, const double* b, double beta,
+                                  double* c, long rs_c, long cs_c)
+{
+	__m256d ab[6][2];
+	TT_UNROLL
+	for (int i = 0; i < 6; i++) {
+		ab[i][0] = _mm256_setzero_pd();
+		ab[i][1] = _mm256_setzero_pd();
+	}
+
+	for (int p = 0; p < kc; p++) {
+		const __m256d b0 = _mm256_loadu_pd(b);
+		const __m256d b1 = _mm256_loadu_pd(b + 4);
+		TT_UNROLL
+		for (int i = 0; i < 6; i++) {
+			const __m256d a_value = _mm256_broadcast_sd(a + i);
+			ab[i][0] = _mm256_fmadd_pd(a_value, b0, ab[i][0]);
+			ab[i][1] = _mm256_fmadd_pd(a_value, b1, ab[i][1]);
+		}
+		a += 6;
+		b += 8;
+	}
+
+	const __m256d alpha_v = _mm256_set1_pd(alpha);
+	if (cs_c != 1) {
+		TT_ALIGN(64) double tile[6 * 8];
+		for (int i = 0; i < 6; i++) {
+			_mm256_store_pd(tile + i * 8, ab[i][0]);
+			_mm256_store_pd(tile + i * 8 + 4, ab[i][1]);
+		}
+		gemm_store_tile(6, 8, alpha, tile, beta, c, rs_c, cs_c);
+		return;
+	}
+
+	const __m256d beta_v = _mm256_set1_pd(beta);
+	TT_UNROLL
+	for (int i = 0; i < 6; i++) {
+		double* row = c + i * rs_c;
+		__m256d r0 = _mm256_mul_pd(alpha_v, ab[i][0]);
+		__m256d r1 = _mm256_mul_pd(alpha_v, ab[i][1]);
+		if (beta != 0.0) {
+			r0 = _mm256_fmadd_pd(beta_v, _mm256_loadu_pd(row), r0);
+			r1 = _mm256_fmadd_pd(beta_v, _mm256_loadu_pd(row + 4), r1);
+		}
+		_mm256_storeu_pd(row, r0);
+		_mm256_storeu_pd(row + 4, r1);
+	}
+}
+
+/*
+ * 6x32 float tile on zmm registers
+ */
+TT_TARGET_AVX512
+inline void gemm_ukernel_avx512_6x32(int kc, float alpha, const float* a, const float* b, float beta,
+                                     float* c, long rs_c, long cs_c)
+{
+	__m512 ab[6][2];
+	TT_UNROLL
+	for (int i = 0; i < 6; i++) {
+		ab[i][0] = _mm512_setzero_ps();
+		ab[i][1] = _mm512_setzero_ps();
+	}
+
+	for (int p = 0; p < kc; p++) {
+		const __m512 b0 = _mm512_loadu_ps(b);
+		const __m512 b1 = _mm512_loadu_ps(b + 16);
+		TT_UNROLL
+		for (int i = 0; i < 6; i++) {
+			const __m512 a_value = _mm512_set1_ps(a[i]);
+			ab[i][0] = _mm512_fmadd_ps(a_value, b0, ab[i][0]);
+			ab[i][1] = _mm512_fmadd_ps(a_value, b1, ab[i][1]);
+		}
+		a += 6;
+		b += 32;
+	}
+
+	const __m512 alpha_v = _mm512_set1_ps(alpha);
+	if (cs_c != 1) {
+		TT_ALIGN(64) float tile[6 * 32];
+		for (int i = 0; i < 6; i++) {
+			_mm512_store_ps(tile + i * 32, ab[i][0]);
+			_mm512_store_ps(tile + i * 32 + 16, ab[i][1]);
+		}
+		gemm_store_tile(6, 32, alpha, tile, beta, c, rs_c, cs_c);
+		return;
+	}
+
+	const __m512 beta_v = _mm512_set1_ps(beta);
+	TT_UNROLL
+	for (int i = 0; i < 6; i++) {
+		float* row = c + i * rs_c;
+		__m512 r0 = _mm512_mul_ps(alpha_v, ab[i][0]);
+		__m512 r1 = _mm512_mul_ps(alpha_v, ab[i][1]);
+		if (beta != 0.0f) {
+			r0 = _mm512_fmadd_ps(beta_v, _mm512_loadu_ps(row), r0);
+			r1 = _mm512_fmadd_ps(beta_v, _mm512_loadu_ps(row + 16), r1);
+		}
+		_mm512_storeu_ps(row, r0);
+		_mm512_storeu_ps(row + 16, r1);
+	}
+}
+
+/*
+ * 6x16 double tile on zmm registers
+ */
+TT_TARGET_AVX512
+inline void gemm_ukernel_avx512_6x16(int kc, double alpha, const double* a, const double* b, double beta,
+                                     double* c, long rs_c, long cs_c)
+{
+	__m512d ab[6][2];
+	TT_UNROLL
+	for (int i = 0; i < 6; i++) {
+		ab[i][0] = _mm512_setzero_pd();
+		ab[i][1] = _mm512_setzero_pd();
+	}
+
+	for (int p = 0; p < kc; p++) {
+		const __m512d b0 = _mm512_loadu_pd(b);
+		const __m512d b1 = _mm512_loadu_pd(b + 8);
+		TT_UNROLL
+		for (int i = 0; i < 6; i++) {
+			const __m512d a_value = _mm512_set1_pd(a[i]);
+			ab[i][0] = _mm512_fmadd_pd(a_value, b0, ab[i][0]);
+			ab[i][1] = _mm512_fmadd_pd(a_value, b1, ab[i][1]);
+		}
+		a += 6;
+		b += 16;
+	}
+
+	const __m512d alpha_v = _mm512_set1_pd(alpha);
+	if (cs_c != 1) {
+		TT_ALIGN(64) double tile[6 * 16];
+		for (int i = 0; i < 6; i++) {
+			_mm512_store_pd(tile + i * 16, ab[i][0]);
+			_mm512_store_pd(tile + i * 16 + 8, ab[i][1]);
+		}
+		gemm_store_tile(6, 16, alpha, tile, beta, c, rs_c, cs_c);
+		return;
+	}
+
+	const __m512d beta_v = _mm512_set1_pd(beta);
+	TT_UNROLL
+	for (int i = 0; i < 6; i++) {
+		double* row = c + i * rs_c;
+		__m512d r0 = _mm512_mul_pd(alpha_v, ab[i][0]);
+		__m512d r1 = _mm512_mul_pd(alpha_v, ab[i][1]);
+		if (beta != 0.0) {
+			r0 = _mm512_fmadd_pd(beta_v, _mm512_loadu_pd(row), r0);
+			r1 = _mm512_fmadd_pd(beta_v, _mm512_loadu_pd(row + 8), r1);
+		}
+		_mm512_storeu_pd(row, r0);
+		_mm512_storeu_pd(row + 8, r1);
+	}
+}
+#endif
+
+template <typename T>
+const GemmKernel<T>& gemm_kernel()
+{
+	static const GemmKernel<T> kernel = { 4, 4, &gemm_ukernel_ref<T, 4, 4> };
+	return kernel;
+}
+
+/*
+ * The widest kernel the host CPU supports, chosen on first use
+ */
+template <>
+inline const GemmKernel<float>& gemm_kernel<float>()
+{
+	static const GemmKernel<float> reference = { 4, 16, &gemm_ukernel_ref<float, 4, 16> };
+#if defined(TT_X86_SIMD)
+	static const GemmKernel<float> sse2 = { 6, 8, &gemm_ukernel_sse2_6x8 };
+	static const GemmKernel<float> avx2 = { 6, 16, &gemm_ukernel_avx2_6x16 };
+	static const GemmKernel<float> avx512 = { 6, 32, &gemm_ukernel_avx512_6x32 };
+	switch (simd_level()) {
+	case SIMD_AVX512: return avx512;
+	case SIMD_AVX2: return avx2;
+	case SIMD_SSE2: return sse2;
+	default: break;
+	}
+#endif
+	return reference;
+}
+
+template <>
+inline const GemmKernel<double>& gemm_kernel<double>()
+{
+	static const GemmKernel<double> reference = { 4, 8, &gemm_ukernel_ref<double, 4, 8> };
+#if defined(TT_X86_SIMD)
+	static const GemmKernel<double> sse2 = { 6, 4, &gemm_ukernel_sse2_6x4 };
+	static const GemmKernel<double> avx2 = { 6, 8, &gemm_ukernel_avx2_6x8 };
+	static const GemmKernel<double> avx512 = { 6, 16, &gemm_ukernel_avx512_6x16 };
+	switch (simd_level()) {
+	case SIMD_AVX512: return avx512;
+	case SIMD_AVX2: return avx2;
+	case SIMD_SSE2: return sse2;
+	default: break;
+	}
+#endif
+	return reference;
+}
+
+/*
+ * Packs an mc x kc block of A into mr row micro panels. Each panel is
+ * stored column by column so the microkernel reads it sequentially.
+ * Rows past mc are zero padded. A transposed A (rs == 1) is read a
+ * full column of the block at a time, contiguously.
+ */
+template <typename T>
+void gemm_pack_a(int mc, int kc, const T* a, long rs, long cs, int mr, T* dst)
+{
+	if (rs == 1 && cs != 1) {
+		for (int p = 0; p < kc; p++) {
+			const T* column = a + p * cs;
+			for (int i = 0; i < mc; i += mr) {
+				const int rows = std::min(mr, mc - i);
+				T* panel = dst + (long)i * kc + p * mr;
+				for (int r = 0; r < rows; r++)
+					panel[r] = column[i + r];
+				for (int r = rows; r < mr; r++)
+					panel[r] = T(0);
+			}
+		}
+		return;
+	}
+
+	for (int i = 0; i < mc; i += mr) {
+		const int rows = std::min(mr, mc - i);
+		const T* src = a + i * rs;
+		if (cs == 1 && rows == mr) {
+			for (int p = 0; p < kc; p++)
+				for (int r = 0; r < mr; r++)
+					*dst++ = src[r * rs + p];
+		}
+		else {
+			for (int p = 0; p < kc; p++) {
+				for (int r = 0; r < rows; r++)
+					*dst++ = src[r * rs + p * cs];
+				for (int r = rows; r < mr; r++)
+					*dst++ = T(0);
+			}
+		}
+	}
+}
+
+/*
+ * Packs a kc x nc panel of B into nr column micro panels, each stored
+ * row by row. Columns past nc are zero padded. A transposed B (rs == 1)
+ * is read along its rows and scattered into the panel.
+ */
+template <typename T>
+void gemm_pack_b(int kc, int nc, const T* b, long rs, long cs, int nr, T* dst)
+{
+	for (int j = 0; j < nc; j += nr) {
+		const int cols = std::min(nr, nc - j);
+		const T* src = b + j * cs;
+		if (cs == 1 && cols == nr) {
+			for (int p = 0; p < kc; p++) {
+				const T* row = src + p * rs;
+				for (int c = 0; c < nr; c++)
+					*dst++ = row[c];
+			}
+		}
+		else if (rs == 1 && cs != 1) {
+			for (int c = 0; c < cols; c++) {
+				const T* column = src + c * cs;
+				for (int p = 0; p < kc; p++)
+					dst[p * nr + c] = column[p];
+			}
+			for (int p = 0; p < kc; p++)
+				for (int c = cols; c < nr; c++)
+					dst[p * nr + c] = T(0);
+			dst += kc * nr;
+		}
+		else {
+			for (int p = 0; p < kc; p++) {
+				for (int c = 0; c < cols; c++)
+					*dst++ = src[p * rs + c * cs];
+				for (int c = cols; c < nr; c++)
+					*dst++ = T(0);
+			}
+		}
+	}
+}
+
+/*
+ * Copies the columns of B one after another, each B.rows long, for the
+ * dots kernel
+ */
+template <typename T>
+void gemm_pack_columns(const ConstMatrixRef<T>& B, T* dst)
+{
+	for (int p = 0; p < B.rows; p++)
+		for (int j = 0; j < B.cols; j++)
+			dst[(long)j * B.rows + p] = B.data[p * B.rs + j * B.cs];
+}
+
+/*
+ * Packs all of B ahead of the products: every KC row block in turn, as
+ * gemm_pack_b lays out a panel as wide as B, so the block at row pc
+ * starts pc * ld elements in, ld being B.cols rounded up to nr
+ */
+template <typename T>
+void gemm_pack_panels(const ConstMatrixRef<T>& B, int nr, T* dst)
+{
+	const long ld = (B.cols + nr - 1) / nr * nr;
+	for (int pc = 0; pc < B.rows; pc += GemmBlocking<T>::KC) {
+		const int kc = std::min((int)GemmBlocking<T>::KC, B.rows - pc);
+		gemm_pack_b(kc, B.cols, B.data + pc * B.rs, B.rs, B.cs, nr, dst + pc * ld);
+	}
+}
+
+/*
+ * Default epilogue of gemm: nothing
+ */
+struct GemmNoEpilogue
+{
+	template <typename T>
+	void operator()(T*, int, int, int) const {}
+};
+
+/*
+ * Runs the microkernel over every mr x nr tile of an mc x nc block.
+ * Fringe tiles are computed into a local tile and copied out. On the
+ * last k block (finish), once GEMM_EPILOGUE_COLS columns of the block
+ * are done and still in cache, epilogue(row, i, j, n) gets each of
+ * their rows: n elements of C at (i, j), unit stride.
+ */
+enum { GEMM_EPILOGUE_COLS = 256 };
+
+template <typename T, typename Epilogue>
+void gemm_macro_kernel(int mc, int nc, int kc, T alpha, const T* packed_a, const T* packed_b,
+                       T beta, T* c, long rs_c, long cs_c, const GemmKernel<T>& kernel,
+                       const Epilogue& epilogue, bool finish)
+{
+	const int mr = kernel.mr;
+	const int nr = kernel.nr;
+	PackBuffer<T> edge(mr * nr);
+
+	for (int j = 0; j < nc; j += nr) {
+		const int cols = std::min(nr, nc - j);
+		for (int i = 0; i < mc; i += mr) {
+			const int rows = std::min(mr, mc - i);
+			const T* a = packed_a + i * kc;
+			const T* b = packed_b + j * kc;
+			T* tile = c + i * rs_c + j * cs_c;
+
+			if (rows == mr && cols == nr)
+				kernel.run(kc, alpha, a, b, beta, tile, rs_c, cs_c);
+			else {
+				T* tmp = edge.data();
+				kernel.run(kc, T(1), a, b, T(0), tmp, nr, 1);
+				for (int r = 0; r < rows; r++) {
+					for (int s = 0; s < cols; s++) {
+						T& dst = tile[r * rs_c + s * cs_c];
+						if (beta == T(0))
+							dst = alpha * tmp[r * nr + s];
+						else
+							dst = beta * dst + alpha * tmp[r * nr + s];
+					}
+				}
+			}
+		}
+
+		const int done = j + cols;
+		if (finish && (done % GEMM_EPILOGUE_COLS == 0 || done == nc)) {
+			const int first = (j / GEMM_EPILOGUE_COLS) * GEMM_EPILOGUE_COLS;
+			for (int r = 0; r < mc; r++)
+				epilogue(c + r * rs_c + first, r, first, done - first);
+		}
+	}
+}
+
+/*
+ * Blocked C = alpha * A * B + beta * C on the calling thread.
+ *
+ * Goto/BLIS style loop nest: the NC wide panel of B and the MC tall block
+ * of A are packed into contiguous micro panels before the microkernel
+ * walks them, so every inner loop streams unit stride from cache. The B
+ * panels come from panel_b(pc, kc, jc, nc), the kc x nc panel at row pc
+ * and column jc in the gemm_pack_b layout.
+ */
+template <typename T, typename PanelB, typename Epilogue>
+void gemm_blocked_panels(T alpha, const ConstMatrixRef<T>& A, const PanelB& panel_b, T beta,
+                         const MatrixRef<T>& C, const GemmKernel<T>& kernel, const Epilogue& epilogue)
+{
+	const int m = C.rows;
+	const int n = C.cols;
+	const int k = A.cols;
+	const int mr = kernel.mr;
+	const int nr = kernel.nr;
+	const int block_m = std::max(mr, (int)GemmBlocking<T>::MC / mr * mr);
+	const int block_k = (int)GemmBlocking<T>::KC;
+	const int block_n = std::max(nr, (int)GemmBlocking<T>::NC / nr * nr);
+
+	const int mc_max = std::min(block_m, (m + mr - 1) / mr * mr);
+	const int kc_max = std::min(block_k, k);
+
+	PackBuffer<T> packed_a((std::size_t)mc_max * kc_max);
+
+	for (int jc = 0; jc < n; jc += block_n) {
+		const int nc = std::min(block_n, n - jc);
+		for (int pc = 0; pc < k; pc += block_k) {
+			const int kc = std::min(block_k, k - pc);
+			const T beta_block = (pc == 0) ? beta : T(1);
+			const T* packed_b = panel_b(pc, kc, jc, nc);
+
+			for (int ic = 0; ic < m; ic += block_m) {
+				const int mc = std::min(block_m, m - ic);
+				gemm_pack_a(mc, kc, A.data + ic * A.rs + pc * A.cs, A.rs, A.cs, mr, packed_a.data());
+				gemm_macro_kernel(mc, nc, kc, alpha, packed_a.data(), packed_b, beta_block,
+				                  C.data + ic * C.rs + jc * C.cs, C.rs, C.cs, kernel,
+				                  [&](T* row, int i, int j, int count) { epilogue(row, ic + i, jc + j, count); },
+				                  pc + kc == k);
+			}
+		}
+	}
+}
+
+template <typename T, typename Epilogue>
+void gemm_blocked(T alpha, const ConstMatrixRef<T>& A, const ConstMatrixRef<T>& B, T beta,
+                  const MatrixRef<T>& C, const GemmKernel<T>& kernel, const Epilogue& epilogue)
+{
+	const int nr = kernel.nr;
+	const int kc_max = std::min((int)GemmBlocking<T>::KC, A.cols);
+	const int nc_max = std::min(std::max(nr, (int)GemmBlocking<T>::NC / nr * nr), (C.cols + nr - 1) / nr * nr);
+	PackBuffer<T> packed_b((std::size_t)kc_max * nc_max);
+
+	gemm_blocked_panels(alpha, A, [&](int pc, int kc, int jc, int nc) -> const T* {
+		gemm_pack_b(kc, nc, B.data + pc * B.rs + jc * B.cs, B.rs, B.cs, nr, packed_b.data());
+		return packed_b.data();
+	}, beta, C, kernel, epilogue);
+}
+
+/*
+ * Splits an m x n output into a grid of tiles for the thread pool.
+ * Tile edges fall on mr/nr multiples so every element sees the same
+ * microkernel tiling, and therefore the same rounding, as the single
+ * threaded run.
+ */
+struct GemmPartition
+{
+	int tile_m;
+	int tile_n;
+	int grid_m;
+	int grid_n;
+
+	GemmPartition(int m, int n, int k, int mr, int nr, int threads)
+	{
+		const double flops = 2.0 * m * n * k;
+		if (threads > 1 && flops < 2.0 * 64 * 64 * 64)
+			threads = 1;
+
+		const int row_tiles = (m + mr - 1) / mr;
+		const int col_tiles = (n + nr - 1) / nr;
+
+		// aim for square-ish tiles: grid_m / grid_n ~ (m / n)
+		int gm = (int)(std::sqrt((double)threads * m / n) + 0.5);
+		gm = std::max(1, std::min(gm, std::min(threads, row_tiles)));
+		int gn = std::max(1, std::min((threads + gm - 1) / gm, col_tiles));
+
+		tile_m = (row_tiles + gm - 1) / gm * mr;
+		tile_n = (col_tiles + gn - 1) / gn * nr;
+		grid_m = (m + tile_m - 1) / tile_m;
+		grid_n = (n + tile_n - 1) / tile_n;
+	}
+
+	int tiles() const { return grid_m * grid_n; }
+};
+
+/*
+ * Runs f(row, col, rows, cols) over the GemmPartition tiles of an m x n
+ * output on the thread pool
+ */
+template <typename T, typename F>
+void gemm_tiles(int m, int n, int k, const GemmKernel<T>& kernel, const F& f)
+{
+	ThreadPool& pool = ThreadPool::instance();
+	const GemmPartition part(m, n, k, kernel.mr, kernel.nr, pool.threads());
+	pool.run(part.tiles(), [&](int tile) {
+		const int row = tile / part.grid_n * part.tile_m;
+		const int col = tile % part.grid_n * part.tile_n;
+		f(row, col, std::min(part.tile_m, m - row), std::min(part.tile_n, n - col));
+	});
+}
+
+/*
+ * Products with at most GEMM_SKINNY rows or columns, matrix-vector
+ * products above all, would spend more time packing than computing in
+ * the blocked path and fill only part of the microkernel tile. Their
+ * kernels stream the large operand once, unpacked:
+ *   rows  C[m x n] = alpha * A * B + beta * C for m <= GEMM_SKINNY and a
+ *         row contiguous B, read row after row into m x n accumulators
+ *         (at most GEMM_SKINNY_ACC) that stay in L1
+ *   dots  the same for n <= GEMM_SKINNY and a row contiguous A: every C
+ *         element is the dot product of an A row and a B column, the
+ *         columns contiguous and ldb apart
+ *   panels  rows for a B packed by gemm_pack_panels (ld and nr as
+ *           there), n columns from micro panel first on, with n * m at
+ *           most GEMM_SKINNY_ACC: the packed blocks are read in memory
+ *           order and C accumulated in an L1 buffer
+ * C is not read when beta is zero. Columns are computed alike as long as
+ * the rows blocks start at multiples of strip.
+ */
+enum { GEMM_SKINNY = 8, GEMM_SKINNY_ACC = 4096 };
+
+template <typename T>
+struct GemmSkinnyKernels
+{
+	typedef void (*Rows)(int m, int n, int k, T alpha, const T* a, long rs_a, long cs_a,
+	                     const T* b, long rs_b, T beta, T* c, long rs_c);
+	typedef void (*Dots)(int m, int n, int k, T alpha, const T* a, long rs_a,
+	                     const T* b, long ldb, T beta, T* c, long rs_c);
+	typedef void (*Panels)(int m, int n, int k, int nr, T alpha, const T* a, long rs_a, long cs_a,
+	                       const T* b, long ld, int first, T beta, T* c, long rs_c);
+
+	int strip;
+	Rows rows;
+	Dots dots;
+	Panels panels;
+};
+
+template <typename T>
+void gemm_rows_ref(int m, int n, int k, T alpha, const T* a, long rs_a, long cs_a,
+                   const T* b, long rs_b, T beta, T* c, long rs_c)
+{
+	T acc[GEMM_SKINNY_ACC];
+	for (int i = 0; i < m * n; i++)
+		acc[i] = T(0);
+
+	for (int p = 0; p < k; p++) {
+		const T* row = b + p * rs_b;
+		for (int r = 0; r < m; r++) {
+			const T a_value = a[r * rs_a + p * cs_a];
+			T* sum = acc + r * n;
+			for (int j = 0; j < n; j++)
+				sum[j] += a_value * row[j];
+		}
+	}
+
+	for (int r = 0; r < m; r++) {
+		const T* sum = acc + r * n;
+		T* dst = c + r * rs_c;
+		for (int j = 0; j < n; j++)
+			dst[j] = (beta == T(0)) ? alpha * sum[j] : beta * dst[j] + alpha * sum[j];
+	}
+}
+
+// four partial sums per dot product hide the add latency
+template <typename T>
+void gemm_dots_ref(int m, int n, int k, T alpha, const T* a, long rs_a,
+                   const T* b, long ldb, T beta, T* c, long rs_c)
+{
+	for (int r = 0; r < m; r++) {
+		const T* row = a + r * rs_a;
+		for (int j = 0; j < n; j++) {
+			const T* column = b + j * ldb;
+			T sum[4] = { T(0), T(0), T(0), T(0) };
+			int p = 0;
+			for (; p + 4 <= k; p += 4) {
+				sum[0] += row[p] * column[p];
+				sum[1] += row[p + 1] * column[p + 1];
+				sum[2] += row[p + 2] * column[p + 2];
+				sum[3] += row[p + 3] * column[p + 3];
+			}
+			for (; p < k; p++)
+				sum[0] += row[p] * column[p];
+
+			const T total = (sum[0] + sum[1]) + (sum[2] + sum[3]);
+			T& dst = c[r * rs_c + j];
+			dst = (beta == T(0)) ? alpha * total : beta * dst + alpha * total;
+		}
+	}
+}
+
+template <typename T>
+void gemm_panels_ref(int m, int n, int k, int nr, T alpha, const T* a, long rs_a, long cs_a,
+                     const T* b, long ld, int first, T beta, T* c, long rs_c)
+{
+	T acc[GEMM_SKINNY_ACC];
+	const int width = (n + nr - 1) / nr * nr;
+	for (int i = 0; i < m * width; i++)
+		acc[i] = T(0);
+
+	for (int pc = 0; pc < k; pc += GemmBlocking<T>::KC) {
+		const int kc = std::min((int)GemmBlocking<T>::KC, k - pc);
+		const T* block = b + pc * ld + (long)first * kc * nr;
+		for (int j = 0; j < width; j += nr) {
+			for (int r = 0; r < m; r++) {
+				const T* row = block + (long)j * kc;
+				T* sum = acc + r * width + j;
+				for (int p = 0; p < kc; p++, row += nr) {
+					const T a_value = a[r * rs_a + (pc + p) * cs_a];
+					for (int s = 0; s < nr; s++)
+						sum[s] += a_value * row[s];
+				}
+			}
+		}
+	}
+
+	for (int r = 0; r < m; r++) {
+		const T* sum = acc + r * width;
+		T* dst = c + r * rs_c;
+		for (int j = 0; j < n; j++)
+			dst[j] = (beta == T(0)) ? alpha * sum[j] : beta * dst[j] + alpha * sum[j];
+	}
+}
+
+#if defined(TT_X86_SIMD)
+/*
+ * Vector rows, dots and panels, stamped out per ISA like
+ * TT_SIMD_ALGORITHMS. panels takes the nr = 2 * W panels of the vector
+ * microkernels.
+ */
+#define TT_SIMD_SKINNY(NAME, TARGET)                                                                                  \
+struct NAME                                                                                                           \
+{                                                                                                                     \
+	/* B streams by rows, four at a time, into the R rows of acc */                                                   \
+	template <typename S, int R>                                                                                      \
+	TARGET static void rows_block(int n, int k, typename S::T alpha, const typename S::T* a, long rs_a, long cs_a,    \
+	                              const typename S::T* b, long rs_b, typename S::T beta,                              \
+	                              typename S::T* c, long rs_c)                                                        \
+	{                                                                                                                 \
+		typedef typename S::T T;                                                                                      \
+		typedef typename S::V Vec;                                                                                    \
+		TT_ALIGN(64) T acc[GEMM_SKINNY_ACC];                                                                          \
+		const int vectors = n / S::W * S::W;                                                                          \
+		for (int i = 0; i < R * n; i++)                                                                               \
+			acc[i] = T(0);                                                                                            \
+                                                                                                                      \
+		int p = 0;                                                                                                    \
+		for (; p + 4 <= k; p += 4) {                                                                                  \
+			const T* b0 = b + p * rs_b;                                                                               \
+			const T* b1 = b0 + rs_b;                                                                                  \
+			const T* b2 = b1 + rs_b;                                                                                  \
+			const T* b3 = b2 + rs_b;                                                                                  \
+			Vec x[R][4];                                                                                              \
+			TT_UNROLL                                                                                                 \
+			for (int r = 0; r < R; r++) {                                                                             \
+				TT_UNROLL                                                                                             \
+				for (int q = 0; q < 4; q++)                                                                           \
+					x[r][q] = S::set1(a[r * rs_a + (p + q) * cs_a]);                                                  \
+			}                                                                                                         \
+                                                                                                                      \
+			int j = 0;                                                                                                \
+			for (; j < vectors; j += S::W) {                                                                          \
+				const Vec v0 = S::load(b0 + j);                                                                       \
+				const Vec v1 = S::load(b1 + j);                                                                       \
+				const Vec v2 = S::load(b2 + j);                                                                       \
+				const Vec v3 = S::load(b3 + j);                                                                       \
+				TT_UNROLL                                                                                             \
+				for (int r = 0; r < R; r++) {                                                                         \
+					T* row = acc + r * n + j;                                                                         \
+					Vec sum = S::fma(x[r][0], v0, S::load(row));                                                      \
+					sum = S::fma(x[r][1], v1, sum);                                                                   \
+					sum = S::fma(x[r][2], v2, sum);                                                                   \
+					S::store(row, S::fma(x[r][3], v3, sum));                                                          \
+				}                                                                                                     \
+			}                                                                                                         \
+			for (; j < n; j++) {                                                                                      \
+				for (int r = 0; r < R; r++) {                                                                         \
+					const T* a_row = a + r * rs_a;                                                                    \
+					T& sum = acc[r * n + j];                                                                          \
+					for (int q = 0; q < 4; q++)                                                                       \
+						sum += a_row[(p + q) * cs_a] * b[(p + q) * rs_b + j];                                         \
+				}                                                                                                     \
+			}                                                                                                         \
+		}                                                                                                             \
+		for (; p < k; p++) {                                                                                          \
+			const T* b0 = b + p * rs_b;                                                                               \
+			TT_UNROLL                                                                                                 \
+			for (int r = 0; r < R; r++) {                                                                             \
+				const T a_value = a[r * rs_a + p * cs_a];                                                             \
+				const Vec x = S::set1(a_value);                                                                       \
+				T* row = acc + r * n;                                                                                 \
+				int j = 0;                                                                                            \
+				for (; j < vectors; j += S::W)                                                                        \
+					S::store(row + j, S::fma(x, S::load(b0 + j), S::load(row + j)));                                  \
+				for (; j < n; j++)                                                                                    \
+					row[j] += a_value * b0[j];                                                                        \
+			}                                                                                                         \
+		}                                                                                                             \
+                                                                                                                      \
+		const Vec alpha_v = S::set1(alpha);                                                                           \
+		const Vec beta_v = S::set1(beta);                                                                             \
+		for (int r = 0; r < R; r++) {                                                                                 \
+			const T* row = acc + r * n;                                                                               \
+			T* dst = c + r * rs_c;                                                                                    \
+			int j = 0;                                                                                                \
+			for (; j < vectors; j += S::W) {                                                                          \
+				Vec result = S::template apply<OP_MUL>(alpha_v, S::load(row + j));                                    \
+				if (beta != T(0))                                                                                     \
+					result = S::fma(beta_v, S::load(dst + j), result);                                                \
+				S::store(dst + j, result);                                                                            \
+			}                                                                                                         \
+			for (; j < n; j++)                                                                                        \
+				dst[j] = (beta == T(0)) ? alpha * row[j] : beta * dst[j] + alpha * row[j];                            \
+		}                                                                                                             \
+	}                                                                                                                 \
+                                                                                                                      \
+	template <typename S>                                                                                             \
+	TARGET static void rows(int m, int n, int k, typename S::T alpha, const typename S::T* a, long rs_a, long cs_a,   \
+	                        const typename S::T* b, long rs_b, typename S::T beta, typename S::T* c, long rs_c)       \
+	{                                                                                                                 \
+		switch (m) {                                                                                                  \
+		case 1: rows_block<S, 1>(n, k, alpha, a, rs_a, cs_a, b, rs_b, beta, c, rs_c); break;                          \
+		case 2: rows_block<S, 2>(n, k, alpha, a, rs_a, cs_a, b, rs_b, beta, c, rs_c); break;                          \
+		case 3: rows_block<S, 3>(n, k, alpha, a, rs_a, cs_a, b, rs_b, beta, c, rs_c); break;                          \
+		case 4: rows_block<S, 4>(n, k, alpha, a, rs_a, cs_a, b, rs_b, beta, c, rs_c); break;                          \
+		case 5: rows_block<S, 5>(n, k, alpha, a, rs_a, cs_a, b, rs_b, beta, c, rs_c); break;                          \
+		case 6: rows_block<S, 6>(n, k, alpha, a, rs_a, cs_a, b, rs_b, beta, c, rs_c); break;                          \
+		case 7: rows_block<S, 7>(n, k, alpha, a, rs_a, cs_a, b, rs_b, beta, c, rs_c); break;                          \
+		default: rows_block<S, 8>(n, k, alpha, a, rs_a, cs_a, b, rs_b, beta, c, rs_c); break;                         \
+		}                                                                                                             \
+	}                                                                                                                 \
+                                                                                                                      \
+	/* R rows of A against N columns of B, one vector accumulator each */                                             \
+	template <typename S, int R, int N>                                                                               \
+	TARGET static void dots_tile(int k, typename S::T alpha, const typename S::T* a, long rs_a,                       \
+	                             const typename S::T* b, long ldb, typename S::T beta, typename S::T* c, long rs_c)   \
+	{                                                                                                                 \
+		typedef typename S::T T;                                                                                      \
+		typedef typename S::V Vec;                                                                                    \
+		Vec acc[R][N];                                                                                                \
+		TT_UNROLL                                                                                                     \
+		for (int r = 0; r < R; r++) {                                                                                 \
+			TT_UNROLL                                                                                                 \
+			for (int j = 0; j < N; j++)                                                                               \
+				acc[r][j] = S::set1(0);                                                                               \
+		}                                                                                                             \
+                                                                                                                      \
+		int p = 0;                                                                                                    \
+		for (; p + S::W <= k; p += S::W) {                                                                            \
+			Vec b_value[N];                                                                                           \
+			TT_UNROLL                                                                                                 \
+			for (int j = 0; j < N; j++)                                                                               \
+				b_value[j] = S::load(b + j * ldb + p);                                                                \
+			TT_UNROLL                                                                                                 \
+			for (int r = 0; r < R; r++) {                                                                             \
+				const Vec a_value = S::load(a + r * rs_a + p);                                                        \
+				TT_UNROLL                                                                                             \
+				for (int j = 0; j < N; j++)                                                                           \
+					acc[r][j] = S::fma(a_value, b_value[j], acc[r][j]);                                               \
+			}                                                                                                         \
+		}                                                                                                             \
+                                                                                                                      \
+		for (int r = 0; r < R; r++) {                                                                                 \
+			for (int j = 0; j < N; j++) {                                                                             \
+				T lanes[S::W];                                                                                        \
+				S::store(lanes, acc[r][j]);                                                                           \
+				T sum = lanes[0];                                                                                     \
+				for (int l = 1; l < S::W; l++)                                                                        \
+					sum += lanes[l];                                                                                  \
+				for (int q = p; q < k; q++)                                                                           \
+					sum += a[r * rs_a + q] * b[j * ldb + q];                                                          \
+				T& dst = c[r * rs_c + j];                                                                             \
+				dst = (beta == T(0)) ? alpha * sum : beta * dst + alpha * sum;                                        \
+			}                                                                                                         \
+		}                                                                                                             \
+	}                                                                                                                 \
+                                                                                                                      \
+	template <typename S, int R, int N>                                                                               \
+	TARGET static void dots_block(int m, int k, typename S::T alpha, const typename S::T* a, long rs_a,               \
+	                              const typename S::T* b, long ldb, typename S::T beta, typename S::T* c, long rs_c)  \
+	{                                                                                                                 \
+		int i = 0;                                                                                                    \
+		for (; i + R <= m; i += R)                                                                                    \
+			dots_tile<S, R, N>(k, alpha, a + i * rs_a, rs_a, b, ldb, beta, c + i * rs_c, rs_c);                       \
+		for (; i < m; i++)                                                                                            \
+			dots_tile<S, 1, N>(k, alpha, a + i * rs_a, rs_a, b, ldb, beta, c + i * rs_c, rs_c);                       \
+	}                                                                                                                 \
+                                                                                                                      \
+	template <typename S>                                                                                             \
+	TARGET static void dots(int m, int n, int k, typename S::T alpha, const typename S::T* a, long rs_a,              \
+	                        const typename S::T* b, long ldb, typename S::T beta, typename S::T* c, long rs_c)        \
+	{                                                                                                                 \
+		switch (n) {                                                                                                  \
+		case 1: dots_block<S, 8, 1>(m, k, alpha, a, rs_a, b, ldb, beta, c, rs_c); break;                              \
+		case 2: dots_block<S, 4, 2>(m, k, alpha, a, rs_a, b, ldb, beta, c, rs_c); break;                              \
+		case 3: dots_block<S, 2, 3>(m, k, alpha, a, rs_a, b, ldb, beta, c, rs_c); break;                              \
+		case 4: dots_block<S, 2, 4>(m, k, alpha, a, rs_a, b, ldb, beta, c, rs_c); break;                              \
+		case 5: dots_block<S, 2, 5>(m, k, alpha, a, rs_a, b, ldb, beta, c, rs_c); break;                              \
+		case 6: dots_block<S, 2, 6>(m, k, alpha, a, rs_a, b, ldb, beta, c, rs_c); break;                              \
+		case 7: dots_block<S, 2, 7>(m, k, alpha, a, rs_a, b, ldb, beta, c, rs_c); break;                              \
+		default: dots_block<S, 2, 8>(m, k, alpha, a, rs_a, b, ldb, beta, c, rs_c); break;                             \
+		}                                                                                                             \
+	}                                                                                                                 \
+                                                                                                                      \
+	/* R rows of acc plus the R rows of A times P adjacent kc x 2W panels */                                          \
+	template <typename S, int R, int P>                                                                               \
+	TARGET static void panel_tile(int kc, const typename S::T* a, long rs_a, long cs_a,                               \
+	                              const typename S::T* panel, typename S::T* acc, long ld_acc)                        \
+	{                                                                                                                 \
+		typedef typename S::V Vec;                                                                                    \
+		const long step = (long)kc * 2 * S::W;                                                                        \
+		Vec sum[R][2 * P];                                                                                            \
+		TT_UNROLL                                                                                                     \
+		for (int r = 0; r < R; r++)                                                                                   \
+			TT_UNROLL                                                                                                 \
+			for (int v = 0; v < 2 * P; v++)                                                                           \
+				sum[r][v] = S::load(acc + r * ld_acc + v * S::W);                                                     \
+                                                                                                                      \
+		for (int p = 0; p < kc; p++, panel += 2 * S::W) {                                                             \
+			Vec b[2 * P];                                                                                             \
+			TT_UNROLL                                                                                                 \
+			for (int q = 0; q < P; q++) {                                                                             \
+				b[2 * q] = S::load(panel + q * step);                                                                 \
+				b[2 * q + 1] = S::load(panel + q * step + S::W);                                                      \
+			}                                                                                                         \
+			TT_UNROLL                                                                                                 \
+			for (int r = 0; r < R; r++) {                                                                             \
+				const Vec a_value = S::set1(a[r * rs_a + p * cs_a]);                                                  \
+				TT_UNROLL                                                                                             \
+				for (int v = 0; v < 2 * P; v++)                                                                       \
+					sum[r][v] = S::fma(a_value, b[v], sum[r][v]);                                                     \
+			}                                                                                                         \
+		}                                                                                                             \
+                                                                                                                      \
+		TT_UNROLL                                                                                                     \
+		for (int r = 0; r < R; r++)                                                                                   \
+			TT_UNROLL                                                                                                 \
+			for (int v = 0; v < 2 * P; v++)                                                                           \
+				S::store(acc + r * ld_acc + v * S::W, sum[r][v]);                                                     \
+	}                                                                                                                 \
+                                                                                                                      \
+	/* R rows by as many panels at a time as keep enough sums in flight                                               \
+	   without spilling (AVX-512 has 32 vector registers, the others 16) */                                           \
+	template <typename S, int R>                                                                                      \
+	TARGET static void panel_rows(int kc, int width, const typename S::T* a, long rs_a, long cs_a,                    \
+	                              const typename S::T* block, typename S::T* acc, long ld_acc)                        \
+	{                                                                                                                 \
+		enum { P = R == 1 ? 4 : (R == 2 || sizeof(typename S::V) == 64) ? 2 : 1 };                                    \
+		const int nr = 2 * S::W;                                                                                      \
+		int j = 0;                                                                                                    \
+		for (; j + P * nr <= width; j += P * nr)                                                                      \
+			panel_tile<S, R, P>(kc, a, rs_a, cs_a, block + (long)j * kc, acc + j, ld_acc);                            \
+		for (; j < width; j += nr)                                                                                    \
+			panel_tile<S, R, 1>(kc, a, rs_a, cs_a, block + (long)j * kc, acc + j, ld_acc);                            \
+	}                                                                                                                 \
+                                                                                                                      \
+	/* the packed blocks are read in memory order, C accumulated in acc */                                            \
+	template <typename S>                                                                                             \
+	TARGET static void panels(int m, int n, int k, int nr, typename S::T alpha, const typename S::T* a,               \
+	                          long rs_a, long cs_a, const typename S::T* b, long ld, int first,                       \
+	                          typename S::T beta, typename S::T* c, long rs_c)                                        \
+	{                                                                                                                 \
+		typedef typename S::T T;                                                                                      \
+		typedef typename S::V Vec;                                                                                    \
+		enum { KC = GemmBlocking<T>::KC };                                                                            \
+		assert(nr == 2 * S::W);                                                                                       \
+		TT_ALIGN(64) T acc[GEMM_SKINNY_ACC];                                                                          \
+		const int width = (n + nr - 1) / nr * nr;                                                                     \
+		for (int i = 0; i < m * width; i++)                                                                           \
+			acc[i] = T(0);                                                                                            \
+                                                                                                                      \
+		for (int pc = 0; pc < k; pc += KC) {                                                                          \
+			const int kc = std::min((int)KC, k - pc);                                                                 \
+			const T* block = b + pc * ld + (long)first * kc * nr;                                                     \
+			for (int i = 0; i < m; i += 4) {                                                                          \
+				const T* a_rows = a + i * rs_a + pc * cs_a;                                                           \
+				T* acc_rows = acc + i * width;                                                                        \
+				switch (std::min(4, m - i)) {                                                                         \
+				case 1: panel_rows<S, 1>(kc, width, a_rows, rs_a, cs_a, block, acc_rows, width); break;               \
+				case 2: panel_rows<S, 2>(kc, width, a_rows, rs_a, cs_a, block, acc_rows, width); break;               \
+				case 3: panel_rows<S, 3>(kc, width, a_rows, rs_a, cs_a, block, acc_rows, width); break;               \
+				default: panel_rows<S, 4>(kc, width, a_rows, rs_a, cs_a, block, acc_rows, width); break;              \
+				}                                                                                                     \
+			}                                                                                                         \
+		}                                                                                                             \
+                                                                                                                      \
+		const Vec alpha_v = S::set1(alpha);                                                                           \
+		const Vec beta_v = S::set1(beta);                                                                             \
+		for (int r = 0; r < m; r++) {                                                                                 \
+			const T* row = acc + r * width;                                                                           \
+			T* dst = c + r * rs_c;                                                                                    \
+			int j = 0;                                                                                                \
+			for (; j + S::W <= n; j += S::W) {                                                                        \
+				Vec result = S::template apply<OP_MUL>(alpha_v, S::load(row + j));                                    \
+				if (beta != T(0))                                                                                     \
+					result = S::fma(beta_v, S::load(dst + j), result);                                                \
+				S::store(dst + j, result);                                                                            \
+			}                                                                                                         \
+			for (; j < n; j++)                                                                                        \
+				dst[j] = (beta == T(0)) ? alpha * row[j] : beta * dst[j] + alpha * row[j];                            \
+		}                                                                                                             \
+	}                                                                                                                 \
+};
+
+TT_SIMD_SKINNY(Sse2Skinny, TT_TARGET_SSE2)
+TT_SIMD_SKINNY(Avx2Skinny, TT_TARGET_AVX2)
+TT_SIMD_SKINNY(Avx512Skinny, TT_TARGET_AVX512)
+
+#undef TT_SIMD_SKINNY
+
+template <typename A, typename S>
+GemmSkinnyKernels<typename S::T> simd_skinny_kernels()
+{
+	const GemmSkinnyKernels<typename S::T> kernels = { S::W, &A::template rows<S>, &A::template dots<S>,
+	                                                   &A::template panels<S> };
+	return kernels;
+}
+#endif
+
+template <typename T>
+const GemmSkinnyKernels<T>& gemm_skinny_kernels()
+{
+	static const GemmSkinnyKernels<T> kernels = { 1, &gemm_rows_ref<T>, &gemm_dots_ref<T>, &gemm_panels_ref<T> };
+	return kernels;
+}
+
+template <>
+inline const GemmSkinnyKernels<float>& gemm_skinny_kernels<float>()
+{
+	static const GemmSkinnyKernels<float> reference = { 1, &gemm_rows_ref<float>, &gemm_dots_ref<float>,
+	                                                    &gemm_panels_ref<float> };
+#if defined(TT_X86_SIMD)
+	static const GemmSkinnyKernels<float> sse2 = simd_skinny_kernels<Sse2Skinny, Sse2Float>();
+	static const GemmSkinnyKernels<float> avx2 = simd_skinny_kernels<Avx2Skinny, Avx2Float>();
+	static const GemmSkinnyKernels<float> avx512 = simd_skinny_kernels<Avx512Skinny, Avx512Float>();
+	switch (simd_level()) {
+	case SIMD_AVX512: return avx512;
+	case SIMD_AVX2: return avx2;
+	case SIMD_SSE2: return sse2;
+	default: break;
+	}
+#endif
+	return reference;
+}
+
+template <>
+inline const GemmSkinnyKernels<double>& gemm_skinny_kernels<double>()
+{
+	static const GemmSkinnyKernels<double> reference = { 1, &gemm_rows_ref<double>, &gemm_dots_ref<double>,
+	                                                    &gemm_panels_ref<double> };
+#if defined(TT_X86_SIMD)
+	static const GemmSkinnyKernels<double> sse2 = simd_skinny_kernels<Sse2Skinny, Sse2Double>();
+	static const GemmSkinnyKernels<double> avx2 = simd_skinny_kernels<Avx2Skinny, Avx2Double>();
+	static const GemmSkinnyKernels<double> avx512 = simd_skinny_kernels<Avx512Skinny, Avx512Double>();
+	switch (simd_level()) {
+	case SIMD_AVX512: return avx512;
+	case SIMD_AVX2: return avx2;
+	case SIMD_SSE2: return sse2;
+	default: break;
+	}
+#endif
+	return reference;
+}
+
+/*
+ * C = beta * C, the product of an empty k or a zero alpha
+ */
+template <typename T, typename Epilogue>
+void gemm_scale(T beta, const MatrixRef<T>& C, const Epilogue& epilogue)
+{
+	for (int r = 0; r < C.rows; r++) {
+		for (int c = 0; c < C.cols; c++) {
+			T& dst = C.data[r * C.rs + c * C.cs];
+			dst = (beta == T(0)) ? T(0) : beta * dst;
+		}
+		epilogue(C.data + r * C.rs, r, 0, C.cols);
+	}
+}
+
+/*
+ * Drivers of the skinny kernels. The threads split the rows of C for
+ * dots and the columns, at strip multiples, for rows and panels, so no
+ * element depends on the thread count. epilogue is applied as in
+ * gemm_macro_kernel, to every block of C as it is finished.
+ */
+enum { GEMM_SKINNY_ROWS = 64 };
+
+inline int gemm_skinny_threads(int m, int n, int k)
+{
+	return (2.0 * m * n * k < 2.0 * 64 * 64 * 64) ? 1 : ThreadPool::instance().threads();
+}
+
+// C = alpha * A * B + beta * C with the B columns contiguous, ldb apart
+template <typename T, typename Epilogue>
+void gemm_dots(T alpha, const ConstMatrixRef<T>& A, const T* b, long ldb, T beta, const MatrixRef<T>& C,
+               const Epilogue& epilogue)
+{
+	const GemmSkinnyKernels<T>& kernels = gemm_skinny_kernels<T>();
+	const int m = C.rows;
+	const int n = C.cols;
+	const int k = A.cols;
+	const int tasks = std::max(1, std::min(gemm_skinny_threads(m, n, k), m / GEMM_SKINNY_ROWS));
+	const int task_rows = (m + tasks - 1) / tasks;
+	ThreadPool::instance().run(tasks, [&](int task) {
+		const int last = std::min(m, (task + 1) * task_rows);
+		for (int i = task * task_rows; i < last; i += GEMM_SKINNY_ROWS) {
+			const int rows = std::min((int)GEMM_SKINNY_ROWS, last - i);
+			kernels.dots(rows, n, k, alpha, A.data + i * A.rs, A.rs, b, ldb, beta, C.data + i * C.rs, C.rs);
+			for (int r = i; r < i + rows; r++)
+				epilogue(C.data + r * C.rs, r, 0, n);
+		}
+	});
+}
+
+// f(j, cols) over blocks of up to block columns of C, starting at unit multiples
+template <typename T, typename Epilogue, typename F>
+void gemm_column_blocks(const MatrixRef<T>& C, int k, int unit, int block, const Epilogue& epilogue, const F& f)
+{
+	const int n = C.cols;
+	const int units = (n + unit - 1) / unit;
+	const int tasks = std::min(gemm_skinny_threads(C.rows, n, k), units);
+	const int task_cols = (units + tasks - 1) / tasks * unit;
+	ThreadPool::instance().run(tasks, [&](int task) {
+		const int last = std::min(n, (task + 1) * task_cols);
+		for (int j = task * task_cols; j < last; j += block) {
+			const int cols = std::min(block, last - j);
+			f(j, cols);
+			for (int r = 0; r < C.rows; r++)
+				epilogue(C.data + r * C.rs + j, r, j, cols);
+		}
+	});
+}
+
+/*
+ * C = alpha * A * B + beta * C with the skinny kernels when the shape
+ * and the strides suit them, returning false otherwise
+ */
+template <typename T, typename Epilogue>
+bool gemm_skinny(T alpha, const ConstMatrixRef<T>& A, const ConstMatrixRef<T>& B, T beta, const MatrixRef<T>& C,
+                 const Epilogue& epilogue)
+{
+	const int m = C.rows;
+	const int n = C.cols;
+	const int k = A.cols;
+	if (C.cs != 1)
+		return false;
+
+	if (n <= GEMM_SKINNY && A.cs == 1) {
+		// B columns as contiguous runs, packed unless B is stored transposed
+		if (B.rs == 1 || k == 1) {
+			gemm_dots(alpha, A, B.data, B.cs, beta, C, epilogue);
+			return true;
+		}
+		PackBuffer<T> packed((std::size_t)n * k);
+		gemm_pack_columns(B, packed.data());
+		gemm_dots(alpha, A, packed.data(), k, beta, C, epilogue);
+		return true;
+	}
+
+	if (m <= GEMM_SKINNY && B.cs == 1) {
+		const GemmSkinnyKernels<T>& kernels = gemm_skinny_kernels<T>();
+		const int block = std::max(kernels.strip, GEMM_SKINNY_ACC / m / kernels.strip * kernels.strip);
+		gemm_column_blocks(C, k, kernels.strip, block, epilogue, [&](int j, int cols) {
+			kernels.rows(m, cols, k, alpha, A.data, A.rs, A.cs, B.data + j, B.rs, beta, C.data + j, C.rs);
+		});
+		return true;
+	}
+
+	return false;
+}
+
+/*
+ * C = alpha * A * B + beta * C, then epilogue(row, i, j, n) over the
+ * finished rows of every tile (see gemm_macro_kernel), which needs a
+ * unit column stride C
+ *
+ * The output is split into 2D tiles that run on the library thread pool.
+ * Each tile owns its packing buffers and walks the whole k dimension in
+ * the same order, so the result does not depend on the thread count.
+ */
+template <typename T, typename Epilogue>
+void gemm(T alpha, const ConstMatrixRef<T>& A, const ConstMatrixRef<T>& B, T beta, const MatrixRef<T>& C,
+          const Epilogue& epilogue)
+{
+	assert(A.cols == B.rows);
+	assert(C.rows == A.rows);
+	assert(C.cols == B.cols);
+
+	const int m = C.rows;
+	const int n = C.cols;
+	const int k = A.cols;
+	if (m == 0 || n == 0)
+		return;
+
+	if (k == 0 || alpha == T(0)) {
+		gemm_scale(beta, C, epilogue);
+		return;
+	}
+
+	if (gemm_skinny(alpha, A, B, beta, C, epilogue))
+		return;
+
+	const GemmKernel<T>& kernel = gemm_kernel<T>();
+	gemm_tiles(m, n, k, kernel, [&](int row, int col, int rows, int cols) {
+		const ConstMatrixRef<T> a = { A.data + row * A.rs, rows, k, A.rs, A.cs };
+		const ConstMatrixRef<T> b = { B.data + col * B.cs, k, cols, B.rs, B.cs };
+		const MatrixRef<T> c = { C.data + row * C.rs + col * C.cs, rows, cols, C.rs, C.cs };
+		gemm_blocked(alpha, a, b, beta, c, kernel,
+		             [&](T* values, int i, int j, int count) { epilogue(values, row + i, col + j, count); });
+	});
+}
+
+template <typename T>
+void gemm(T alpha, const ConstMatrixRef<T>& A, const ConstMatrixRef<T>& B, T beta, const MatrixRef<T>& C)
+{
+	gemm(alpha, A, B, beta, C, GemmNoEpilogue());
+}
+
+/*
+ * B packed ahead of the products (TortoisePackedMatrix): with at most
+ * GEMM_SKINNY columns, the columns one after another for the dots
+ * kernel (nr 0), otherwise by gemm_pack_panels for the microkernel of
+ * width nr
+ */
+template <typename T>
+struct PackedMatrixRef
+{
+	const T* data;
+	int rows;
+	int cols;
+	int nr;
+	long ld;
+};
+
+template <typename T>
+inline int packed_nr(int cols)
+{
+	return cols <= GEMM_SKINNY ? 0 : gemm_kernel<T>().nr;
+}
+
+template <typename T>
+inline long packed_size(int rows, int cols)
+{
+	const int nr = packed_nr<T>(cols);
+	return nr ? (long)rows * ((cols + nr - 1) / nr * nr) : (long)rows * cols;
+}
+
+template <typename T>
+void gemm_pack(const ConstMatrixRef<T>& B, T* dst)
+{
+	const int nr = packed_nr<T>(B.cols);
+	if (nr)
+		gemm_pack_panels(B, nr, dst);
+	else
+		gemm_pack_columns(B, dst);
+}
+
+/*
+ * C = alpha * A * B + beta * C for a packed B. Only the packing is
+ * skipped: for a B of a few columns or an A of more than GEMM_SKINNY rows
+ * the kernels, blocking and thread split are those of gemm, and so is
+ * the result, bit for bit; fewer A rows run the panels kernel. A must be
+ * row contiguous for a B of a few columns and C must have a unit column
+ * stride.
+ */
+template <typename T, typename Epilogue>
+void gemm(T alpha, const ConstMatrixRef<T>& A, const PackedMatrixRef<T>& B, T beta, const MatrixRef<T>& C,
+          const Epilogue& epilogue)
+{
+	assert(A.cols == B.rows);
+	assert(C.rows == A.rows);
+	assert(C.cols == B.cols);
+	assert(C.cs == 1);
+
+	const int m = C.rows;
+	const int n = C.cols;
+	const int k = A.cols;
+	if (m == 0 || n == 0)
+		return;
+
+	if (k == 0 || alpha == T(0)) {
+		gemm_scale(beta, C, epilogue);
+		return;
+	}
+
+	if (B.nr == 0) {
+		assert(A.cs == 1);
+		gemm_dots(alpha, A, B.data, k, beta, C, epilogue);
+		return;
+	}
+
+	const GemmKernel<T>& kernel = gemm_kernel<T>();
+	assert(B.nr == kernel.nr);
+	if (m <= GEMM_SKINNY) {
+		const GemmSkinnyKernels<T>& kernels = gemm_skinny_kernels<T>();
+		const int block = std::max(B.nr, GEMM_SKINNY_ACC / m / B.nr * B.nr);
+		gemm_column_blocks(C, k, B.nr, block, epilogue, [&](int j, int cols) {
+			kernels.panels(m, cols, k, B.nr, alpha, A.data, A.rs, A.cs, B.data, B.ld, j / B.nr, beta, C.data + j, C.rs);
+		});
+		return;
+	}
+
+	gemm_tiles(m, n, k, kernel, [&](int row, int col, int rows, int cols) {
+		const ConstMatrixRef<T> a = { A.data + row * A.rs, rows, k, A.rs, A.cs };
+		const MatrixRef<T> c = { C.data + row * C.rs + col, rows, cols, C.rs, 1 };
+		gemm_blocked_panels(alpha, a, [&](int pc, int kc, int jc, int) -> const T* {
+			return B.data + pc * B.ld + (long)(col + jc) / B.nr * kc * B.nr;
+		}, beta, c, kernel, [&](T* values, int i, int j, int count) { epilogue(values, row + i, col + j, count); });
+	});
+}
+
+/*
+ * Batches of small products (tortoiseBatchedDot) run as many at a time as
+ * the SIMD width W, one per vector lane: the W operands are interleaved
+ * element by element, a as [m][k][W] and b as [k][n][W], so a vector
+ * holds the same element of W matrices and the kernel computes c as
+ * [m][n][W] with plain vector FMAs. Every lane sums over k in order. The
+ * reference kernel is the same loop over row major matrices (W 1).
+ */
+enum { GEMM_BATCH = 64 };
+
+template <typename T>
+struct GemmBatchKernel
+{
+	typedef void (*Run)(int m, int n, int k, const T* a, const T* b, T* c);
+	typedef void (*Interleave)(const T* const* src, long size, T* dst);
+	typedef void (*Deinterleave)(const T* src, long size, T* const* dst);
+
+	int width;
+	Run run;
+	Interleave interleave;
+	Deinterleave deinterleave;
+};
+
+template <typename T>
+void gemm_batch_ref(int m, int n, int k, const T* a, const T* b, T* c)
+{
+	for (int i = 0; i < m; i++) {
+		T* row = c + i * n;
+		for (int j = 0; j < n; j++)
+			row[j] = T(0);
+		for (int p = 0; p < k; p++) {
+			const T a_value = a[i * k + p];
+			const T* b_row = b + p * n;
+			for (int j = 0; j < n; j++)
+				row[j] += a_value * b_row[j];
+		}
+	}
+}
+
+template <typename T>
+void gemm_batch_interleave_ref(const T* const* src, long size, T* dst)
+{
+	std::copy(src[0], src[0] + size, dst);
+}
+
+template <typename T>
+void gemm_batch_deinterleave_ref(const T* src, long size, T* const* dst)
+{
+	std::copy(src, src + size, dst[0]);
+}
+
+#if defined(TT_X86_SIMD)
+#define TT_SIMD_BATCH(NAME, TARGET)                                                                                \
+struct NAME                                                                                                        \
+{                                                                                                                  \
+	/* R rows by N vectors of columns of c, in registers over all of k */                                          \
+	template <typename S, int R, int N>                                                                            \
+	TARGET static void tile(int n, int k, const typename S::T* a, const typename S::T* b, typename S::T* c)        \
+	{                                                                                                              \
+		typedef typename S::T T;                                                                                   \
+		typedef typename S::V Vec;                                                                                 \
+		const long ld_a = (long)k * S::W;                                                                          \
+		const long ld_b = (long)n * S::W;                                                                          \
+		Vec sum[R][N];                                                                                             \
+		TT_UNROLL                                                                                                  \
+		for (int r = 0; r < R; r++)                                                                                \
+			TT_UNROLL                                                                                              \
+			for (int q = 0; q < N; q++)                                                                            \
+				sum[r][q] = S::set1(T(0));                                                                         \
+                                                                                                                   \
+		for (int p = 0; p < k; p++) {                                                                              \
+			Vec b_value[N];                                                                                        \
+			TT_UNROLL                                                                                              \
+			for (int q = 0; q < N; q++)                                                                            \
+				b_value[q] = S::load(b + p * ld_b + q * S::W);                                                     \
+			TT_UNROLL                                                                                              \
+			for (int r = 0; r < R; r++) {                                                                          \
+				const Vec a_value = S::load(a + r * ld_a + p * S::W);                                              \
+				TT_UNROLL                                                                                          \
+				for (int q = 0; q < N; q++)                                                                        \
+					sum[r][q] = S::fma(a_value, b_value[q], sum[r][q]);                                            \
+			}                                                                                                      \
+		}                                                                                                          \
+                                                                                                                   \
+		TT_UNROLL                                                                                                  \
+		for (int r = 0; r < R; r++)                                                                                \
+			TT_UNROLL                                                                                              \
+			for (int q = 0; q < N; q++)                                                                            \
+				S::store(c + r * ld_b + q * S::W, sum[r][q]);                                                      \
+	}                                                                                                              \
+                                                                                                                   \
+	template <typename S, int R>                                                                                   \
+	TARGET static void tile_row(int n, int k, const typename S::T* a, const typename S::T* b, typename S::T* c)    \
+	{                                                                                                              \
+		int j = 0;                                                                                                 \
+		for (; j + 3 <= n; j += 3)                                                                                 \
+			tile<S, R, 3>(n, k, a, b + j * S::W, c + j * S::W);                                                    \
+		for (; j < n; j++)                                                                                         \
+			tile<S, R, 1>(n, k, a, b + j * S::W, c + j * S::W);                                                    \
+	}                                                                                                              \
+                                                                                                                   \
+	template <typename S>                                                                                          \
+	TARGET static void run(int m, int n, int k, const typename S::T* a, const typename S::T* b, typename S::T* c)  \
+	{                                                                                                              \
+		const long ld_a = (long)k * S::W;                                                                          \
+		const long ld_c = (long)n * S::W;                                                                          \
+		for (int i = 0; i < m; i += 4) {                                                                           \
+			switch (std::min(4, m - i)) {                                                                          \
+			case 1: tile_row<S, 1>(n, k, a + i * ld_a, b, c + i * ld_c); break;                                    \
+			case 2: tile_row<S, 2>(n, k, a + i * ld_a, b, c + i * ld_c); break;                                    \
+			case 3: tile_row<S, 3>(n, k, a + i * ld_a, b, c + i * ld_c); break;                                    \
+			default: tile_row<S, 4>(n, k, a + i * ld_a, b, c + i * ld_c); break;                                   \
+			}                                                                                                      \
+		}                                                                                                          \
+	}                                                                                                              \
+                                                                                                                   \
+	/* dst[e][l] = src[l][e] for the W matrices src, W by W elements at a time */                                  \
+	template <typename S>                                                                                          \
+	TARGET static void interleave(const typename S::T* const* src, long size, typename S::T* dst)                  \
+	{                                                                                                              \
+		typedef typename S::V Vec;                                                                                 \
+		long e = 0;                                                                                                \
+		for (; e + S::W <= size; e += S::W) {                                                                      \
+			Vec rows[S::W];                                                                                        \
+			TT_UNROLL                                                                                              \
+			for (int l = 0; l < S::W; l++)                                                                         \
+				rows[l] = S::load(src[l] + e);                                                                     \
+			S::transpose(rows);                                                                                    \
+			TT_UNROLL                                                                                              \
+			for (int l = 0; l < S::W; l++)                                                                         \
+				S::store(dst + (e + l) * S::W, rows[l]);                                                           \
+		}                                                                                                          \
+		for (; e < size; e++)                                                                                      \
+			for (int l = 0; l < S::W; l++)                                                                         \
+				dst[e * S::W + l] = src[l][e];                                                                     \
+	}                                                                                                              \
+                                                                                                                   \
+	/* dst[l][e] = src[e][l], the inverse of interleave */                                                         \
+	template <typename S>                                                                                          \
+	TARGET static void deinterleave(const typename S::T* src, long size, typename S::T* const* dst)                \
+	{                                                                                                              \
+		typedef typename S::V Vec;                                                                                 \
+		long e = 0;                                                                                                \
+		for (; e + S::W <= size; e += S::W) {                                                                      \
+			Vec rows[S::W];                                                                                        \
+			TT_UNROLL                                                                                              \
+			for (int l = 0; l < S::W; l++)                                                                         \
+				rows[l] = S::load(src + (e + l) * S::W);                                                           \
+			S::transpose(rows);                                                                                    \
+			TT_UNROLL                                                                                              \
+			for (int l = 0; l < S::W; l++)                                                                         \
+				S::store(dst[l] + e, rows[l]);                                                                     \
+		}                                                                                                          \
+		for (; e < size; e++)                                                                                      \
+			for (int l = 0; l < S::W; l++)                                                                         \
+				dst[l][e] = src[e * S::W + l];                                                                     \
+	}                                                                                                              \
+};
+
+TT_SIMD_BATCH(Sse2Batch, TT_TARGET_SSE2)
+TT_SIMD_BATCH(Avx2Batch, TT_TARGET_AVX2)
+TT_SIMD_BATCH(Avx512Batch, TT_TARGET_AVX512)
+
+#undef TT_SIMD_BATCH
+
+template <typename A, typename S>
+GemmBatchKernel<typename S::T> simd_batch_kernel()
+{
+	const GemmBatchKernel<typename S::T> kernel = { S::W, &A::template run<S>, &A::template interleave<S>,
+	                                                &A::template deinterleave<S> };
+	return kernel;
+}
+#endif
+
+template <typename T>
+const GemmBatchKernel<T>& gemm_batch_kernel()
+{
+	static const GemmBatchKernel<T> kernel = { 1, &gemm_batch_ref<T>, &gemm_batch_interleave_ref<T>,
+	                                           &gemm_batch_deinterleave_ref<T> };
+	return kernel;
+}
+
+template <>
+inline const GemmBatchKernel<float>& gemm_batch_kernel<float>()
+{
+	static const GemmBatchKernel<float> reference = { 1, &gemm_batch_ref<float>, &gemm_batch_interleave_ref<float>,
+	                                                &gemm_batch_deinterleave_ref<float> };
+#if defined(TT_X86_SIMD)
+	static const GemmBatchKernel<float> sse2 = simd_batch_kernel<Sse2Batch, Sse2Float>();
+	static const GemmBatchKernel<float> avx2 = simd_batch_kernel<Avx2Batch, Avx2Float>();
+	static const GemmBatchKernel<float> avx512 = simd_batch_kernel<Avx512Batch, Avx512Float>();
+	switch (simd_level()) {
+	case SIMD_AVX512: return avx512;
+	case SIMD_AVX2: return avx2;
+	case SIMD_SSE2: return sse2;
+	default: break;
+	}
+#endif
+	return reference;
+}
+
+template <>
+inline const GemmBatchKernel<double>& gemm_batch_kernel<double>()
+{
+	static const GemmBatchKernel<double> reference = { 1, &gemm_batch_ref<double>, &gemm_batch_interleave_ref<double>,
+	                                                 &gemm_batch_deinterleave_ref<double> };
+#if defined(TT_X86_SIMD)
+	static const GemmBatchKernel<double> sse2 = simd_batch_kernel<Sse2Batch, Sse2Double>();
+	static const GemmBatchKernel<double> avx2 = simd_batch_kernel<Avx2Batch, Avx2Double>();
+	static const GemmBatchKernel<double> avx512 = simd_batch_kernel<Avx512Batch, Avx512Double>();
+	switch (simd_level()) {
+	case SIMD_AVX512: return avx512;
+	case SIMD_AVX2: return avx2;
+	case SIMD_SSE2: return sse2;
+	default: break;
+	}
+#endif
+	return reference;
+}
+
+// Interleave of a short last group: zeros in the unused lanes
+template <typename T>
+void gemm_batch_interleave(int count, int width, const T* const* src, long size, T* dst)
+{
+	for (long e = 0; e < size; e++, dst += width) {
+		for (int l = 0; l < count; l++)
+			dst[l] = src[l][e];
+		for (int l = count; l < width; l++)
+			dst[l] = T(0);
+	}
+}
+
+/*
+ * c[i] = a[i] * b[i] for count products of row contiguous m x k and
+ * k x n matrices. Groups of the kernel width run on the thread pool,
+ * the last one padded with zeros, so an item is computed alike wherever
+ * it is in the batch and whatever the thread count. Products with a
+ * dimension over GEMM_BATCH run gemm, one per task.
+ */
+template <typename T>
+void gemm_batch(int count, int m, int n, int k, const T* const* a, const T* const* b, T* const* c)
+{
+	if (count == 0 || m == 0 || n == 0)
+		return;
+
+	ThreadPool& pool = ThreadPool::instance();
+	const int threads = (2.0 * count * m * n * k < 2.0 * 64 * 64 * 64) ? 1 : pool.threads();
+	if (std::max(m, std::max(n, k)) > GEMM_BATCH) {
+		const int tasks = count < threads ? 1 : threads;
+		pool.run(tasks, [&](int task) {
+			for (int i = task; i < count; i += tasks) {
+				const ConstMatrixRef<T> A = { a[i], m, k, k, 1 };
+				const ConstMatrixRef<T> B = { b[i], k, n, n, 1 };
+				const MatrixRef<T> C = { c[i], m, n, n, 1 };
+				gemm(T(1), A, B, T(0), C);
+			}
+		});
+		return;
+	}
+
+	const GemmBatchKernel<T>& kernel = gemm_batch_kernel<T>();
+	const int width = kernel.width;
+	const int groups = (count + width - 1) / width;
+	const int tasks = std::min(groups, threads);
+	pool.run(tasks, [&](int task) {
+		if (width == 1) {
+			for (int i = task; i < count; i += tasks)
+				kernel.run(m, n, k, a[i], b[i], c[i]);
+			return;
+		}
+
+		const long size_a = (long)m * k;
+		const long size_b = (long)k * n;
+		const long size_c = (long)m * n;
+		PackBuffer<T> buffer((size_a + size_b + size_c) * width);
+		T* packed_a = buffer.data();
+		T* packed_b = packed_a + size_a * width;
+		T* packed_c = packed_b + size_b * width;
+		for (int group = task; group < groups; group += tasks) {
+			const int first = group * width;
+			const int items = std::min(width, count - first);
+			if (items < width) {
+				gemm_batch_interleave(items, width, a + first, size_a, packed_a);
+				gemm_batch_interleave(items, width, b + first, size_b, packed_b);
+			}
+			else {
+				kernel.interleave(a + first, size_a, packed_a);
+				kernel.interleave(b + first, size_b, packed_b);
+			}
+			kernel.run(m, n, k, packed_a, packed_b, packed_c);
+			if (items < width) {
+				for (long e = 0; e < size_c; e++)
+					for (int l = 0; l < items; l++)
+						c[first + l][e] = packed_c[e * width + l];
+			}
+			else {
+				kernel.deinterleave(packed_c, size_c, c + first);
+			}
+		}
+	});
+}
+
+} // namespace tortoise_detail
+
+/*
+ * Number of threads used by the parallel kernels (dot), including the
+ * calling thread. Defaults to TORTOISE_NUM_THREADS or the hardware
+ * concurrency; 0 restores that default.
+ */
+inline void tortoiseSetThreads(int threads)
+{
+	tortoise_detail::ThreadPool::instance().setThreads(threads);
+}
+
+inline int tortoiseThreads()
+{
+	return tortoise_detail::ThreadPool::instance().threads();
+}
+
+/*
+ * Accuracy of the vectorized exp, log, log10, sin, cos, sinh, cosh and
+ * tanh of float and double matrices, measured against correctly rounded
+ * results:
+ *   Accurate  float and double within 2.5 ulp
+ *   Fast      float within 7 ulp, double within 10 ulp; shorter exp and
+ *             log polynomials, which sinh, cosh and tanh build on
+ * NaN, infinities and arguments beyond the polynomial ranges (large sin
+ * and cos arguments, exp overflow and underflow, subnormal log inputs)
+ * are computed by libm in both modes. tan, asin, acos, atan and pow
+ * always use libm.
+ */
+enum TortoisePrecision
+{
+	// the global setting of tortoiseSetPrecision()
+	TortoisePrecisionDefault,
+	TortoisePrecisionAccurate,
+	TortoisePrecisionFast
+};
+
+namespace tortoise_detail {
+
+inline std::atomic<int>& precision_setting()
+{
+	static std::atomic<int> precision(TortoisePrecisionAccurate);
+	return precision;
+}
+
+} // namespace tortoise_detail
+
+/*
+ * Precision used by the math functions called without one. Accurate by
+ * default; TortoisePrecisionDefault restores that default.
+ */
+inline void tortoiseSetPrecision(TortoisePrecision precision)
+{
+	if (precision == TortoisePrecisionDefault)
+		precision = TortoisePrecisionAccurate;
+	tortoise_detail::precision_setting().store(precision, std::memory_order_relaxed);
+}
+
+inline TortoisePrecision tortoisePrecision()
+{
+	return (TortoisePrecision)tortoise_detail::precision_setting().load(std::memory_order_relaxed);
+}
+
+/*
+ * Algorithm of dot for large float and double products:
+ *   Classical  the blocked product, 2 m n k flops
+ *   Strassen   Strassen-Winograd recursion down to blocked products of
+ *              about 1024 x 1024: 7 half size products instead of 8 per
+ *              level, for products whose three dimensions are all at
+ *              least 2048. The error is bounded normwise only,
+ *              max |C - A B| <= c u max |A| max |B| with c growing about
+ *              3x per level (measured on float operands uniform in
+ *              [-1, 1]: 3x the classical error at 2048, 9x at 4096, 21x
+ *              at 8192), and cancellation can make small elements of C
+ *              far less accurate than in the classical product
+ * Smaller products, integer products, packed right operands and
+ * tortoiseGemm always use the classical algorithm.
+ */
+enum TortoiseDotAlgorithm
+{
+	// the global setting of tortoiseSetDotAlgorithm()
+	TortoiseDotDefault,
+	TortoiseDotClassical,
+	TortoiseDotStrassen
+};
+
+namespace tortoise_detail {
+
+inline std::atomic<int>& dot_algorithm_setting()
+{
+	static std::atomic<int> algorithm(TortoiseDotClassical);
+	return algorithm;
+}
+
+} // namespace tortoise_detail
+
+/*
+ * Algorithm of dot, dotTN, dotNT, dotTT and the fused dot. Classical by
+ * default; TortoiseDotDefault restores that default.
+ */
+inline void tortoiseSetDotAlgorithm(TortoiseDotAlgorithm algorithm)
+{
+	if (algorithm == TortoiseDotDefault)
+		algorithm = TortoiseDotClassical;
+	tortoise_detail::dot_algorithm_setting().store(algorithm, std::memory_order_relaxed);
+}
+
+inline TortoiseDotAlgorithm tortoiseDotAlgorithm()
+{
+	return (TortoiseDotAlgorithm)tortoise_detail::dot_algorithm_setting().load(std::memory_order_relaxed);
+}
+
+/*
+ * Backing of matrix buffers of 2 MB and more; smaller ones always come
+ * from the heap:
+ *   Off          the heap
+ *   Transparent  2 MB aligned anonymous mappings advised with
+ *                MADV_HUGEPAGE, which the kernel backs with transparent
+ *                huge pages when it can
+ *   Explicit     2 MB pages reserved through vm.nr_hugepages
+ *                (MAP_HUGETLB), falling back to Transparent when none
+ *                are free
+ * Huge pages cut the TLB misses of dot and transpose on matrices of
+ * hundreds of MB and more. Mapped buffers are rounded up to 2 MB. Only
+ * Linux has huge pages; elsewhere every mode is Off.
+ */
+enum TortoiseHugePages
+{
+	// the global setting of tortoiseSetHugePages()
+	TortoiseHugePagesDefault,
+	TortoiseHugePagesOff,
+	TortoiseHugePagesTransparent,
+	TortoiseHugePagesExplicit
+};
+
+namespace tortoise_detail {
+
+inline std::atomic<int>& huge_pages_setting()
+{
+	static std::atomic<int> huge_pages(TortoiseHugePagesOff);
+	return huge_pages;
+}
+
+} // namespace tortoise_detail
+
+/*
+ * Backing of the matrices allocated from then on. Off by default;
+ * TortoiseHugePagesDefault restores that default.
+ */
+inline void tortoiseSetHugePages(TortoiseHugePages huge_pages)
+{
+	if (huge_pages == TortoiseHugePagesDefault)
+		huge_pages = TortoiseHugePagesOff;
+	tortoise_detail::huge_pages_setting().store(huge_pages, std::memory_order_relaxed);
+}
+
+inline TortoiseHugePages tortoiseHugePages()
+{
+	return (TortoiseHugePages)tortoise_detail::huge_pages_setting().load(std::memory_order_relaxed);
+}
+
+namespace tortoise_detail {
+
+/*
+ * Buffers start on a cache line, which is also the width of the widest
+ * vectors
+ */
+enum { STORAGE_ALIGNMENT = 64, HUGE_PAGE = 2 << 20 };
+
+struct ArenaChunk;
+
+/*
+ * Memory of one buffer: mapped is the length of an mmap()ed block, 0 for
+ * a heap block, whose allocation starts at raw; chunk is the arena chunk
+ * the buffer was cut from, see TortoiseMatrixArena
+ */
+struct StorageBlock
+{
+	void* data;
+	void* raw;
+	std::size_t mapped;
+	ArenaChunk* chunk;
+};
+
+#if defined(TT_HUGE_PAGES)
+/*
+ * Maps length bytes, a multiple of HUGE_PAGE, on a HUGE_PAGE boundary so
+ * the kernel can back all of it with huge pages
+ */
+inline void* map_huge_pages(std::size_t length, int huge_pages)
+{
+#ifdef MAP_HUGETLB
+	if (huge_pages == TortoiseHugePagesExplicit) {
+		void* data = mmap(0, length, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_HUGETLB, -1, 0);
+		if (data != MAP_FAILED)
+			return data;
+	}
+#endif
+	char* raw = (char*)mmap(0, length + HUGE_PAGE, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+	if (raw == (char*)MAP_FAILED)
+		return 0;
+	char* data = (char*)(((std::size_t)raw + HUGE_PAGE - 1) & ~std::size_t(HUGE_PAGE - 1));
+	if (data > raw)
+		munmap(raw, data - raw);
+	if (raw + HUGE_PAGE > data)
+		munmap(data + length, raw + HUGE_PAGE - data);
+#ifdef MADV_HUGEPAGE
+	madvise(data, length, MADV_HUGEPAGE);
+#endif
+	return data;
+}
+#endif
+
+/*
+ * Buffer from the heap, or mapped per tortoiseSetHugePages()
+ */
+inline StorageBlock system_allocate(std::size_t bytes)
+{
+	StorageBlock block = {0, 0, 0, 0};
+#if defined(TT_HUGE_PAGES)
+	const int huge_pages = huge_pages_setting().load(std::memory_order_relaxed);
+	if (huge_pages != TortoiseHugePagesOff && bytes >= (std::size_t)HUGE_PAGE) {
+		const std::size_t length = (bytes + HUGE_PAGE - 1) & ~std::size_t(HUGE_PAGE - 1);
+		block.data = map_huge_pages(length, huge_pages);
+		if (block.data) {
+			block.mapped = length;
+			return block;
+		}
+	}
+#endif
+	char* raw = new char[bytes + STORAGE_ALIGNMENT - 1];
+	block.raw = raw;
+	block.data = (void*)(((std::size_t)raw + STORAGE_ALIGNMENT - 1) & ~std::size_t(STORAGE_ALIGNMENT - 1));
+	return block;
+}
+
+inline void system_release(const StorageBlock& block)
+{
+#if defined(TT_HUGE_PAGES)
+	if (block.mapped) {
+		munmap(block.data, block.mapped);
+		return;
+	}
+#endif
+	delete[] (char*)block.raw;
+}
+
+/*
+ * Default chunk size of TortoiseMatrixArena, and the number of freed
+ * chunks every thread keeps for its next arenas, of each kind
+ */
+enum { ARENA_CHUNK = 4 << 20, ARENA_CACHE = 4, ARENA_OVERSIZE_CACHE = 8 };
+
+/*
+ * Block of memory buffers are cut from, headed by this struct. users
+ * counts the buffers cut from it that are still alive, plus one while
+ * it is on the list of an open arena; the chunk goes back to the pool of
+ * the thread that drops it to 0. An oversize chunk holds one buffer over
+ * half a chunk and is on no list.
+ */
+struct ArenaChunk
+{
+	StorageBlock block;
+	std::atomic<long> users;
+	char* begin;
+	char* next;
+	char* end;
+	bool oversize;
+	ArenaChunk* previous;
+};
+
+/*
+ * Capacity of the oversize chunk of a buffer: bytes rounded up to a
+ * quarter octave, so buffers of about the same size share chunks while
+ * wasting at most a fifth of one
+ */
+inline std::size_t oversize_capacity(std::size_t bytes)
+{
+	std::size_t step = STORAGE_ALIGNMENT;
+	while (step * 8 < bytes)
+		step *= 2;
+	return (bytes + step - 1) / step * step;
+}
+
+/*
+ * Freed chunks of the thread, reused by its next arenas: shared chunks
+ * of any size, and oversize chunks by capacity
+ */
+class ChunkCache
+{
+public:
+	static ChunkCache* instance()
+	{
+		static thread_local bool closed = false;
+		static thread_local ChunkCache cache(closed);
+		return closed ? 0 : &cache;
+	}
+
+	~ChunkCache()
+	{
+		m_closed = true;
+		for (std::size_t i = 0; i < m_chunks.size(); i++)
+			release(m_chunks[i]);
+		for (std::size_t i = 0; i < m_oversize.size(); i++)
+			release(m_oversize[i]);
+	}
+
+	/*
+	 * A cached shared chunk of at least capacity bytes, or an oversize
+	 * one of exactly capacity bytes, or 0
+	 */
+	ArenaChunk* take(std::size_t capacity, bool oversize)
+	{
+		std::vector<ArenaChunk*>& chunks = oversize ? m_oversize : m_chunks;
+		for (std::size_t i = 0; i < chunks.size(); i++) {
+			const std::size_t size = chunks[i]->end - chunks[i]->begin;
+			if (oversize ? size == capacity : size >= capacity) {
+				ArenaChunk* chunk = chunks[i];
+				chunks.erase(chunks.begin() + i);
+				return chunk;
+			}
+		}
+		return 0;
+	}
+
+	bool put(ArenaChunk* chunk)
+	{
+		std::vector<ArenaChunk*>& chunks = chunk->oversize ? m_oversize : m_chunks;
+		if (chunks.size() >= (std::size_t)(chunk->oversize ? ARENA_OVERSIZE_CACHE : ARENA_CACHE))
+			return false;
+		chunks.push_back(chunk);
+		return true;
+	}
+
+	static void release(ArenaChunk* chunk)
+	{
+		const StorageBlock block = chunk->block;
+		chunk->~ArenaChunk();
+		system_release(block);
+	}
+
+private:
+	explicit ChunkCache(bool& closed) : m_closed(closed) {}
+
+	std::vector<ArenaChunk*> m_chunks;
+	std::vector<ArenaChunk*> m_oversize;
+	bool& m_closed;
+};
+
+inline void chunk_release(ArenaChunk* chunk)
+{
+	if (chunk->users.fetch_sub(1, std::memory_order_acq_rel) != 1)
+		return;
+	ChunkCache* cache = ChunkCache::instance();
+	if (!cache || !cache->put(chunk))
+		ChunkCache::release(chunk);
+}
+
+/*
+ * Chunk list of a TortoiseMatrixArena; the innermost open arena of the
+ * thread is current()
+ */
+class Arena
+{
+public:
+	explicit Arena(std::size_t chunk_bytes)
+	: m_chunks(0), m_chunk_bytes(round(chunk_bytes)), m_reserved(0), m_previous(current())
+	{
+		current() = this;
+	}
+
+	~Arena()
+	{
+		assert(current() == this);
+		current() = m_previous;
+		while (m_chunks) {
+			ArenaChunk* chunk = m_chunks;
+			m_chunks = chunk->previous;
+			chunk_release(chunk);
+		}
+	}
+
+	static Arena*& current()
+	{
+		static thread_local Arena* arena = 0;
+		return arena;
+	}
+
+	std::size_t reserved() const { return m_reserved; }
+
+	/*
+	 * Cuts bytes off the newest chunk of the list. A chunk whose buffers
+	 * have all been freed starts over at its beginning, so a loop of
+	 * temporaries keeps reusing the same memory; when the newest one is
+	 * full, such a chunk further down the list is taken before a new
+	 * one. Buffers over half a chunk get an oversize chunk of their own,
+	 * which goes back to the pool as soon as the buffer is freed.
+	 */
+	StorageBlock allocate(std::size_t bytes)
+	{
+		bytes = round(bytes);
+		ArenaChunk* chunk;
+		if (bytes > m_chunk_bytes / 2) {
+			chunk = take(oversize_capacity(bytes), true);
+			chunk->users.store(0, std::memory_order_relaxed);
+		}
+		else {
+			chunk = m_chunks;
+			if (chunk && chunk->users.load(std::memory_order_acquire) == 1)
+				chunk->next = chunk->begin;
+			if (!chunk || (std::size_t)(chunk->end - chunk->next) < bytes)
+				chunk = reuse();
+			if (!chunk) {
+				chunk = take(m_chunk_bytes, false);
+				chunk->previous = m_chunks;
+				m_chunks = chunk;
+				m_reserved += chunk->end - chunk->begin;
+			}
+		}
+
+		StorageBlock block = {chunk->next, 0, 0, chunk};
+		chunk->next += bytes;
+		chunk->users.fetch_add(1, std::memory_order_relaxed);
+		return block;
+	}
+
+private:
+	Arena(const Arena&);
+	Arena& operator=(const Arena&);
+
+	static std::size_t round(std::size_t bytes)
+	{
+		return (bytes + STORAGE_ALIGNMENT - 1) & ~std::size_t(STORAGE_ALIGNMENT - 1);
+	}
+
+	/*
+	 * Moves a chunk of the list without live buffers to its front,
+	 * rewound, or returns 0
+	 */
+	ArenaChunk* reuse()
+	{
+		ArenaChunk** link = m_chunks ? &m_chunks->previous : 0;
+		for (; link && *link; link = &(*link)->previous) {
+			ArenaChunk* chunk = *link;
+			if (chunk->users.load(std::memory_order_acquire) == 1) {
+				*link = chunk->previous;
+				chunk->previous = m_chunks;
+				chunk->next = chunk->begin;
+				m_chunks = chunk;
+				return chunk;
+			}
+		}
+		return 0;
+	}
+
+	/*
+	 * A chunk of capacity bytes (at least, for a shared one) from the
+	 * pool of the thread or the system, with one user
+	 */
+	static ArenaChunk* take(std::size_t capacity, bool oversize)
+	{
+		ChunkCache* cache = ChunkCache::instance();
+		ArenaChunk* chunk = cache ? cache->take(capacity, oversize) : 0;
+		if (!chunk) {
+			const std::size_t header = round(sizeof(ArenaChunk));
+			StorageBlock block = system_allocate(header + capacity);
+			chunk = new (block.data) ArenaChunk();
+			chunk->block = block;
+			chunk->begin = (char*)block.data + header;
+			chunk->end = chunk->begin + capacity;
+			chunk->oversize = oversize;
+		}
+		chunk->users.store(1, std::memory_order_relaxed);
+		chunk->next = chunk->begin;
+		chunk->previous = 0;
+		return chunk;
+	}
+
+	ArenaChunk* m_chunks;
+	std::size_t m_chunk_bytes;
+	std::size_t m_reserved;
+	Arena* m_previous;
+};
+
+/*
+ * Buffer from the innermost open arena of the thread, else the system
+ */
+inline StorageBlock storage_allocate(std::size_t bytes)
+{
+	if (bytes == 0) {
+		StorageBlock block = {0, 0, 0, 0};
+		return block;
+	}
+	Arena* arena = Arena::current();
+	return arena ? arena->allocate(bytes) : system_allocate(bytes);
+}
+
+inline void storage_release(const StorageBlock& block)
+{
+	if (block.chunk)
+		chunk_release(block.chunk);
+	else
+		system_release(block);
+}
+
+/*
+ * STORAGE_ALIGNMENT aligned element buffer of a matrix, in place of a
+ * std::valarray. Elements are copied as raw memory, which the arithmetic
+ * element types allow.
+ */
+template <typename T>
+class Storage
+{
+public:
+	Storage() : m_size(0) { m_block = storage_allocate(0); }
+
+	/*
+	 * size elements set to value
+	 */
+	explicit Storage(std::size_t size, const T& value = T())
+	: m_block(storage_allocate(size * sizeof(T))), m_size(size)
+	{
+		fill(value);
+	}
+
+	Storage(const Storage& storage)
+	: m_block(storage_allocate(storage.m_size * sizeof(T))), m_size(storage.m_size)
+	{
+		std::copy(storage.data(), storage.data() + m_size, data());
+	}
+
+	Storage(Storage&& storage)
+	: m_block(storage.m_block), m_size(storage.m_size)
+	{
+		storage.m_block = storage_allocate(0);
+		storage.m_size = 0;
+	}
+
+	~Storage() { storage_release(m_block); }
+
+	Storage& operator=(const Storage& storage)
+	{
+		if (this != &storage) {
+			reset(storage.m_size);
+			std::copy(storage.data(), storage.data() + m_size, data());
+		}
+		return *this;
+	}
+
+	Storage& operator=(Storage&& storage)
+	{
+		swap(storage);
+		return *this;
+	}
+
+	void swap(Storage& storage)
+	{
+		std::swap(m_block, storage.m_block);
+		std::swap(m_size, storage.m_size);
+	}
+
+	inline std::size_t size() const { return m_size; }
+	inline T* data() { return (T*)m_block.data; }
+	inline const T* data() const { return (const T*)m_block.data; }
+	inline T& operator[](std::size_t i) { return data()[i]; }
+	inline const T& operator[](std::size_t i) const { return data()[i]; }
+
+	/*
+	 * size elements set to value, like std::valarray::resize
+	 */
+	void resize(std::size_t size, const T& value = T())
+	{
+		reset(size);
+		fill(value);
+	}
+
+	/*
+	 * size elements left unset, for a buffer about to be overwritten;
+	 * keeps the current buffer when the size does not change
+	 */
+	void reset(std::size_t size)
+	{
+		if (size != m_size) {
+			StorageBlock block = storage_allocate(size * sizeof(T));
+			storage_release(m_block);
+			m_block = block;
+			m_size = size;
+		}
+	}
+
+	void fill(const T& value) { std::fill(data(), data() + m_size, value); }
+
+private:
+	StorageBlock m_block;
+	std::size_t m_size;
+};
+
+} // namespace tortoise_detail
+
+/*
+ * Scope in which the matrices allocated by the calling thread, including
+ * every temporary of the operators, transpose, extract and the math
+ * functions, take their buffers from a few large chunks instead of the
+ * heap, eg. around one inference request:
+ *
+ *	{
+ *		TortoiseMatrixArena scope;
+ *		TortoiseMatrix<float> y = x.dot(w).broadcast(b).tanh().dot(v);
+ *		...
+ *	}
+ *
+ * Closing the scope hands all its chunks back at once; every thread keeps
+ * a few for its next scopes, so a steady loop of requests stops calling
+ * malloc. A matrix that outlives its scope stays valid and holds on to
+ * its chunk until it is destroyed. Scopes nest, the innermost serving the
+ * allocations, and must close in the order they were opened.
+ */
+class TortoiseMatrixArena
+{
+public:
+	/*
+	 * chunk_bytes is the size of the chunks buffers are cut from; a
+	 * buffer over half of it gets a chunk of its own
+	 */
+	explicit TortoiseMatrixArena(std::size_t chunk_bytes = tortoise_detail::ARENA_CHUNK)
+	: m_arena(chunk_bytes)
+	{
+	}
+
+	/*
+	 * Bytes of the chunks the scope shares out; the oversize chunks of
+	 * large buffers go back to the pool of the thread when the buffer
+	 * is freed and are not counted
+	 */
+	std::size_t reserved() const { return m_arena.reserved(); }
+
+private:
+	tortoise_detail::Arena m_arena;
+};
+
+/*
+ * Direction of the axis reductions: TortoiseAxisRows reduces every row to
+ * one value ([rows, 1] result), TortoiseAxisCols every column ([1, cols])
+ */
+enum TortoiseAxis
+{
+	TortoiseAxisRows,
+	TortoiseAxisCols
+};
+
+/*
+ * Activations of the fused dot (see TortoiseMatrix::dot)
+ */
+enum TortoiseActivation
+{
+	TortoiseActivationNone,
+	TortoiseActivationRelu,
+	TortoiseActivationSigmoid,
+	TortoiseActivationTanh,
+	TortoiseActivationExp
+};
+
+template <typename T> class TortoiseMatrix;
+template <typename E, typename T> class TortoiseExpression;
+template <typename L, typename R, typename T, int Op> class TortoiseBinaryExpression;
+template <typename E, typename T, int Op, bool Reverse> class TortoiseScalarExpression;
+template <typename E, typename M, typename T, int Op> class TortoiseBroadcastExpression;
+template <typename E, typename T, typename F> class TortoiseUnaryExpression;
+template <typename T> class TortoiseBlockView;
+template <typename T> class TortoisePackedMatrix;
+
+namespace tortoise_detail {
+
+/*
+ * Expressions are evaluated EXPRESSION_BLOCK elements at a time, so every
+ * intermediate of a chain stays in L1 and memory is walked once.
+ */
+enum { EXPRESSION_BLOCK = 256 };
+
+/*
+ * Expression leaf that owns a matrix which was an rvalue operand, eg. the
+ * result of dot() in (x.dot(w) + b).tanh(). Owning it keeps the node safe
+ * to store, and lets the final assignment reuse its buffer.
+ */
+template <typename T>
+class OwnedMatrix
+{
+public:
+	explicit OwnedMatrix(TortoiseMatrix<T>&& mat)
+	: m_mat(std::move(mat)), m_stolen(0)
+	{
+	}
+
+	inline int rows() const { return m_mat.rows(); }
+	inline int cols() const { return m_mat.cols(); }
+	inline long size() const { return m_mat.size(); }
+
+	/*
+	 * Still valid after the buffer was handed over by steal()
+	 */
+	inline const T* data() const { return m_stolen ? m_stolen : m_mat.data(); }
+
+	inline const T* block(long begin, long, T*) const { return data() + begin; }
+	inline bool aliases(const T* first, const T* last) const
+	{
+		return size() > 0 && first < data() + size() && data() < last;
+	}
+	inline bool aliases_across(const T*, const T*) const { return false; }
+
+	/*
+	 * Moves the storage into into; the values stay readable through
+	 * data() until into is written
+	 */
+	bool steal(Storage<T>& into)
+	{
+		if (m_stolen || size() == 0)
+			return false;
+		m_stolen = m_mat.data();
+		into.swap(m_mat.m_data);
+		return true;
+	}
+
+private:
+	TortoiseMatrix<T> m_mat;
+	const T* m_stolen;
+};
+
+/*
+ * What an expression stores for an argument of (forwarded) type A:
+ * matrices passed as lvalues are referenced, rvalue matrices are owned,
+ * sub expressions are kept by value
+ */
+template <typename A>
+struct ExpressionOperand
+{
+	typedef typename std::decay<A>::type type;
+};
+
+template <typename T>
+struct ExpressionOperand<TortoiseMatrix<T> >
+{
+	typedef OwnedMatrix<T> type;
+};
+
+template <typename T>
+struct ExpressionOperand<TortoiseMatrix<T>&&>
+{
+	typedef OwnedMatrix<T> type;
+};
+
+template <typename X>
+struct ExpressionStorage
+{
+	typedef X type;
+};
+
+template <typename T>
+struct ExpressionStorage<TortoiseMatrix<T> >
+{
+	typedef const TortoiseMatrix<T>& type;
+};
+
+template <typename E, typename T>
+std::true_type is_expression_test(const TortoiseExpression<E, T>*);
+std::false_type is_expression_test(...);
+
+template <typename X>
+struct IsExpression : decltype(is_expression_test(static_cast<X*>(0)))
+{
+};
+
+/*
+ * Node types built by the operators, only defined for expression
+ * arguments so the free operators do not match anything else
+ */
+template <typename L, typename R, int Op, typename Enable = void>
+struct BinaryResult
+{
+};
+
+template <typename L, typename R, int Op>
+struct BinaryResult<L, R, Op, typename std::enable_if<
+	IsExpression<typename std::decay<L>::type>::value &&
+	IsExpression<typename std::decay<R>::type>::value &&
+	std::is_same<typename std::decay<L>::type::value_type, typename std::decay<R>::type::value_type>::value>::type>
+{
+	typedef typename std::decay<L>::type::value_type value_type;
+	typedef TortoiseBinaryExpression<typename ExpressionOperand<L>::type,
+	                                 typename ExpressionOperand<R>::type, value_type, Op> type;
+};
+
+template <typename L, typename T, int Op, bool Reverse>
+struct ScalarNode
+{
+	typedef TortoiseScalarExpression<typename ExpressionOperand<L>::type, T, Op, Reverse> type;
+};
+
+template <typename L, int Op, bool Reverse, typename Enable = void>
+struct ScalarResult
+{
+};
+
+template <typename L, int Op, bool Reverse>
+struct ScalarResult<L, Op, Reverse, typename std::enable_if<IsExpression<typename std::decay<L>::type>::value>::type>
+: ScalarNode<L, typename std::decay<L>::type::value_type, Op, Reverse>
+{
+	typedef typename std::decay<L>::type::value_type value_type;
+};
+
+/*
+ * Used inside TortoiseExpression, where the derived type is incomplete
+ */
+template <typename L, typename M, typename T, int Op>
+struct BroadcastResult
+{
+	typedef TortoiseBroadcastExpression<typename ExpressionOperand<L>::type,
+	                                    typename ExpressionOperand<M>::type, T, Op> type;
+};
+
+template <typename L, typename T, typename F>
+struct UnaryResult
+{
+	typedef TortoiseUnaryExpression<typename ExpressionOperand<L>::type, T, F> type;
+};
+
+template <int Op, typename T>
+inline void apply_binary(const T* a, const T* b, T* dst, long n)
+{
+	const ElementKernels<T>& k = element_kernels<T>();
+	switch (Op) {
+	case OP_ADD: k.add(a, b, dst, n); break;
+	case OP_SUB: k.sub(a, b, dst, n); break;
+	case OP_MUL: k.mul(a, b, dst, n); break;
+	default: k.div(a, b, dst, n); break;
+	}
+}
+
+template <int Op, bool Reverse, typename T>
+inline void apply_scalar(const T* a, T value, T* dst, long n)
+{
+	const ElementKernels<T>& k = element_kernels<T>();
+	if (Reverse) {
+		assert(Op == OP_DIV);
+		k.rdiv_scalar(a, value, dst, n);
+		return;
+	}
+	switch (Op) {
+	case OP_ADD: k.add_scalar(a, value, dst, n); break;
+	case OP_SUB: k.sub_scalar(a, value, dst, n); break;
+	case OP_MUL: k.mul_scalar(a, value, dst, n); break;
+	default: k.div_scalar(a, value, dst, n); break;
+	}
+}
+
+/*
+ * What a broadcast operand is to a [rows, cols] matrix: a [1, cols] row,
+ * a [rows, 1] column or a [1, 1] scalar
+ */
+enum BroadcastMode
+{
+	BROADCAST_ROW,
+	BROADCAST_COLUMN,
+	BROADCAST_SCALAR
+};
+
+inline BroadcastMode broadcast_mode(long rows, long cols, long vector_rows, long vector_cols)
+{
+	if (vector_rows == 1 && vector_cols == cols)
+		return BROADCAST_ROW;
+	if (vector_rows == 1 && vector_cols == 1)
+		return BROADCAST_SCALAR;
+	assert(vector_rows == rows && vector_cols == 1);
+	return BROADCAST_COLUMN;
+}
+
+/*
+ * Elements of a broadcast column are vector_step(vector) apart; rows
+ * are always contiguous
+ */
+template <typename V>
+inline long vector_step(const V& vector)
+{
+	return vector.cols();
+}
+
+template <typename T>
+inline long vector_step(const TortoiseBlockView<T>& vector)
+{
+	return vector.stride();
+}
+
+/*
+ * Broadcasts vector onto elements [begin, begin + n) of a row major
+ * matrix with cols columns, a (piece of a) row per kernel call so the
+ * row of the vector stays in L1; the elements of a column vector are
+ * step apart. out may equal a
+ */
+template <int Op, typename T>
+void broadcast_block(const T* a, long begin, long n, const T* vector, long step, long cols, BroadcastMode mode, T* out)
+{
+	for (long i = 0; i < n;) {
+		const long col = (begin + i) % cols;
+		const long count = std::min(n - i, cols - col);
+		if (mode == BROADCAST_ROW)
+			apply_binary<Op>(a + i, vector + col, out + i, count);
+		else
+			apply_scalar<Op, false>(a + i, vector[mode == BROADCAST_COLUMN ? (begin + i) / cols * step : 0], out + i, count);
+		i += count;
+	}
+}
+
+template <int Op, typename T>
+void broadcast_in_place(T* a, long rows, long cols, const T* vector, BroadcastMode mode)
+{
+	const long rows_per_task = std::max(1L, (long)(64 * EXPRESSION_BLOCK) / std::max(1L, cols));
+	ThreadPool::instance().run((int)((rows + rows_per_task - 1) / rows_per_task), [&](int task) {
+		const long begin = task * rows_per_task * cols;
+		const long n = (std::min(rows, (task + 1) * rows_per_task) - task * rows_per_task) * cols;
+		broadcast_block<Op>(a + begin, begin, n, vector, 1, cols, mode, a + begin);
+	});
+}
+
+/*
+ * Elementwise math applied to one block; dst may equal a
+ */
+#define TT_UNARY_FUNCTION(NAME, FUNCTION)                     \
+struct NAME                                                   \
+{                                                             \
+	template <typename T>                                     \
+	void operator()(const T* a, T* dst, long n) const         \
+	{                                                         \
+		for (long i = 0; i < n; i++)                          \
+			dst[i] = (T)std::FUNCTION(a[i]);                  \
+	}                                                         \
+};
+
+TT_UNARY_FUNCTION(TanFunction, tan)
+TT_UNARY_FUNCTION(AsinFunction, asin)
+TT_UNARY_FUNCTION(AcosFunction, acos)
+TT_UNARY_FUNCTION(AtanFunction, atan)
+
+#undef TT_UNARY_FUNCTION
+
+/*
+ * The vectorized functions; the precision is resolved when a block is
+ * evaluated, so TortoisePrecisionDefault follows the global setting
+ */
+template <int Function>
+struct MathFunction
+{
+	explicit MathFunction(TortoisePrecision precision) : precision(precision) {}
+
+	template <typename T>
+	void operator()(const T* a, T* dst, long n) const
+	{
+		const TortoisePrecision resolved = precision == TortoisePrecisionDefault ? tortoisePrecision() : precision;
+		elementwise_math<Function>(a, dst, n, resolved == TortoisePrecisionFast);
+	}
+
+	TortoisePrecision precision;
+};
+
+typedef MathFunction<MATH_EXP> ExpFunction;
+typedef MathFunction<MATH_LOG> LogFunction;
+typedef MathFunction<MATH_LOG10> Log10Function;
+typedef MathFunction<MATH_SIN> SinFunction;
+typedef MathFunction<MATH_COS> CosFunction;
+typedef MathFunction<MATH_SINH> SinhFunction;
+typedef MathFunction<MATH_COSH> CoshFunction;
+typedef MathFunction<MATH_TANH> TanhFunction;
+
+struct AbsFunction
+{
+	template <typename T>
+	void operator()(const T* a, T* dst, long n) const { elementwise_abs(a, dst, n); }
+};
+
+struct SqrtFunction
+{
+	template <typename T>
+	void operator()(const T* a, T* dst, long n) const { elementwise_sqrt(a, dst, n); }
+};
+
+struct PowFunction
+{
+	explicit PowFunction(double exponent) : exponent(exponent) {}
+
+	template <typename T>
+	void operator()(const T* a, T* dst, long n) const
+	{
+		for (long i = 0; i < n; i++)
+			dst[i] = (T)std::pow(a[i], (T)exponent);
+	}
+
+	double exponent;
+};
+
+/*
+ * Writes the whole expression to dst, one block at a time. When dst is
+ * also read by the expression each block is finished in a local buffer
+ * before it is stored; when it is read at other positions, eg. a
+ * broadcast of one of its own rows, the whole result is. Large
+ * expressions are split over the thread pool.
+ */
+template <typename E, typename T>
+void evaluate(const E& expr, T* dst)
+{
+	const long n = expr.size();
+	if (expr.aliases_across(dst, dst + n)) {
+		Storage<T> result;
+		result.reset(n);
+		evaluate(expr, result.data());
+		std::copy(result.data(), result.data() + n, dst);
+		return;
+	}
+	const bool buffered = expr.aliases(dst, dst + n);
+	const long blocks = (n + EXPRESSION_BLOCK - 1) / EXPRESSION_BLOCK;
+	const long blocks_per_task = 64;
+	const long tasks = (blocks + blocks_per_task - 1) / blocks_per_task;
+
+	ThreadPool::instance().run((int)tasks, [&](int task) {
+		T buffer[EXPRESSION_BLOCK];
+		const long first = task * blocks_per_task * EXPRESSION_BLOCK;
+		const long last = std::min(n, first + blocks_per_task * EXPRESSION_BLOCK);
+		for (long begin = first; begin < last; begin += EXPRESSION_BLOCK) {
+			const long count = std::min((long)EXPRESSION_BLOCK, last - begin);
+			const T* values = expr.block(begin, count, buffered ? buffer : dst + begin);
+			if (values != dst + begin)
+				std::copy(values, values + count, dst + begin);
+		}
+	});
+}
+
+/*
+ * Reductions split the elements into REDUCE_CHUNK sized chunks, reduced
+ * in parallel, and add up both the blocks of a chunk and the chunk
+ * results pairwise, so the rounding error of a sum grows with log(n)
+ * instead of n. The split depends on n only: results are bit identical
+ * for every thread count.
+ */
+enum { REDUCE_CHUNK = 1 << 16, REDUCE_BLOCK = 4096 };
+
+template <int Op, typename T>
+inline T reduce_kernel(const T* a, long n)
+{
+	const ElementKernels<T>& k = element_kernels<T>();
+	switch (Op) {
+	case OP_ADD: return k.sum(a, n);
+	case OP_MIN: return k.min(a, n);
+	default: return k.max(a, n);
+	}
+}
+
+// leaf(begin, count) reduces count <= block elements
+template <int Op, typename T, typename Leaf>
+T reduce_pairwise(const Leaf& leaf, long begin, long n, long block)
+{
+	if (n <= block)
+		return leaf(begin, n);
+	const long half = (n / 2 + block - 1) / block * block;
+	return scalar_op<Op>(reduce_pairwise<Op, T>(leaf, begin, half, block),
+	                     reduce_pairwise<Op, T>(leaf, begin + half, n - half, block));
+}
+
+template <int Op, typename T, typename Leaf>
+T reduce_chunks(const Leaf& leaf, long n, long block)
+{
+	const long chunks = (n + REDUCE_CHUNK - 1) / REDUCE_CHUNK;
+	if (chunks <= 1)
+		return reduce_pairwise<Op, T>(leaf, 0, n, block);
+
+	std::vector<T> partial(chunks);
+	ThreadPool::instance().run((int)chunks, [&](int chunk) {
+		const long begin = chunk * (long)REDUCE_CHUNK;
+		partial[chunk] = reduce_pairwise<Op, T>(leaf, begin, std::min((long)REDUCE_CHUNK, n - begin), block);
+	});
+	const T* values = &partial[0];
+	return reduce_pairwise<Op, T>([values](long begin, long) { return values[begin]; }, 0, chunks, 1);
+}
+
+template <int Op, typename T>
+T reduce(const T* a, long n)
+{
+	return reduce_chunks<Op, T>([a](long begin, long count) { return reduce_kernel<Op>(a + begin, count); },
+	                            n, REDUCE_BLOCK);
+}
+
+template <int Op, typename T, typename E>
+T reduce_expression(const E& expr)
+{
+	return reduce_chunks<Op, T>([&expr](long begin, long count) {
+		T buffer[EXPRESSION_BLOCK];
+		return reduce_kernel<Op>(expr.block(begin, count, buffer), count);
+	}, expr.size(), EXPRESSION_BLOCK);
+}
+
+/*
+ * Axis reductions. Each row is reduced like a whole matrix, rows in
+ * parallel. Columns are never walked with a stride: panels of
+ * EXPRESSION_BLOCK columns are accumulated a row at a time into a vector
+ * of results, pairwise over REDUCE_ROWS row leaves. Large inputs are
+ * split into panels and bands of rows that depend on the shape only, so
+ * like the whole matrix reductions the results do not depend on the
+ * number of threads. Arg reductions keep the first index of the best
+ * value.
+ */
+enum { REDUCE_ROWS = 64 };
+
+template <int Op, typename T>
+inline bool reduce_better(const T& a, const T& b)
+{
+	return Op == OP_MIN ? a < b : b < a;
+}
+
+template <int Op, typename T, typename E>
+void reduce_rows(const E& expr, T* out, int* index)
+{
+	const long rows = expr.rows();
+	const long cols = expr.cols();
+	const long rows_per_task = std::max(1L, (long)REDUCE_CHUNK / std::max(1L, cols));
+	const long tasks = (rows + rows_per_task - 1) / rows_per_task;
+
+	ThreadPool::instance().run((int)tasks, [&](int task) {
+		T buffer[EXPRESSION_BLOCK];
+		const long last = std::min(rows, (task + 1) * rows_per_task);
+		for (long row = task * rows_per_task; row < last; row++) {
+			const long base = row * cols;
+			if (!index) {
+				out[row] = reduce_pairwise<Op, T>([&](long begin, long count) {
+					return reduce_kernel<Op>(expr.block(base + begin, count, buffer), count);
+				}, 0, cols, EXPRESSION_BLOCK);
+				continue;
+			}
+			for (long begin = 0; begin < cols; begin += EXPRESSION_BLOCK) {
+				const long count = std::min((long)EXPRESSION_BLOCK, cols - begin);
+				const T* values = expr.block(base + begin, count, buffer);
+				const T best = reduce_kernel<Op>(values, count);
+				if (begin == 0 || reduce_better<Op>(best, out[row])) {
+					const long found = std::find(values, values + count, best) - values;
+					out[row] = best;
+					index[row] = (int)(begin + (found < count ? found : 0));
+				}
+			}
+		}
+	});
+}
+
+// Rows of an expression, as seen by reduce_columns
+template <typename E, typename T>
+struct ExpressionRows
+{
+	const T* values(long row, long col, long n, T* buffer) const { return expr.block(row * expr.cols() + col, n, buffer); }
+	const int* indices(long, long) const { return 0; }
+
+	const E& expr;
+};
+
+// Partial results of bands of rows, [bands, cols], with their indices
+template <typename T>
+struct PartialRows
+{
+	const T* values(long row, long col, long, T*) const { return value + row * cols + col; }
+	const int* indices(long row, long col) const { return index + row * cols + col; }
+
+	const T* value;
+	const int* index;
+	long cols;
+};
+
+// Combines n values into out; their indices are indices[i], or row if null
+template <int Op, bool Arg, typename T>
+inline void accumulate_row(const T* values, const int* indices, long row, long n, T* out, int* index)
+{
+	if (Arg) {
+		for (long i = 0; i < n; i++)
+			if (reduce_better<Op>(values[i], out[i])) {
+				out[i] = values[i];
+				index[i] = indices ? indices[i] : (int)row;
+			}
+	}
+	else if (Op == OP_ADD)
+		element_kernels<T>().add(out, values, out, n);
+	else if (Op == OP_MIN)
+		element_kernels<T>().minimum(out, values, out, n);
+	else
+		element_kernels<T>().maximum(out, values, out, n);
+}
+
+// Reduces rows [row, row + count) of the n <= EXPRESSION_BLOCK columns at col
+template <int Op, bool Arg, typename T, typename Rows>
+void reduce_columns(const Rows& rows, long row, long count, long col, long n, T* out, int* index)
+{
+	T buffer[EXPRESSION_BLOCK];
+	if (count <= REDUCE_ROWS) {
+		const T* values = rows.values(row, col, n, buffer);
+		std::copy(values, values + n, out);
+		if (Arg) {
+			const int* indices = rows.indices(row, col);
+			for (long i = 0; i < n; i++)
+				index[i] = indices ? indices[i] : (int)row;
+		}
+		for (long r = row + 1; r < row + count; r++)
+			accumulate_row<Op, Arg>(rows.values(r, col, n, buffer), Arg ? rows.indices(r, col) : 0, r, n, out, index);
+		return;
+	}
+
+	int second_index[EXPRESSION_BLOCK];
+	const long half = (count / 2 + REDUCE_ROWS - 1) / REDUCE_ROWS * REDUCE_ROWS;
+	reduce_columns<Op, Arg>(rows, row, half, col, n, out, index);
+	reduce_columns<Op, Arg>(rows, row + half, count - half, col, n, buffer, second_index);
+	accumulate_row<Op, Arg>(buffer, second_index, 0, n, out, index);
+}
+
+template <int Op, bool Arg, typename T, typename E>
+void reduce_cols(const E& expr, T* out, int* index)
+{
+	const long rows = expr.rows();
+	const long cols = expr.cols();
+	const long panels = (cols + EXPRESSION_BLOCK - 1) / EXPRESSION_BLOCK;
+	const long band = std::max((long)REDUCE_ROWS, (long)REDUCE_CHUNK / EXPRESSION_BLOCK);
+	const long bands = (rows + band - 1) / band;
+	const ExpressionRows<E, T> source = { expr };
+
+	if (rows == 0) {
+		std::fill(out, out + cols, T());
+		return;
+	}
+	if (bands <= 1) {
+		ThreadPool::instance().run((int)panels, [&](int panel) {
+			const long col = panel * (long)EXPRESSION_BLOCK;
+			const long n = std::min((long)EXPRESSION_BLOCK, cols - col);
+			reduce_columns<Op, Arg>(source, 0, rows, col, n, out + col, Arg ? index + col : 0);
+		});
+		return;
+	}
+
+	std::vector<T> partial(bands * cols);
+	std::vector<int> partial_index(Arg ? bands * cols : 0);
+	ThreadPool::instance().run((int)(bands * panels), [&](int task) {
+		const long row = task / panels * band;
+		const long col = task % panels * (long)EXPRESSION_BLOCK;
+		const long n = std::min((long)EXPRESSION_BLOCK, cols - col);
+		const long offset = row / band * cols + col;
+		reduce_columns<Op, Arg>(source, row, std::min(band, rows - row), col, n,
+		                        &partial[offset], Arg ? &partial_index[offset] : 0);
+	});
+
+	const PartialRows<T> partials = { &partial[0], Arg ? &partial_index[0] : 0, cols };
+	ThreadPool::instance().run((int)panels, [&](int panel) {
+		const long col = panel * (long)EXPRESSION_BLOCK;
+		const long n = std::min((long)EXPRESSION_BLOCK, cols - col);
+		reduce_columns<Op, Arg>(partials, 0, bands, col, n, out + col, Arg ? index + col : 0);
+	});
+}
+
+template <int Op, bool Arg, typename T, typename E>
+void reduce_axis(const E& expr, TortoiseAxis axis, T* out, int* index)
+{
+	if (axis == TortoiseAxisRows)
+		reduce_rows<Op>(expr, out, Arg ? index : 0);
+	else
+		reduce_cols<Op, Arg>(expr, out, index);
+}
+
+// [rows, 1] or [1, cols] result of an axis reduction
+template <typename T, typename E>
+TortoiseMatrix<T> axis_result(const E& expr, TortoiseAxis axis)
+{
+	if (axis == TortoiseAxisRows)
+		return TortoiseMatrix<T>(expr.rows(), 1);
+	return TortoiseMatrix<T>(1, expr.cols());
+}
+
+/*
+ * normalize() and normalizeColumns() read the data once for the minimum
+ * and the maximum together and once more to rescale it in place, as
+ * (value - min) * (1 / (max - min)); integers divide by max - min
+ * instead. Constant data (or columns) become 0.
+ */
+template <typename T>
+inline T normalize_scale(T min, T max)
+{
+	const T range = max - min == 0 ? T(1) : max - min;
+	return std::numeric_limits<T>::is_integer ? range : T(1) / range;
+}
+
+// a[i] = (a[i] - min[i]) * scale[i], over n elements
+template <typename T>
+inline void normalize_kernel(T* a, const T* min, const T* scale, long n)
+{
+	const ElementKernels<T>& k = element_kernels<T>();
+	k.sub(a, min, a, n);
+	if (std::numeric_limits<T>::is_integer)
+		k.div(a, scale, a, n);
+	else
+		k.mul(a, scale, a, n);
+}
+
+template <typename T>
+void normalize(T* a, long n)
+{
+	const ElementKernels<T>& k = element_kernels<T>();
+	const long chunks = (n + REDUCE_CHUNK - 1) / REDUCE_CHUNK;
+	std::vector<T> lows(chunks), highs(chunks);
+	ThreadPool::instance().run((int)chunks, [&](int chunk) {
+		const long first = chunk * (long)REDUCE_CHUNK;
+		const long last = std::min(n, first + REDUCE_CHUNK);
+		T low = a[first], high = a[first];
+		for (long begin = first; begin < last; begin += REDUCE_BLOCK) {
+			// the maximum reads the block back from L1
+			const long count = std::min((long)REDUCE_BLOCK, last - begin);
+			low = scalar_op<OP_MIN>(low, k.min(a + begin, count));
+			high = scalar_op<OP_MAX>(high, k.max(a + begin, count));
+		}
+		lows[chunk] = low;
+		highs[chunk] = high;
+	});
+
+	const T min = k.min(&lows[0], chunks);
+	const T scale = normalize_scale(min, k.max(&highs[0], chunks));
+	ThreadPool::instance().run((int)chunks, [&](int chunk) {
+		const long first = chunk * (long)REDUCE_CHUNK;
+		const long last = std::min(n, first + REDUCE_CHUNK);
+		for (long begin = first; begin < last; begin += REDUCE_BLOCK) {
+			const long count = std::min((long)REDUCE_BLOCK, last - begin);
+			k.sub_scalar(a + begin, min, a + begin, count);
+			if (std::numeric_limits<T>::is_integer)
+				k.div_scalar(a + begin, scale, a + begin, count);
+			else
+				k.mul_scalar(a + begin, scale, a + begin, count);
+		}
+	});
+}
+
+/*
+ * Columns are handled in panels of up to REDUCE_BLOCK columns and bands
+ * of rows, each task accumulating the minimum and maximum of its panel a
+ * row at a time; the partial results of the bands are combined per
+ * panel.
+ */
+template <typename T>
+void normalize_columns(T* a, long rows, long cols)
+{
+	const ElementKernels<T>& k = element_kernels<T>();
+	const long width = std::min(cols, (long)REDUCE_BLOCK);
+	const long panels = (cols + width - 1) / width;
+	const long band = std::max(1L, (long)REDUCE_CHUNK / width);
+	const long bands = (rows + band - 1) / band;
+
+	// minimums of every band, then maximums
+	std::vector<T> partial(2 * bands * cols);
+	T* const lows = &partial[0];
+	T* const highs = lows + bands * cols;
+	ThreadPool::instance().run((int)(bands * panels), [&](int task) {
+		const long row = task / panels * band;
+		const long col = task % panels * width;
+		const long n = std::min(width, cols - col);
+		T* low = lows + row / band * cols + col;
+		T* high = highs + row / band * cols + col;
+		std::copy(a + row * cols + col, a + row * cols + col + n, low);
+		std::copy(low, low + n, high);
+		for (long r = row + 1; r < std::min(rows, row + band); r++) {
+			k.minimum(low, a + r * cols + col, low, n);
+			k.maximum(high, a + r * cols + col, high, n);
+		}
+	});
+
+	// band 0 ends up with the minimum and scale of every column
+	ThreadPool::instance().run((int)panels, [&](int panel) {
+		const long col = panel * width;
+		const long last = std::min(cols, col + width);
+		for (long b = 1; b < bands; b++) {
+			k.minimum(lows + col, lows + b * cols + col, lows + col, last - col);
+			k.maximum(highs + col, highs + b * cols + col, highs + col, last - col);
+		}
+		for (long c = col; c < last; c++)
+			highs[c] = normalize_scale(lows[c], highs[c]);
+	});
+
+	const long rows_per_task = std::max(1L, (long)REDUCE_CHUNK / cols);
+	ThreadPool::instance().run((int)((rows + rows_per_task - 1) / rows_per_task), [&](int task) {
+		const long last = std::min(rows, (task + 1) * rows_per_task);
+		for (long row = task * rows_per_task; row < last; row++)
+			for (long col = 0; col < cols; col += REDUCE_BLOCK)
+				normalize_kernel(a + row * cols + col, lows + col, highs + col, std::min((long)REDUCE_BLOCK, cols - col));
+	});
+}
+
+} // namespace tortoise_detail
+
+/*
+ * Base of everything that can appear in an elementwise expression.
+ *
+ * Arithmetic operators, the broadcast family and the math functions do
+ * not compute anything; they return lightweight nodes that are evaluated
+ * in a single fused pass when assigned to a TortoiseMatrix (or reduced).
+ * Nodes reference matrices passed as lvalues and take ownership of
+ * temporaries, so an expression built from x.dot(w) can be stored, and
+ * assigning it reuses the buffer of that temporary.
+ *
+ * Every node E provides rows(), cols(), size(), aliases(first, last),
+ * aliases_across(first, last), true when an element of the result reads
+ * [first, last) at another position than its own, steal(storage) and
+ * block(begin, n, out), which returns a pointer to elements
+ * [begin, begin + n) of the row major result, written to out if needed.
+ */
+template <typename E, typename T>
+class TortoiseExpression
+{
+public:
+	typedef T value_type;
+
+	inline const E& derived() const { return static_cast<const E&>(*this); }
+	inline E& derived() { return static_cast<E&>(*this); }
+
+	/*
+	 * Computes a single element
+	 */
+	T operator()(int row, int col) const;
+
+	/*
+	 * Materializes the expression
+	 */
+	TortoiseMatrix<T> eval() const &;
+	TortoiseMatrix<T> eval() &&;
+
+	TortoiseMatrix<T> transpose() const;
+	TortoiseMatrix<T> dot(const TortoiseMatrix<T>& mat) const;
+
+	/*
+	  Adds the row of the mat to all rows of this matrix. mat is a
+	  [1, cols] row, or a [rows, 1] column added to all columns, or a
+	  [1, 1] matrix added to every element; the same goes for bSubtract,
+	  bMultiply and bDivide.
+	*/
+	template <typename M>
+	typename tortoise_detail::BroadcastResult<const E&, M, T, tortoise_detail::OP_ADD>::type broadcast(M&& mat) const &;
+	template <typename M>
+	typename tortoise_detail::BroadcastResult<E, M, T, tortoise_detail::OP_ADD>::type broadcast(M&& mat) &&;
+	/*
+	  Subtracts the row of the mat from all rows of this matrix
+	*/
+	template <typename M>
+	typename tortoise_detail::BroadcastResult<const E&, M, T, tortoise_detail::OP_SUB>::type bSubtract(M&& mat) const &;
+	template <typename M>
+	typename tortoise_detail::BroadcastResult<E, M, T, tortoise_detail::OP_SUB>::type bSubtract(M&& mat) &&;
+	/*
+	  Multiplies the row of the mat with all rows of this matrix
+	*/
+	template <typename M>
+	typename tortoise_detail::BroadcastResult<const E&, M, T, tortoise_detail::OP_MUL>::type bMultiply(M&& mat) const &;
+	template <typename M>
+	typename tortoise_detail::BroadcastResult<E, M, T, tortoise_detail::OP_MUL>::type bMultiply(M&& mat) &&;
+	/*
+	  Divides all rows of this matrix by the row of the mat
+	*/
+	template <typename M>
+	typename tortoise_detail::BroadcastResult<const E&, M, T, tortoise_detail::OP_DIV>::type bDivide(M&& mat) const &;
+	template <typename M>
+	typename tortoise_detail::BroadcastResult<E, M, T, tortoise_detail::OP_DIV>::type bDivide(M&& mat) &&;
+
+	// reverse order divide (eg. value / matrix)
+	typename tortoise_detail::ScalarNode<const E&, T, tortoise_detail::OP_DIV, true>::type div(double value) const &;
+	typename tortoise_detail::ScalarNode<E, T, tortoise_detail::OP_DIV, true>::type div(double value) &&;
+
+	typename tortoise_detail::UnaryResult<const E&, T, tortoise_detail::PowFunction>::type pow(double value) const &;
+	typename tortoise_detail::UnaryResult<E, T, tortoise_detail::PowFunction>::type pow(double value) &&;
+
+	/*
+	 * The math functions evaluated into out, a matrix of the same shape,
+	 * eg. to reuse one buffer across iterations; out may be an operand
+	 */
+	TortoiseMatrix<T>& pow(TortoiseMatrix<T>& out, double value) const;
+
+	/*
+	 * abs, exp, log, log10, sqrt, sin, cos, tan, asin, acos, atan, sinh,
+	 * cosh and tanh, each with an overload for temporaries and one
+	 * evaluating into out, like pow(out, value). exp, log, log10, sin,
+	 * cos, sinh, cosh and tanh take a TortoisePrecision.
+	 */
+#define TT_EXPRESSION_FUNCTION(NAME, FUNCTION)                                                        \
+	typename tortoise_detail::UnaryResult<const E&, T, tortoise_detail::FUNCTION>::type NAME() const &   \
+	{                                                                                                 \
+		typedef typename tortoise_detail::UnaryResult<const E&, T, tortoise_detail::FUNCTION>::type Node; \
+		return Node(derived(), tortoise_detail::FUNCTION());                                          \
+	}                                                                                                 \
+	typename tortoise_detail::UnaryResult<E, T, tortoise_detail::FUNCTION>::type NAME() &&               \
+	{                                                                                                 \
+		typedef typename tortoise_detail::UnaryResult<E, T, tortoise_detail::FUNCTION>::type Node;       \
+		return Node(std::move(derived()), tortoise_detail::FUNCTION());                               \
+	}                                                                                                 \
+	TortoiseMatrix<T>& NAME(TortoiseMatrix<T>& out) const                                             \
+	{                                                                                                 \
+		assert(out.rows() == derived().rows() && out.cols() == derived().cols());                     \
+		return out = NAME();                                                                          \
+	}
+
+#define TT_EXPRESSION_MATH(NAME, FUNCTION)                                                            \
+	typename tortoise_detail::UnaryResult<const E&, T, tortoise_detail::FUNCTION>::type                \
+	NAME(TortoisePrecision precision = TortoisePrecisionDefault) const &                              \
+	{                                                                                                 \
+		typedef typename tortoise_detail::UnaryResult<const E&, T, tortoise_detail::FUNCTION>::type Node; \
+		return Node(derived(), tortoise_detail::FUNCTION(precision));                                 \
+	}                                                                                                 \
+	typename tortoise_detail::UnaryResult<E, T, tortoise_detail::FUNCTION>::type                       \
+	NAME(TortoisePrecision precision = TortoisePrecisionDefault) &&                                   \
+	{                                                                                                 \
+		typedef typename tortoise_detail::UnaryResult<E, T, tortoise_detail::FUNCTION>::type Node;       \
+		return Node(std::move(derived()), tortoise_detail::FUNCTION(precision));                      \
+	}                                                                                                 \
+	TortoiseMatrix<T>& NAME(TortoiseMatrix<T>& out, TortoisePrecision precision = TortoisePrecisionDefault) const \
+	{                                                                                                 \
+		assert(out.rows() == derived().rows() && out.cols() == derived().cols());                     \
+		return out = NAME(precision);                                                                 \
+	}
+
+	TT_EXPRESSION_FUNCTION(abs, AbsFunction)
+	TT_EXPRESSION_MATH(exp, ExpFunction)
+	TT_EXPRESSION_MATH(log, LogFunction)
+	TT_EXPRESSION_MATH(log10, Log10Function)
+	TT_EXPRESSION_FUNCTION(sqrt, SqrtFunction)
+	TT_EXPRESSION_MATH(sin, SinFunction)
+	TT_EXPRESSION_MATH(cos, CosFunction)
+	TT_EXPRESSION_FUNCTION(tan, TanFunction)
+	TT_EXPRESSION_FUNCTION(asin, AsinFunction)
+	TT_EXPRESSION_FUNCTION(acos, AcosFunction)
+	TT_EXPRESSION_FUNCTION(atan, AtanFunction)
+	TT_EXPRESSION_MATH(sinh, SinhFunction)
+	TT_EXPRESSION_MATH(cosh, CoshFunction)
+	TT_EXPRESSION_MATH(tanh, TanhFunction)
+
+#undef TT_EXPRESSION_MATH
+#undef TT_EXPRESSION_FUNCTION
+
+	/*
+	 * Reductions run block by block without materializing the expression,
+	 * in parallel and pairwise like the TortoiseMatrix ones
+	 */
+	T min() const;
+	T max() const;
+	T sum() const;
+	double mean() const;
+
+	/*
+	 * Reductions along an axis (see TortoiseAxis). sumRows() is the
+	 * [rows, 1] matrix of the sums of every row, sumCols() the [1, cols]
+	 * one of every column, ready for broadcast(). meanAxis is computed in
+	 * T (truncated for integers) and argmin/argmax return the first index
+	 * of the minimum/maximum within the row (or column).
+	 */
+	TortoiseMatrix<T> sumRows() const;
+	TortoiseMatrix<T> sumCols() const;
+	TortoiseMatrix<T> minAxis(TortoiseAxis axis) const;
+	TortoiseMatrix<T> maxAxis(TortoiseAxis axis) const;
+	TortoiseMatrix<T> meanAxis(TortoiseAxis axis) const;
+	TortoiseMatrix<int> argmin(TortoiseAxis axis) const;
+	TortoiseMatrix<int> argmax(TortoiseAxis axis) const;
+};
+
+template <typename L, typename R, typename T, int Op>
+class TortoiseBinaryExpression : public TortoiseExpression<TortoiseBinaryExpression<L, R, T, Op>, T>
+{
+public:
+	template <typename A, typename B>
+	TortoiseBinaryExpression(A&& lhs, B&& rhs)
+	: m_lhs(std::forward<A>(lhs)), m_rhs(std::forward<B>(rhs))
+	{
+		assert(m_lhs.rows() == m_rhs.rows());
+		assert(m_lhs.cols() == m_rhs.cols());
+	}
+
+	inline int rows() const { return m_lhs.rows(); }
+	inline int cols() const { return m_lhs.cols(); }
+	inline long size() const { return m_lhs.size(); }
+
+	bool aliases(const T* first, const T* last) const
+	{
+		return m_lhs.aliases(first, last) || m_rhs.aliases(first, last);
+	}
+	bool aliases_across(const T* first, const T* last) const
+	{
+		return m_lhs.aliases_across(first, last) || m_rhs.aliases_across(first, last);
+	}
+
+	bool steal(tortoise_detail::Storage<T>& into) { return m_lhs.steal(into) || m_rhs.steal(into); }
+
+	const T* block(long begin, long n, T* out) const
+	{
+		T rhs[tortoise_detail::EXPRESSION_BLOCK];
+		const T* a = m_lhs.block(begin, n, out);
+		const T* b = m_rhs.block(begin, n, rhs);
+		tortoise_detail::apply_binary<Op>(a, b, out, n);
+		return out;
+	}
+
+private:
+	typename tortoise_detail::ExpressionStorage<L>::type m_lhs;
+	typename tortoise_detail::ExpressionStorage<R>::type m_rhs;
+};
+
+template <typename E, typename T, int Op, bool Reverse>
+class TortoiseScalarExpression : public TortoiseExpression<TortoiseScalarExpression<E, T, Op, Reverse>, T>
+{
+public:
+	template <typename A>
+	TortoiseScalarExpression(A&& mat, const T& value)
+	: m_mat(std::forward<A>(mat)), m_value(value)
+	{
+	}
+
+	inline int rows() const { return m_mat.rows(); }
+	inline int cols() const { return m_mat.cols(); }
+	inline long size() const { return m_mat.size(); }
+
+	bool aliases(const T* first, const T* last) const { return m_mat.aliases(first, last); }
+	bool aliases_across(const T* first, const T* last) const { return m_mat.aliases_across(first, last); }
+	bool steal(tortoise_detail::Storage<T>& into) { return m_mat.steal(into); }
+
+	const T* block(long begin, long n, T* out) const
+	{
+		const T* a = m_mat.block(begin, n, out);
+		tortoise_detail::apply_scalar<Op, Reverse>(a, m_value, out, n);
+		return out;
+	}
+
+private:
+	typename tortoise_detail::ExpressionStorage<E>::type m_mat;
+	T m_value;
+};
+
+template <typename E, typename M, typename T, int Op>
+class TortoiseBroadcastExpression : public TortoiseExpression<TortoiseBroadcastExpression<E, M, T, Op>, T>
+{
+public:
+	template <typename A, typename B>
+	TortoiseBroadcastExpression(A&& mat, B&& vector)
+	: m_mat(std::forward<A>(mat)), m_vector(std::forward<B>(vector)),
+	  m_mode(tortoise_detail::broadcast_mode(m_mat.rows(), m_mat.cols(), m_vector.rows(), m_vector.cols()))
+	{
+	}
+
+	inline int rows() const { return m_mat.rows(); }
+	inline int cols() const { return m_mat.cols(); }
+	inline long size() const { return m_mat.size(); }
+
+	bool aliases(const T* first, const T* last) const
+	{
+		return m_mat.aliases(first, last) || m_vector.aliases(first, last);
+	}
+
+	/*
+	 * Every block reads the vector, so a vector in [first, last) is
+	 * read after blocks before have been stored over it
+	 */
+	bool aliases_across(const T* first, const T* last) const
+	{
+		return m_mat.aliases_across(first, last) || m_vector.aliases(first, last);
+	}
+
+	bool steal(tortoise_detail::Storage<T>& into) { return m_mat.steal(into); }
+
+	/*
+	 * The block is cut at row ends so each piece lines up with the row
+	 * (or the element of the column)
+	 */
+	const T* block(long begin, long n, T* out) const
+	{
+		tortoise_detail::broadcast_block<Op>(m_mat.block(begin, n, out), begin, n, m_vector.data(),
+			tortoise_detail::vector_step(m_vector), m_mat.cols(), m_mode, out);
+		return out;
+	}
+
+private:
+	typename tortoise_detail::ExpressionStorage<E>::type m_mat;
+	typename tortoise_detail::ExpressionStorage<M>::type m_vector;
+	tortoise_detail::BroadcastMode m_mode;
+};
+
+template <typename E, typename T, typename F>
+class TortoiseUnaryExpression : public TortoiseExpression<TortoiseUnaryExpression<E, T, F>, T>
+{
+public:
+	template <typename A>
+	TortoiseUnaryExpression(A&& mat, const F& function)
+	: m_mat(std::forward<A>(mat)), m_function(function)
+	{
+	}
+
+	inline int rows() const { return m_mat.rows(); }
+	inline int cols() const { return m_mat.cols(); }
+	inline long size() const { return m_mat.size(); }
+
+	bool aliases(const T* first, const T* last) const { return m_mat.aliases(first, last); }
+	bool aliases_across(const T* first, const T* last) const { return m_mat.aliases_across(first, last); }
+	bool steal(tortoise_detail::Storage<T>& into) { return m_mat.steal(into); }
+
+	const T* block(long begin, long n, T* out) const
+	{
+		const T* a = m_mat.block(begin, n, out);
+		m_function(a, out, n);
+		return out;
+	}
+
+private:
+	typename tortoise_detail::ExpressionStorage<E>::type m_mat;
+	F m_function;
+};
+
+/*
+ * Non owning, read only view of a rectangular part of a matrix, eg. a
+ * minibatch of rows or a single column. Views reference the elements of
+ * the matrix in place; they are valid while the matrix is alive and not
+ * resized. They can be used in expressions, reductions and dot, copy()
+ * materializes the view into a new matrix.
+ */
+template <typename T>
+class TortoiseBlockView : public TortoiseExpression<TortoiseBlockView<T>, T>
+{
+public:
+	/*
+	 * rows x cols elements starting at data, consecutive rows are
+	 * stride elements apart
+	 */
+	TortoiseBlockView(const T* data, int rows, int cols, long stride)
+	: m_data(data), m_rows(rows), m_cols(cols), m_stride(stride)
+	{
+		assert(rows >= 0 && cols >= 0 && stride >= cols);
+	}
+
+	inline int rows() const { return m_rows; }
+	inline int cols() const { return m_cols; }
+	inline long size() const { return (long)m_rows * m_cols; }
+	inline long stride() const { return m_stride; }
+
+	inline T operator()(int row, int col) const { return m_data[row * m_stride + col]; }
+
+	/*
+	 * First element of the view
+	 */
+	inline const T* data() const { return m_data; }
+
+	TortoiseMatrix<T> copy() const { return TortoiseMatrix<T>(*this); }
+
+	TortoiseMatrix<T> dot(const TortoiseMatrix<T>& mat) const;
+	TortoiseMatrix<T> dot(const TortoiseBlockView<T>& view) const;
+
+	/*
+	 * Expression leaf interface, see TortoiseExpression
+	 */
+	const T* block(long begin, long n, T* out) const
+	{
+		if (m_stride == m_cols)
+			return m_data + begin;
+		long row = begin / m_cols;
+		long col = begin % m_cols;
+		for (long i = 0; i < n; row++, col = 0) {
+			const long count = std::min(n - i, m_cols - col);
+			std::copy(m_data + row * m_stride + col, m_data + row * m_stride + col + count, out + i);
+			i += count;
+		}
+		return out;
+	}
+
+	bool aliases(const T* first, const T* last) const
+	{
+		return size() > 0 && first < m_data + (m_rows - 1) * m_stride + m_cols && m_data < last;
+	}
+
+	/*
+	 * Element i of the view is element i of [first, last) only when the
+	 * view is all of it
+	 */
+	bool aliases_across(const T* first, const T* last) const
+	{
+		return aliases(first, last) && (m_data != first || m_stride != m_cols);
+	}
+
+	inline bool steal(tortoise_detail::Storage<T>&) const { return false; }
+
+private:
+	const T* m_data;
+	int m_rows;
+	int m_cols;
+	long m_stride;
+};
+
+/*
+ * A range of whole rows, the elements are contiguous
+ */
+template <typename T>
+using TortoiseRowRangeView = TortoiseBlockView<T>;
+
+/*
+ * A single column, rows x 1
+ */
+template <typename T>
+using TortoiseColumnView = TortoiseBlockView<T>;
+
+/*
+ * Elementwise operators between expressions (and matrices), and with a
+ * scalar on the right
+ */
+template <typename L, typename R>
+typename tortoise_detail::BinaryResult<L, R, tortoise_detail::OP_ADD>::type operator+(L&& lhs, R&& rhs)
+{
+	typedef typename tortoise_detail::BinaryResult<L, R, tortoise_detail::OP_ADD>::type Node;
+	return Node(std::forward<L>(lhs), std::forward<R>(rhs));
+}
+
+template <typename L, typename R>
+typename tortoise_detail::BinaryResult<L, R, tortoise_detail::OP_SUB>::type operator-(L&& lhs, R&& rhs)
+{
+	typedef typename tortoise_detail::BinaryResult<L, R, tortoise_detail::OP_SUB>::type Node;
+	return Node(std::forward<L>(lhs), std::forward<R>(rhs));
+}
+
+template <typename L, typename R>
+typename tortoise_detail::BinaryResult<L, R, tortoise_detail::OP_MUL>::type operator*(L&& lhs, R&& rhs)
+{
+	typedef typename tortoise_detail::BinaryResult<L, R, tortoise_detail::OP_MUL>::type Node;
+	return Node(std::forward<L>(lhs), std::forward<R>(rhs));
+}
+
+template <typename L, typename R>
+typename tortoise_detail::BinaryResult<L, R, tortoise_detail::OP_DIV>::type operator/(L&& lhs, R&& rhs)
+{
+	typedef typename tortoise_detail::BinaryResult<L, R, tortoise_detail::OP_DIV>::type Node;
+	return Node(std::forward<L>(lhs), std::forward<R>(rhs));
+}
+
+template <typename L>
+typename tortoise_detail::ScalarResult<L, tortoise_detail::OP_ADD, false>::type
+operator+(L&& lhs, const typename tortoise_detail::ScalarResult<L, tortoise_detail::OP_ADD, false>::value_type& value)
+{
+	typedef typename tortoise_detail::ScalarResult<L, tortoise_detail::OP_ADD, false>::type Node;
+	return Node(std::forward<L>(lhs), value);
+}
+
+template <typename L>
+typename tortoise_detail::ScalarResult<L, tortoise_detail::OP_SUB, false>::type
+operator-(L&& lhs, const typename tortoise_detail::ScalarResult<L, tortoise_detail::OP_SUB, false>::value_type& value)
+{
+	typedef typename tortoise_detail::ScalarResult<L, tortoise_detail::OP_SUB, false>::type Node;
+	return Node(std::forward<L>(lhs), value);
+}
+
+template <typename L>
+typename tortoise_detail::ScalarResult<L, tortoise_detail::OP_MUL, false>::type
+operator*(L&& lhs, const typename tortoise_detail::ScalarResult<L, tortoise_detail::OP_MUL, false>::value_type& value)
+{
+	typedef typename tortoise_detail::ScalarResult<L, tortoise_detail::OP_MUL, false>::type Node;
+	return Node(std::forward<L>(lhs), value);
+}
+
+template <typename L>
+typename tortoise_detail::ScalarResult<L, tortoise_detail::OP_DIV, false>::type
+operator/(L&& lhs, const typename tortoise_detail::ScalarResult<L, tortoise_detail::OP_DIV, false>::value_type& value)
+{
+	typedef typename tortoise_detail::ScalarResult<L, tortoise_detail::OP_DIV, false>::type Node;
+	return Node(std::forward<L>(lhs), value);
+}
+
+template <typename T>
+class TortoiseMatrix : public TortoiseExpression<TortoiseMatrix<T>, T>
+{
+public:
+	TortoiseMatrix<T>();
+	TortoiseMatrix<T>(int rows, int cols);
+	TortoiseMatrix<T>(int rows, int cols, const T&);
+	TortoiseMatrix<T>(int rows, int cols, const std::valarray<std::valarray<T>>& mat);
+	TortoiseMatrix<T>(const TortoiseMatrix<T>& mat);
+
+	/*
+	 * Takes over the storage of mat, which is left empty
+	 */
+	TortoiseMatrix<T>(TortoiseMatrix<T>&& mat);
+
+	/*
+	 * Evaluates an elementwise expression, eg. (a * b + c) / d
+	 */
+	template <typename E>
+	TortoiseMatrix<T>(const TortoiseExpression<E, T>& expr);
+
+	/*
+	 * Evaluates a temporary expression; when it owns a temporary matrix,
+	 * eg. (x.dot(w) + b).tanh(), the result is written over its storage
+	 * instead of a new allocation
+	 */
+	template <typename E>
+	TortoiseMatrix<T>(TortoiseExpression<E, T>&& expr);
+
+	/*
+	 * Access specific element by row and column
+	 */
+	T operator()(int row, int col) const;
+
+	long size() const;
+
+	TortoiseMatrix<T>& operator=(const TortoiseMatrix<T>& mat);
+	TortoiseMatrix<T>& operator=(TortoiseMatrix<T>&& mat);
+	TortoiseMatrix<T>& operator=(const T& value);
+
+	/*
+	 * Evaluates the expression into this matrix, reusing the storage
+	 * when the shape matches
+	 */
+	template <typename E>
+	TortoiseMatrix<T>& operator=(const TortoiseExpression<E, T>& expr);
+	template <typename E>
+	TortoiseMatrix<T>& operator=(TortoiseExpression<E, T>&& expr);
+
+	/*
+	 * Arithmetic operators, broadcast/bSubtract/bMultiply/bDivide, div
+	 * and the math functions (exp, tanh, ...) come from
+	 * TortoiseExpression and are evaluated lazily
+	 */
+	template <typename E>
+	TortoiseMatrix<T>& operator+=(const TortoiseExpression<E, T>& expr);
+	template <typename E>
+	TortoiseMatrix<T>& operator-=(const TortoiseExpression<E, T>& expr);
+	template <typename E>
+	TortoiseMatrix<T>& operator*=(const TortoiseExpression<E, T>& expr);
+	template <typename E>
+	TortoiseMatrix<T>& operator/=(const TortoiseExpression<E, T>& expr);
+
+	/*
+	 * broadcast, bSubtract, bMultiply and bDivide written over this
+	 * matrix, eg. a bias added to activations without a copy; mat is a
+	 * [1, cols] row, a [rows, 1] column or a [1, 1] matrix
+	 */
+	TortoiseMatrix<T>& broadcastInPlace(const TortoiseMatrix<T>& mat);
+	TortoiseMatrix<T>& bSubtractInPlace(const TortoiseMatrix<T>& mat);
+	TortoiseMatrix<T>& bMultiplyInPlace(const TortoiseMatrix<T>& mat);
+	TortoiseMatrix<T>& bDivideInPlace(const TortoiseMatrix<T>& mat);
+
+	/*
+	 * The math functions written over this matrix, eg. an activation
+	 * applied without a copy; the ones taking a TortoisePrecision in
+	 * TortoiseExpression take it here too
+	 */
+	TortoiseMatrix<T>& absInPlace();
+	TortoiseMatrix<T>& expInPlace(TortoisePrecision precision = TortoisePrecisionDefault);
+	TortoiseMatrix<T>& logInPlace(TortoisePrecision precision = TortoisePrecisionDefault);
+	TortoiseMatrix<T>& log10InPlace(TortoisePrecision precision = TortoisePrecisionDefault);
+	TortoiseMatrix<T>& powInPlace(double value);
+	TortoiseMatrix<T>& sqrtInPlace();
+	TortoiseMatrix<T>& sinInPlace(TortoisePrecision precision = TortoisePrecisionDefault);
+	TortoiseMatrix<T>& cosInPlace(TortoisePrecision precision = TortoisePrecisionDefault);
+	TortoiseMatrix<T>& tanInPlace();
+	TortoiseMatrix<T>& asinInPlace();
+	TortoiseMatrix<T>& acosInPlace();
+	TortoiseMatrix<T>& atanInPlace();
+	TortoiseMatrix<T>& sinhInPlace(TortoisePrecision precision = TortoisePrecisionDefault);
+	TortoiseMatrix<T>& coshInPlace(TortoisePrecision precision = TortoisePrecisionDefault);
+	TortoiseMatrix<T>& tanhInPlace(TortoisePrecision precision = TortoisePrecisionDefault);
+
+	void resize(int rows, int cols);
+
+	/*
+	 * Set value to the individual position in the matrix
+	 */
+	void set(int row, int col, const T&);
+
+/*
+	 * Set value to the all positions in the matrix
+	 */
+	void set(const T&);
+
+	/*
+	 * Transpose of the matrix
+	 */
+	TortoiseMatrix<T> transpose() const;
+
+	/*
+	 * Dot product
+	 */
+	TortoiseMatrix<T> dot(const TortoiseMatrix<T>& mat) const;
+	TortoiseMatrix<T> dot(const TortoiseBlockView<T>& view) const;
+
+	/*
+	 * Fused dense layer, activation(alpha * dot(mat) + bias): bias is
+	 * broadcast like broadcast() does (an empty matrix for none) and the
+	 * activation, a TortoiseActivation (at the tortoisePrecision()
+	 * setting) or a function T(T), is applied to pieces of the product
+	 * while they are still in cache instead of in passes over the result;
+	 * an exception thrown by the function propagates out of dot
+	 */
+	TortoiseMatrix<T> dot(const TortoiseMatrix<T>& mat, const TortoiseMatrix<T>& bias, T alpha = T(1),
+	                      TortoiseActivation activation = TortoiseActivationNone) const;
+	template <typename F>
+	TortoiseMatrix<T> dot(const TortoiseMatrix<T>& mat, const TortoiseMatrix<T>& bias, T alpha, F activation) const;
+
+	/*
+	 * Products with transposed operands, read transposed while packing
+	 * without a transposed copy: dotTN is this^T * mat, dotNT is
+	 * this * mat^T and dotTT is this^T * mat^T
+	 */
+	TortoiseMatrix<T> dotTN(const TortoiseMatrix<T>& mat) const;
+	TortoiseMatrix<T> dotNT(const TortoiseMatrix<T>& mat) const;
+	TortoiseMatrix<T> dotTT(const TortoiseMatrix<T>& mat) const;
+
+	/*
+	 * Products with a matrix packed by pack(), the same as dot and the
+	 * fused dot with the matrix itself minus the packing of every call
+	 */
+	TortoiseMatrix<T> dot(const TortoisePackedMatrix<T>& mat) const;
+	TortoiseMatrix<T> dot(const TortoisePackedMatrix<T>& mat, const TortoiseMatrix<T>& bias, T alpha = T(1),
+	                      TortoiseActivation activation = TortoiseActivationNone) const;
+	template <typename F>
+	TortoiseMatrix<T> dot(const TortoisePackedMatrix<T>& mat, const TortoiseMatrix<T>& bias, T alpha, F activation) const;
+
+	/*
+	 * Copy of the matrix in the layout dot reads its right operand in,
+	 * see TortoisePackedMatrix
+	 */
+	TortoisePackedMatrix<T> pack() const;
+	TortoiseMatrix<T> dot2(const TortoiseMatrix<T>& mat);
+
+	// experimental only! 4 times slower than dot 
+	TortoiseMatrix<T> dotTemp(const TortoiseMatrix<T>& mat);
+
+	TortoiseMatrix<T> atan2() const;
+
+	/*
+	  Extracts sub matrix from row_begin to row_end (including)
+	  returns [row_count, m_cols] matrix
+	*/
+	TortoiseMatrix<T> extract(int row_begin, int row_count) const;
+
+	/*
+	  Extracts single column
+	  returns [m_rows, 1] matrix
+	*/
+	TortoiseMatrix<T> extract(int col) const;
+
+	/*
+	  Views of rows row_begin to row_begin + row_count - 1, of a single
+	  column and of the rows x cols block at (row, col), without copying.
+	  See TortoiseBlockView; views of temporaries are not allowed.
+	*/
+	TortoiseRowRangeView<T> viewRows(int row_begin, int row_count) const &;
+	TortoiseColumnView<T> viewColumn(int col) const &;
+	TortoiseBlockView<T> viewBlock(int row, int col, int rows, int cols) const &;
+	TortoiseRowRangeView<T> viewRows(int row_begin, int row_count) && = delete;
+	TortoiseColumnView<T> viewColumn(int col) && = delete;
+	TortoiseBlockView<T> viewBlock(int row, int col, int rows, int cols) && = delete;
+
+	/*
+	 * Normalizes the matrix elements by:
+	 * value - min / max - min
+	 * in one pass for min and max and one to rescale; a constant matrix
+	 * becomes 0 and an empty one is left as is
+	 */
+	void normalize();
+
+	/*
+	 * Normalizes every column by its own min and max, eg. for feature
+	 * scaling; constant columns become 0 and an empty matrix is left
+	 * as is
+	 */
+	void normalizeColumns();
+
+	/*
+	 * Swaps the rows of the matrix
+	 */
+	void swap(int row1, int row2);
+
+	/*
+	 * Transposes the matrix without a second full size buffer. Square
+	 * matrices swap blocks across the diagonal, rectangular ones follow
+	 * the cycles of the permutation (one bit of bookkeeping per element,
+	 * and several times slower than transpose() for large matrices).
+	 */
+	void transposeInPlace();
+
+	/*
+	 * minimum value in the matrix
+	 */
+	T min() const;
+
+	/*
+	 * maximum value in the matrix
+	 */
+	T max() const;
+
+	/*
+	 * All the elements are summed, pairwise and in parallel for large
+	 * matrices; the result does not depend on the number of threads
+	 */
+	T sum() const;
+
+	/*
+	 * Mean of the whole matrix
+	 */
+	double mean() const;
+
+	inline int rows() const { return m_rows; }
+	inline int cols() const { return m_cols; }
+
+	/*
+	 * Row major element storage
+	 */
+	inline T* data() { return m_data.data(); }
+	inline const T* data() const { return m_data.data(); }
+
+	/*
+	 * Expression leaf interface, see TortoiseExpression
+	 */
+	inline const T* block(long begin, long, T*) const { return data() + begin; }
+	inline bool aliases(const T* first, const T* last) const
+	{
+		return m_data.size() > 0 && first < data() + m_data.size() && data() < last;
+	}
+	inline bool aliases_across(const T*, const T*) const { return false; }
+	inline bool steal(tortoise_detail::Storage<T>&) const { return false; }
+
+private:
+	friend class tortoise_detail::OwnedMatrix<T>;
+
+	tortoise_detail::Storage<T> m_data;
+
+	int m_rows;
+	int m_cols;
+};
+
+/*
+ * A matrix packed once into the layout dot reads its right operand in,
+ * for an operand of many products such as the weights of a layer:
+ * x.dot(packed) skips the packing that x.dot(w) does on every call. It
+ * is a copy of the matrix, laid out for the product kernels of the CPU
+ * it runs on.
+ */
+template <typename T>
+class TortoisePackedMatrix
+{
+public:
+	TortoisePackedMatrix() : m_rows(0), m_cols(0) {}
+	explicit TortoisePackedMatrix(const TortoiseMatrix<T>& mat);
+
+	inline int rows() const { return m_rows; }
+	inline int cols() const { return m_cols; }
+
+	/*
+	 * Packed elements
+	 */
+	inline const T* data() const { return m_data.data(); }
+
+private:
+	tortoise_detail::Storage<T> m_data;
+
+	int m_rows;
+	int m_cols;
+};
+
+/*
+ * A matrix whose dimensions are template arguments, eg.
+ * TortoiseFixedMatrix<float, 4, 4> for a transform. The elements live
+ * inline, so it never allocates and can sit on the stack or in another
+ * object, and every loop has a compile-time trip count the compiler
+ * unrolls. Meant for small shapes; matrix() converts to a TortoiseMatrix
+ * for everything else.
+ */
+template <typename T, int Rows, int Cols>
+class TortoiseFixedMatrix
+{
+	static_assert(Rows > 0 && Cols > 0, "TortoiseFixedMatrix needs positive dimensions");
+
+public:
+	typedef T value_type;
+
+	TortoiseFixedMatrix();
+	explicit TortoiseFixedMatrix(const T& value);
+	TortoiseFixedMatrix(std::initializer_list<std::initializer_list<T>> mat);
+	TortoiseFixedMatrix(const std::valarray<std::valarray<T>>& mat);
+
+	/*
+	 * Copies mat, which must be Rows x Cols
+	 */
+	explicit TortoiseFixedMatrix(const TortoiseMatrix<T>& mat);
+
+	static constexpr int rows() { return Rows; }
+	static constexpr int cols() { return Cols; }
+	static constexpr long size() { return (long)Rows * Cols; }
+
+	inline T operator()(int row, int col) const { return m_data[row * Cols + col]; }
+	inline T& operator()(int row, int col) { return m_data[row * Cols + col]; }
+	inline void set(int row, int col, const T& value) { m_data[row * Cols + col] = value; }
+	void set(const T& value);
+
+	inline T* data() { return m_data; }
+	inline const T* data() const { return m_data; }
+
+	TortoiseMatrix<T> matrix() const;
+
+	template <int N>
+	TortoiseFixedMatrix<T, Rows, N> dot(const TortoiseFixedMatrix<T, Cols, N>& mat) const;
+	TortoiseFixedMatrix<T, Cols, Rows> transpose() const;
+
+	T min() const;
+	T max() const;
+	T sum() const;
+	double mean() const;
+
+	TortoiseFixedMatrix& operator+=(const TortoiseFixedMatrix& mat);
+	TortoiseFixedMatrix& operator-=(const TortoiseFixedMatrix& mat);
+	TortoiseFixedMatrix& operator*=(const TortoiseFixedMatrix& mat);
+	TortoiseFixedMatrix& operator/=(const TortoiseFixedMatrix& mat);
+	TortoiseFixedMatrix& operator+=(const T& value);
+	TortoiseFixedMatrix& operator-=(const T& value);
+	TortoiseFixedMatrix& operator*=(const T& value);
+	TortoiseFixedMatrix& operator/=(const T& value);
+
+	/*
+	 * Elementwise operators, evaluated on the spot; defined here so a
+	 * scalar of another type, eg. m * 2 for a float matrix, converts to T
+	 */
+	friend TortoiseFixedMatrix operator+(TortoiseFixedMatrix lhs, const TortoiseFixedMatrix& rhs) { return lhs += rhs; }
+	friend TortoiseFixedMatrix operator-(TortoiseFixedMatrix lhs, const TortoiseFixedMatrix& rhs) { return lhs -= rhs; }
+	friend TortoiseFixedMatrix operator*(TortoiseFixedMatrix lhs, const TortoiseFixedMatrix& rhs) { return lhs *= rhs; }
+	friend TortoiseFixedMatrix operator/(TortoiseFixedMatrix lhs, const TortoiseFixedMatrix& rhs) { return lhs /= rhs; }
+	friend TortoiseFixedMatrix operator+(TortoiseFixedMatrix lhs, const T& value) { return lhs += value; }
+	friend TortoiseFixedMatrix operator-(TortoiseFixedMatrix lhs, const T& value) { return lhs -= value; }
+	friend TortoiseFixedMatrix operator*(TortoiseFixedMatrix lhs, const T& value) { return lhs *= value; }
+	friend TortoiseFixedMatrix operator/(TortoiseFixedMatrix lhs, const T& value) { return lhs /= value; }
+
+	friend bool operator==(const TortoiseFixedMatrix& lhs, const TortoiseFixedMatrix& rhs)
+	{
+		return std::equal(lhs.m_data, lhs.m_data + Rows * Cols, rhs.m_data);
+	}
+	friend bool operator!=(const TortoiseFixedMatrix& lhs, const TortoiseFixedMatrix& rhs) { return !(lhs == rhs); }
+
+private:
+	T m_data[Rows * Cols];
+};
+
+template<typename T>
+TortoiseMatrix<T>::TortoiseMatrix()
+: m_rows(0), m_cols(0)
+{
+}
+
+template<typename T>
+TortoiseMatrix<T>::TortoiseMatrix(int rows, int cols)
+: m_rows(rows), m_cols(cols)
+{
+	m_data.resize(rows * cols);
+}
+
+template<typename T>
+TortoiseMatrix<T>::TortoiseMatrix(int rows, int cols, const T& value)
+: m_rows(rows), m_cols(cols)
+{
+	m_data.resize(rows * cols, value);
+}
+
+template<typename T>
+TortoiseMatrix<T>::TortoiseMatrix(int rows, int cols, const std::valarray<std::valarray<T>> & mat)
+: m_rows(rows), m_cols(cols)
+{
+	m_data.resize(rows * cols);
+	for (int r = 0; r < rows; r++) {
+		for (int c = 0; c < cols; c++) {
+			set(r, c, mat[r][c]);
+		}
+	}
+}
+
+template<typename T>
+TortoiseMatrix<T>::TortoiseMatrix(const TortoiseMatrix<T>& mat)
+{
+	m_data = mat.m_data;
+	m_rows = mat.m_rows;
+	m_cols = mat.m_cols;
+}
+
+template<typename T>
+TortoiseMatrix<T>::TortoiseMatrix(TortoiseMatrix<T>&& mat)
+: m_rows(mat.m_rows), m_cols(mat.m_cols)
+{
+	std::swap(m_data, mat.m_data);
+	mat.m_rows = 0;
+	mat.m_cols = 0;
+}
+
+template<typename T>
+template<typename E>
+TortoiseMatrix<T>::TortoiseMatrix(const TortoiseExpression<E, T>& expr)
+: m_rows(expr.derived().rows()), m_cols(expr.derived().cols())
+{
+	m_data.reset(size());
+	tortoise_detail::evaluate(expr.derived(), data());
+}
+
+template<typename T>
+template<typename E>
+TortoiseMatrix<T>::TortoiseMatrix(TortoiseExpression<E, T>&& expr)
+: m_rows(expr.derived().rows()), m_cols(expr.derived().cols())
+{
+	E& mat = expr.derived();
+	if (!mat.steal(m_data))
+		m_data.reset(size());
+	tortoise_detail::evaluate(mat, data());
+}
+
+template<typename T>
+T TortoiseMatrix<T>::operator()(int row, int col) const
+{
+	return m_data[row * m_cols + col];
+}
+
+template<typename T>
+long TortoiseMatrix<T>::size() const
+{
+	return m_cols * m_rows;
+}
+
+template<typename T>
+TortoiseMatrix<T>& TortoiseMatrix<T>::operator=(const TortoiseMatrix<T>& mat)
+{
+	m_rows = mat.m_rows;
+	m_cols = mat.m_cols;
+
+	m_data = mat.m_data;
+	return *this;
+}
+
+template<typename T>
+TortoiseMatrix<T>& TortoiseMatrix<T>::operator=(TortoiseMatrix<T>&& mat)
+{
+	if (this != &mat) {
+		m_data.swap(mat.m_data);
+		m_rows = mat.m_rows;
+		m_cols = mat.m_cols;
+		tortoise_detail::Storage<T>().swap(mat.m_data);
+		mat.m_rows = 0;
+		mat.m_cols = 0;
+	}
+	return *this;
+}
+
+template<typename T>
+template<typename E>
+TortoiseMatrix<T>& TortoiseMatrix<T>::operator=(const TortoiseExpression<E, T>& expr)
+{
+	const E& mat = expr.derived();
+	if (m_data.size() != (std::size_t)mat.size()) {
+		if (mat.aliases(data(), data() + m_data.size()))
+			return *this = TortoiseMatrix<T>(expr);
+		m_data.reset(mat.size());
+	}
+	m_rows = mat.rows();
+	m_cols = mat.cols();
+	tortoise_detail::evaluate(mat, data());
+	return *this;
+}
+
+template<typename T>
+template<typename E>
+TortoiseMatrix<T>& TortoiseMatrix<T>::operator=(TortoiseExpression<E, T>&& expr)
+{
+	if (m_data.size() != (std::size_t)expr.derived().size())
+		return *this = TortoiseMatrix<T>(std::move(expr));
+	return *this = static_cast<const TortoiseExpression<E, T>&>(expr);
+}
+
+template<typename T>
+TortoiseMatrix<T>& TortoiseMatrix<T>::operator=(const T& value)
+{
+	m_data.fill(value);
+	return *this;
+}
+
+template<typename T>
+template<typename E>
+TortoiseMatrix<T>& TortoiseMatrix<T>::operator+=(const TortoiseExpression<E, T>& expr)
+{
+	const E& mat = expr.derived();
+	assert(m_rows == mat.rows());
+	assert(m_cols == mat.cols());
+	if (mat.aliases_across(data(), data() + size()))
+		return *this += TortoiseMatrix<T>(expr);
+
+	T buffer[tortoise_detail::EXPRESSION_BLOCK];
+	for (long begin = 0; begin < size(); begin += tortoise_detail::EXPRESSION_BLOCK) {
+		const long count = std::min((long)tortoise_detail::EXPRESSION_BLOCK, size() - begin);
+		const T* values = mat.block(begin, count, buffer);
+		tortoise_detail::apply_binary<tortoise_detail::OP_ADD>(data() + begin, values, data() + begin, count);
+	}
+	return *this;
+}
+
+template<typename T>
+template<typename E>
+TortoiseMatrix<T>& TortoiseMatrix<T>::operator-=(const TortoiseExpression<E, T>& expr)
+{
+	const E& mat = expr.derived();
+	assert(m_rows == mat.rows());
+	assert(m_cols == mat.cols());
+	if (mat.aliases_across(data(), data() + size()))
+		return *this -= TortoiseMatrix<T>(expr);
+
+	T buffer[tortoise_detail::EXPRESSION_BLOCK];
+	for (long begin = 0; begin < size(); begin += tortoise_detail::EXPRESSION_BLOCK) {
+		const long count = std::min((long)tortoise_detail::EXPRESSION_BLOCK, size() - begin);
+		const T* values = mat.block(begin, count, buffer);
+		tortoise_detail::apply_binary<tortoise_detail::OP_SUB>(data() + begin, values, data() + begin, count);
+	}
+	return *this;
+}
+
+template<typename T>
+template<typename E>
+TortoiseMatrix<T>& TortoiseMatrix<T>::operator*=(const TortoiseExpression<E, T>& expr)
+{
+	const E& mat = expr.derived();
+	assert(m_rows == mat.rows());
+	assert(m_cols == mat.cols());
+	if (mat.aliases_across(data(), data() + size()))
+		return *this *= TortoiseMatrix<T>(expr);
+
+	T buffer[tortoise_detail::EXPRESSION_BLOCK];
+	for (long begin = 0; begin < size(); begin += tortoise_detail::EXPRESSION_BLOCK) {
+		const long count = std::min((long)tortoise_detail::EXPRESSION_BLOCK, size() - begin);
+		const T* values = mat.block(begin, count, buffer);
+		tortoise_detail::apply_binary<tortoise_detail::OP_MUL>(data() + begin, values, data() + begin, count);
+	}
+	return *this;
+}
+
+template<typename T>
+template<typename E>
+TortoiseMatrix<T>& TortoiseMatrix<T>::operator/=(const TortoiseExpression<E, T>& expr)
+{
+	const E& mat = expr.derived();
+	assert(m_rows == mat.rows());
+	assert(m_cols == mat.cols());
+	if (mat.aliases_across(data(), data() + size()))
+		return *this /= TortoiseMatrix<T>(expr);
+
+	T buffer[tortoise_detail::EXPRESSION_BLOCK];
+	for (long begin = 0; begin < size(); begin += tortoise_detail::EXPRESSION_BLOCK) {
+		const long count = std::min((long)tortoise_detail::EXPRESSION_BLOCK, size() - begin);
+		const T* values = mat.block(begin, count, buffer);
+		tortoise_detail::apply_binary<tortoise_detail::OP_DIV>(data() + begin, values, data() + begin, count);
+	}
+	return *this;
+}
+
+template<typename T>
+TortoiseMatrix<T>& TortoiseMatrix<T>::broadcastInPlace(const TortoiseMatrix<T>& mat)
+{
+	tortoise_detail::broadcast_in_place<tortoise_detail::OP_ADD>(data(), m_rows, m_cols, mat.data(),
+		tortoise_detail::broadcast_mode(m_rows, m_cols, mat.rows(), mat.cols()));
+	return *this;
+}
+
+template<typename T>
+TortoiseMatrix<T>& TortoiseMatrix<T>::bSubtractInPlace(const TortoiseMatrix<T>& mat)
+{
+	tortoise_detail::broadcast_in_place<tortoise_detail::OP_SUB>(data(), m_rows, m_cols, mat.data(),
+		tortoise_detail::broadcast_mode(m_rows, m_cols, mat.rows(), mat.cols()));
+	return *this;
+}
+
+template<typename T>
+TortoiseMatrix<T>& TortoiseMatrix<T>::bMultiplyInPlace(const TortoiseMatrix<T>& mat)
+{
+	tortoise_detail::broadcast_in_place<tortoise_detail::OP_MUL>(data(), m_rows, m_cols, mat.data(),
+		tortoise_detail::broadcast_mode(m_rows, m_cols, mat.rows(), mat.cols()));
+	return *this;
+}
+
+template<typename T>
+TortoiseMatrix<T>& TortoiseMatrix<T>::bDivideInPlace(const TortoiseMatrix<T>& mat)
+{
+	tortoise_detail::broadcast_in_place<tortoise_detail::OP_DIV>(data(), m_rows, m_cols, mat.data(),
+		tortoise_detail::broadcast_mode(m_rows, m_cols, mat.rows(), mat.cols()));
+	return *this;
+}
+
+template<typename T>
+TortoiseMatrix<T>& TortoiseMatrix<T>::powInPlace(double value)
+{
+	return *this = this->pow(value);
+}
+
+#define TT_IN_PLACE_FUNCTION(NAME)                                                                  \
+	template<typename T>                                                                            \
+	TortoiseMatrix<T>& TortoiseMatrix<T>::NAME##InPlace()                                           \
+	{                                                                                               \
+		return *this = this->NAME();                                                                \
+	}
+
+#define TT_IN_PLACE_MATH(NAME)                                                                      \
+	template<typename T>                                                                            \
+	TortoiseMatrix<T>& TortoiseMatrix<T>::NAME##InPlace(TortoisePrecision precision)                \
+	{                                                                                               \
+		return *this = this->NAME(precision);                                                       \
+	}
+
+TT_IN_PLACE_FUNCTION(abs)
+TT_IN_PLACE_MATH(exp)
+TT_IN_PLACE_MATH(log)
+TT_IN_PLACE_MATH(log10)
+TT_IN_PLACE_FUNCTION(sqrt)
+TT_IN_PLACE_MATH(sin)
+TT_IN_PLACE_MATH(cos)
+TT_IN_PLACE_FUNCTION(tan)
+TT_IN_PLACE_FUNCTION(asin)
+TT_IN_PLACE_FUNCTION(acos)
+TT_IN_PLACE_FUNCTION(atan)
+TT_IN_PLACE_MATH(sinh)
+TT_IN_PLACE_MATH(cosh)
+TT_IN_PLACE_MATH(tanh)
+
+#undef TT_IN_PLACE_MATH
+#undef TT_IN_PLACE_FUNCTION
+
+template<typename T>
+void TortoiseMatrix<T>::resize(int rows, int cols)
+{
+	m_rows = rows;
+	m_cols = cols;
+
+	m_data.resize(rows * cols);
+}
+
+template<typename T>
+void TortoiseMatrix<T>::set(int row, int col, const T& value)
+{
+	m_data[row * m_cols + col] = value;
+}
+
+template<typename T>
+void TortoiseMatrix<T>::set(const T& value)
+{
+	m_data.fill(value);
+}
+
+template<typename T>
+void TortoiseMatrix<T>::transposeInPlace()
+{
+	if (m_rows == m_cols)
+		tortoise_detail::element_kernels<T>().transpose_square(data(), m_rows);
+	else
+		tortoise_detail::transpose_rectangular(data(), m_rows, m_cols);
+	std::swap(m_rows, m_cols);
+}
+
+template<typename T>
+TortoiseMatrix<T> TortoiseMatrix<T>::transpose() const
+{
+	TortoiseMatrix<T> result(m_cols, m_rows);
+	tortoise_detail::element_kernels<T>().transpose(data(), m_rows, m_cols, result.data());
+	return result;
+}
+
+template<typename T>
+TortoiseMatrix<T> TortoiseMatrix<T>::extract(int row_begin, int row_count) const
+{
+	return viewRows(row_begin, row_count).copy();
+}
+
+template<typename T>
+TortoiseMatrix<T> TortoiseMatrix<T>::extract(int col) const
+{
+	return viewColumn(col).copy();
+}
+
+template<typename T>
+TortoiseRowRangeView<T> TortoiseMatrix<T>::viewRows(int row_begin, int row_count) const &
+{
+	assert(row_begin >= 0 && row_count >= 0 && row_begin + row_count <= m_rows);
+	return TortoiseRowRangeView<T>(data() + (long)row_begin * m_cols, row_count, m_cols, m_cols);
+}
+
+template<typename T>
+TortoiseColumnView<T> TortoiseMatrix<T>::viewColumn(int col) const &
+{
+	assert(col >= 0 && col < m_cols);
+	return TortoiseColumnView<T>(data() + col, m_rows, 1, m_cols);
+}
+
+template<typename T>
+TortoiseBlockView<T> TortoiseMatrix<T>::viewBlock(int row, int col, int rows, int cols) const &
+{
+	assert(row >= 0 && rows >= 0 && row + rows <= m_rows);
+	assert(col >= 0 && cols >= 0 && col + cols <= m_cols);
+	return TortoiseBlockView<T>(data() + (long)row * m_cols + col, rows, cols, m_cols);
+}
+
+template<typename T>
+void TortoiseMatrix<T>::normalize()
+{
+	if (size() == 0)
+		return;
+	tortoise_detail::normalize(data(), size());
+}
+
+template<typename T>
+void TortoiseMatrix<T>::normalizeColumns()
+{
+	if (size() == 0)
+		return;
+	tortoise_detail::normalize_columns(data(), m_rows, m_cols);
+}
+
+template<typename T>
+void TortoiseMatrix<T>::swap(int row1, int row2)
+{
+	assert(m_rows > row1);
+	assert(m_rows > row2);
+
+	int ind_start = row1 * m_cols;
+	int ind_end = ind_start + m_cols;
+	int swp_ind_start = row2 * m_cols;
+	std::swap_ranges(data() + ind_start, data() + ind_end, data() + swp_ind_start);
+}
+
+template<typename T>
+T TortoiseMatrix<T>::min() const
+{
+	assert(size() > 0);
+	return tortoise_detail::reduce<tortoise_detail::OP_MIN>(data(), size());
+}
+
+template<typename T>
+T TortoiseMatrix<T>::max() const
+{
+	assert(size() > 0);
+	return tortoise_detail::reduce<tortoise_detail::OP_MAX>(data(), size());
+}
+
+template<typename T>
+T TortoiseMatrix<T>::sum() const
+{
+	return tortoise_detail::reduce<tortoise_detail::OP_ADD>(data(), size());
+}
+
+template<typename T>
+double TortoiseMatrix<T>::mean() const
+{
+	return (double)sum() / m_data.size();
+}
+
+template<typename T>
+TortoiseMatrix<T> TortoiseMatrix<T>::dotTemp(const TortoiseMatrix<T> &mat)
+{
+	TortoiseMatrix<T> result = TortoiseMatrix(m_rows, mat.m_cols);
+	const std::valarray<T> lhs(data(), size());
+	const std::valarray<T> rhs(mat.data(), mat.size());
+	for(auto r = 0; r < m_rows; r++) {
+		for(auto c = 0; c < mat.m_cols; c++) {
+			std::valarray<T> row = lhs[std::slice(r * m_cols, m_cols, 1)];
+			std::valarray<T> col = rhs[std::slice(c, mat.m_rows, mat.m_cols)];
+			std::valarray<T> mul = row * col;
+			const T& sum = mul.sum();
+			result.set(r, c, sum);
+		}
+	}
+	return result;
+}
+
+namespace tortoise_detail {
+
+template <typename T>
+inline ConstMatrixRef<T> const_ref(const TortoiseMatrix<T>& mat)
+{
+	ConstMatrixRef<T> ref = { mat.data(), mat.rows(), mat.cols(), mat.cols(), 1 };
+	return ref;
+}
+
+template <typename T>
+inline ConstMatrixRef<T> const_ref(const TortoiseBlockView<T>& view)
+{
+	ConstMatrixRef<T> ref = { view.data(), view.rows(), view.cols(), view.stride(), 1 };
+	return ref;
+}
+
+template <typename T>
+inline ConstMatrixRef<T> transposed(const ConstMatrixRef<T>& mat)
+{
+	ConstMatrixRef<T> ref = { mat.data, mat.cols, mat.rows, mat.cs, mat.rs };
+	return ref;
+}
+
+template <typename T>
+inline PackedMatrixRef<T> packed_ref(const TortoisePackedMatrix<T>& mat)
+{
+	const int nr = packed_nr<T>(mat.cols());
+	PackedMatrixRef<T> ref = { mat.data(), mat.rows(), mat.cols(), nr, nr ? (mat.cols() + nr - 1) / nr * nr : 0 };
+	return ref;
+}
+
+/*
+ * Strassen-Winograd products (TortoiseDotStrassen) recurse while all of
+ * m, k and n are at least GEMM_STRASSEN, then call gemm
+ */
+enum { GEMM_STRASSEN = 2048 };
+
+template <typename Ref>
+inline Ref strassen_block(const Ref& mat, int row, int col, int rows, int cols)
+{
+	Ref ref = { mat.data + row * mat.rs + col * mat.cs, rows, cols, mat.rs, mat.cs };
+	return ref;
+}
+
+template <typename T>
+inline ConstMatrixRef<T> strassen_const(const MatrixRef<T>& mat)
+{
+	ConstMatrixRef<T> ref = { mat.data, mat.rows, mat.cols, mat.rs, mat.cs };
+	return ref;
+}
+
+/*
+ * c = a op b elementwise; c has a unit column stride and may alias a or
+ * b. Every row of c is then scaled by alpha and handed to epilogue, as
+ * row + i of the product at column col, while it is still in cache.
+ */
+template <int Op, typename T, typename Epilogue>
+void strassen_combine(const ConstMatrixRef<T>& a, const ConstMatrixRef<T>& b, const MatrixRef<T>& c, T alpha,
+                      const Epilogue& epilogue, int row, int col)
+{
+	const int rows_per_task = std::max(1, (int)(64 * EXPRESSION_BLOCK) / std::max(1, c.cols));
+	ThreadPool::instance().run((c.rows + rows_per_task - 1) / rows_per_task, [&](int task) {
+		const int last = std::min(c.rows, (task + 1) * rows_per_task);
+		for (int i = task * rows_per_task; i < last; i++) {
+			const T* a_row = a.data + i * a.rs;
+			const T* b_row = b.data + i * b.rs;
+			T* c_row = c.data + i * c.rs;
+			if (a.cs == 1 && b.cs == 1)
+				apply_binary<Op>(a_row, b_row, c_row, c.cols);
+			else
+				for (int j = 0; j < c.cols; j++)
+					c_row[j] = scalar_op<Op>(a_row[j * a.cs], b_row[j * b.cs]);
+			if (alpha != T(1))
+				apply_scalar<OP_MUL, false>(c_row, alpha, c_row, c.cols);
+			epilogue(c_row, row + i, col, c.cols);
+		}
+	});
+}
+
+template <int Op, typename T>
+void strassen_combine(const ConstMatrixRef<T>& a, const ConstMatrixRef<T>& b, const MatrixRef<T>& c)
+{
+	strassen_combine<Op>(a, b, c, T(1), GemmNoEpilogue(), 0, 0);
+}
+
+/*
+ * epilogue, or nothing when the product is not finished yet
+ */
+template <typename Epilogue>
+struct StrassenEpilogue
+{
+	template <typename T>
+	void operator()(T* values, int row, int col, int n) const
+	{
+		if (enabled)
+			epilogue(values, row, col, n);
+	}
+
+	const Epilogue& epilogue;
+	bool enabled;
+};
+
+inline bool strassen_split(int m, int k, int n)
+{
+	return std::min(m, std::min(k, n)) >= GEMM_STRASSEN;
+}
+
+// Workspace of strassen_product for an m x k by k x n product
+template <typename T>
+long strassen_workspace(int m, int k, int n)
+{
+	if (!strassen_split(m, k, n))
+		return 0;
+	const int m2 = m / 2;
+	const int k2 = k / 2;
+	const int n2 = n / 2;
+	return (long)m2 * std::max(k2, n2) + (long)k2 * n2 + strassen_workspace<T>(m2, k2, n2);
+}
+
+/*
+ * C = alpha * A * B, then epilogue over every row, C with a unit column
+ * stride. An odd last row of A, column of A and row of B, or column of B
+ * is peeled off and handled by gemm. The even part runs the Winograd
+ * schedule of Boyer, Dumas, Pernet and Zhou (2009), with the C quadrants
+ * and two temporaries, X and Y, as the only storage: 7 products and 15
+ * additions. alpha and epilogue are applied by the last addition into
+ * each quadrant, or by the gemm of the odd slice of k, so C is not read
+ * again for them.
+ */
+template <typename T, typename Epilogue>
+void strassen_product(const ConstMatrixRef<T>& A, const ConstMatrixRef<T>& B, const MatrixRef<T>& C, T* work,
+                      T alpha, const Epilogue& epilogue)
+{
+	const int m = C.rows;
+	const int n = C.cols;
+	const int k = A.cols;
+	if (!strassen_split(m, k, n)) {
+		gemm(alpha, A, B, T(0), C, epilogue);
+		return;
+	}
+
+	const int m2 = m / 2;
+	const int k2 = k / 2;
+	const int n2 = n / 2;
+	const ConstMatrixRef<T> a11 = strassen_block(A, 0, 0, m2, k2);
+	const ConstMatrixRef<T> a12 = strassen_block(A, 0, k2, m2, k2);
+	const ConstMatrixRef<T> a21 = strassen_block(A, m2, 0, m2, k2);
+	const ConstMatrixRef<T> a22 = strassen_block(A, m2, k2, m2, k2);
+	const ConstMatrixRef<T> b11 = strassen_block(B, 0, 0, k2, n2);
+	const ConstMatrixRef<T> b12 = strassen_block(B, 0, n2, k2, n2);
+	const ConstMatrixRef<T> b21 = strassen_block(B, k2, 0, k2, n2);
+	const ConstMatrixRef<T> b22 = strassen_block(B, k2, n2, k2, n2);
+	const MatrixRef<T> c11 = strassen_block(C, 0, 0, m2, n2);
+	const MatrixRef<T> c12 = strassen_block(C, 0, n2, m2, n2);
+	const MatrixRef<T> c21 = strassen_block(C, m2, 0, m2, n2);
+	const MatrixRef<T> c22 = strassen_block(C, m2, n2, m2, n2);
+	const MatrixRef<T> x = { work, m2, k2, k2, 1 };
+	const MatrixRef<T> y = { work + (long)m2 * std::max(k2, n2), k2, n2, n2, 1 };
+	const MatrixRef<T> p1 = { work, m2, n2, n2, 1 };
+	T* next = y.data + (long)k2 * n2;
+	const bool odd_k = k > 2 * k2;
+	const T scale = odd_k ? T(1) : alpha;
+	const StrassenEpilogue<Epilogue> finish = { epilogue, !odd_k };
+	const GemmNoEpilogue none = GemmNoEpilogue();
+
+	// S3 T3 = P7, S1 T1 = P5, S2 T2 = P6, S4 B22 = P3
+	strassen_combine<OP_SUB>(a11, a21, x);
+	strassen_combine<OP_SUB>(b22, b12, y);
+	strassen_product(strassen_const(x), strassen_const(y), c21, next, T(1), none);
+	strassen_combine<OP_ADD>(a21, a22, x);
+	strassen_combine<OP_SUB>(b12, b11, y);
+	strassen_product(strassen_const(x), strassen_const(y), c22, next, T(1), none);
+	strassen_combine<OP_SUB>(strassen_const(x), a11, x);
+	strassen_combine<OP_SUB>(b22, strassen_const(y), y);
+	strassen_product(strassen_const(x), strassen_const(y), c12, next, T(1), none);
+	strassen_combine<OP_SUB>(a12, strassen_const(x), x);
+	strassen_product(strassen_const(x), b22, c11, next, T(1), none);
+
+	// P1 = A11 B11, then U2 = P1 + P6, U3 = U2 + P7, U4 = U2 + P5,
+	// U7 = U3 + P5 (C22) and U5 = U4 + P3 (C12)
+	strassen_product(a11, b11, p1, next, T(1), none);
+	strassen_combine<OP_ADD>(strassen_const(p1), strassen_const(c12), c12);
+	strassen_combine<OP_ADD>(strassen_const(c12), strassen_const(c21), c21);
+	strassen_combine<OP_ADD>(strassen_const(c12), strassen_const(c22), c12);
+	strassen_combine<OP_ADD>(strassen_const(c21), strassen_const(c22), c22, scale, finish, m2, n2);
+	strassen_combine<OP_ADD>(strassen_const(c12), strassen_const(c11), c12, scale, finish, 0, n2);
+
+	// P4 = A22 T4, U6 = U3 - P4 (C21), P2 = A12 B21 and U1 = P1 + P2 (C11)
+	strassen_combine<OP_SUB>(strassen_const(y), b21, y);
+	strassen_product(a22, strassen_const(y), c11, next, T(1), none);
+	strassen_combine<OP_SUB>(strassen_const(c21), strassen_const(c11), c21, scale, finish, m2, 0);
+	strassen_product(a12, b21, c11, next, T(1), none);
+	strassen_combine<OP_ADD>(strassen_const(p1), strassen_const(c11), c11, scale, finish, 0, 0);
+
+	if (odd_k) {
+		const MatrixRef<T> c = strassen_block(C, 0, 0, 2 * m2, 2 * n2);
+		gemm(alpha, strassen_block(A, 0, 2 * k2, 2 * m2, 1), strassen_block(B, 2 * k2, 0, 1, 2 * n2), alpha, c,
+		     epilogue);
+	}
+	if (n > 2 * n2)
+		gemm(alpha, strassen_block(A, 0, 0, 2 * m2, k), strassen_block(B, 0, 2 * n2, k, 1), T(0),
+		     strassen_block(C, 0, 2 * n2, 2 * m2, 1),
+		     [&](T* values, int i, int j, int count) { epilogue(values, i, 2 * n2 + j, count); });
+	if (m > 2 * m2)
+		gemm(alpha, strassen_block(A, 2 * m2, 0, 1, k), B, T(0), strassen_block(C, 2 * m2, 0, 1, n),
+		     [&](T* values, int i, int j, int count) { epilogue(values, 2 * m2 + i, j, count); });
+}
+
+/*
+ * C = alpha * A * B, then epilogue over every row, with the Strassen
+ * products when they are enabled and suit the shape and type; returns
+ * false otherwise
+ */
+template <typename T, typename Epilogue>
+bool gemm_strassen(T alpha, const ConstMatrixRef<T>& A, const ConstMatrixRef<T>& B, const MatrixRef<T>& C,
+                   const Epilogue& epilogue)
+{
+	if (tortoiseDotAlgorithm() != TortoiseDotStrassen || !std::is_floating_point<T>::value
+	    || !strassen_split(C.rows, A.cols, C.cols) || C.cs != 1)
+		return false;
+
+	PackBuffer<T> work(strassen_workspace<T>(C.rows, A.cols, C.cols));
+	strassen_product(A, B, C, work.data(), alpha, epilogue);
+	return true;
+}
+
+template <typename T, typename Epilogue>
+inline bool gemm_strassen(T, const ConstMatrixRef<T>&, const PackedMatrixRef<T>&, const MatrixRef<T>&,
+                          const Epilogue&)
+{
+	return false;
+}
+
+/*
+ * a * b into a new matrix, b a ConstMatrixRef or a PackedMatrixRef
+ */
+template <typename T, typename Operand>
+TortoiseMatrix<T> multiply(const ConstMatrixRef<T>& a, const Operand& b)
+{
+	assert(a.cols == b.rows);
+
+	TortoiseMatrix<T> dest(a.rows, b.cols);
+	MatrixRef<T> c = { dest.data(), dest.rows(), dest.cols(), dest.cols(), 1 };
+	if (!gemm_strassen(T(1), a, b, c, GemmNoEpilogue()))
+		gemm(T(1), a, b, T(0), c, GemmNoEpilogue());
+	return dest;
+}
+
+/*
+ * The TortoiseActivation functions over n values in place
+ */
+template <typename T>
+struct BuiltinActivation
+{
+	void operator()(T* values, int n) const
+	{
+		const ExpFunction exp_function(TortoisePrecisionDefault);
+		const TanhFunction tanh_function(TortoisePrecisionDefault);
+		switch (activation) {
+		case TortoiseActivationRelu:
+			for (int i = 0; i < n; i++)
+				values[i] = scalar_op<OP_MAX>(values[i], T(0));
+			break;
+		case TortoiseActivationSigmoid:
+			// 1 / (1 + exp(-x))
+			apply_scalar<OP_MUL, false>(values, T(-1), values, n);
+			exp_function(values, values, n);
+			apply_scalar<OP_ADD, false>(values, T(1), values, n);
+			apply_scalar<OP_DIV, true>(values, T(1), values, n);
+			break;
+		case TortoiseActivationTanh:
+			tanh_function(values, values, n);
+			break;
+		case TortoiseActivationExp:
+			exp_function(values, values, n);
+			break;
+		default:
+			break;
+		}
+	}
+
+	TortoiseActivation activation;
+};
+
+// A user function T(T), applied to every value
+template <typename T, typename F>
+struct ElementActivation
+{
+	void operator()(T* values, int n) const
+	{
+		for (int i = 0; i < n; i++)
+			values[i] = function(values[i]);
+	}
+
+	F function;
+};
+
+/*
+ * Epilogue of the fused dot: bias broadcast over the full result, then
+ * the activation
+ */
+template <typename T, typename Activation>
+struct DenseEpilogue
+{
+	void operator()(T* values, int row, int col, int n) const
+	{
+		if (bias)
+			broadcast_block<OP_ADD>(values, (long)row * cols + col, n, bias, 1, cols, mode, values);
+		activation(values, n);
+	}
 
-	/*
-	 * All the elements are summed
-	 */
-	T sum() const;
+	const T* bias;
+	BroadcastMode mode;
+	long cols;
+	Activation activation;
+};
 
-	/*
-	 * Mean of the whole matrix
-	 */
-	double mean() const;
+/*
+ * activation(alpha * a * b + bias) into a new matrix
+ */
+template <typename T, typename Operand, typename Activation>
+TortoiseMatrix<T> multiply(const ConstMatrixRef<T>& a, const Operand& b, const TortoiseMatrix<T>& bias,
+                           T alpha, const Activation& activation)
+{
+	assert(a.cols == b.rows);
 
-	inline int rows() const { return m_rows; }
-	inline int cols() const { return m_cols; }
+	TortoiseMatrix<T> dest(a.rows, b.cols);
+	MatrixRef<T> c = { dest.data(), dest.rows(), dest.cols(), dest.cols(), 1 };
+	const BroadcastMode mode = bias.size() ? broadcast_mode(c.rows, c.cols, bias.rows(), bias.cols()) : BROADCAST_ROW;
+	const DenseEpilogue<T, Activation> epilogue = { bias.data(), mode, c.cols, activation };
+	if (!gemm_strassen(alpha, a, b, c, epilogue))
+		gemm(alpha, a, b, T(0), c, epilogue);
+	return dest;
+}
 
-private:
-	std::valarray<T> m_data;
+} // namespace tortoise_detail
 
-	int m_rows;
-	int m_cols;
-};
+template<typename T>
+TortoiseMatrix<T> TortoiseMatrix<T>::dot(const TortoiseMatrix<T> &mat) const
+{
+	return tortoise_detail::multiply(tortoise_detail::const_ref(*this), tortoise_detail::const_ref(mat));
+}
 
 template<typename T>
-TortoiseMatrix<T>::TortoiseMatrix()
+TortoiseMatrix<T> TortoiseMatrix<T>::dot(const TortoiseBlockView<T>& view) const
 {
+	return tortoise_detail::multiply(tortoise_detail::const_ref(*this), tortoise_detail::const_ref(view));
 }
 
 template<typename T>
-TortoiseMatrix<T>::TortoiseMatrix(int rows, int cols)
-: m_rows(rows), m_cols(cols)
+TortoiseMatrix<T> TortoiseMatrix<T>::dot(const TortoiseMatrix<T>& mat, const TortoiseMatrix<T>& bias, T alpha,
+                                         TortoiseActivation activation) const
 {
-	m_data.resize(rows * cols);
+	const tortoise_detail::BuiltinActivation<T> function = { activation };
+	return tortoise_detail::multiply(tortoise_detail::const_ref(*this), tortoise_detail::const_ref(mat), bias, alpha, function);
 }
 
 template<typename T>
-TortoiseMatrix<T>::TortoiseMatrix(int rows, int cols, const T& value)
-: m_rows(rows), m_cols(cols)
+template<typename F>
+TortoiseMatrix<T> TortoiseMatrix<T>::dot(const TortoiseMatrix<T>& mat, const TortoiseMatrix<T>& bias, T alpha,
+                                         F activation) const
 {
-	m_data.resize(rows * cols, value);
+	const tortoise_detail::ElementActivation<T, F> function = { activation };
+	return tortoise_detail::multiply(tortoise_detail::const_ref(*this), tortoise_detail::const_ref(mat), bias, alpha, function);
 }
 
 template<typename T>
-TortoiseMatrix<T>::TortoiseMatrix(int rows, int cols, const std::valarray<std::valarray<T>> & mat)
-: m_rows(rows), m_cols(cols)
+TortoiseMatrix<T> TortoiseMatrix<T>::dotTN(const TortoiseMatrix<T>& mat) const
 {
-	m_data.resize(rows * cols);
-	for (int r = 0; r < rows; r++) {
-		for (int c = 0; c < cols; c++) {
-			set(r, c, mat[r][c]);
-		}
-	}
+	return tortoise_detail::multiply(tortoise_detail::transposed(tortoise_detail::const_ref(*this)),
+	                                 tortoise_detail::const_ref(mat));
 }
 
 template<typename T>
-TortoiseMatrix<T>::TortoiseMatrix(const TortoiseMatrix<T>& mat)
+TortoiseMatrix<T> TortoiseMatrix<T>::dotNT(const TortoiseMatrix<T>& mat) const
 {
-	m_data = mat.m_data;
-	m_rows = mat.m_rows;
-	m_cols = mat.m_cols;
+	return tortoise_detail::multiply(tortoise_detail::const_ref(*this),
+	                                 tortoise_detail::transposed(tortoise_detail::const_ref(mat)));
 }
 
 template<typename T>
-T TortoiseMatrix<T>::operator()(int row, int col) const
+TortoiseMatrix<T> TortoiseMatrix<T>::dotTT(const TortoiseMatrix<T>& mat) const
 {
-	return m_data[row * m_cols + col];
+	return tortoise_detail::multiply(tortoise_detail::transposed(tortoise_detail::const_ref(*this)),
+	                                 tortoise_detail::transposed(tortoise_detail::const_ref(mat)));
 }
 
 template<typename T>
-long TortoiseMatrix<T>::size() const
+TortoisePackedMatrix<T>::TortoisePackedMatrix(const TortoiseMatrix<T>& mat)
+: m_data(tortoise_detail::packed_size<T>(mat.rows(), mat.cols())), m_rows(mat.rows()), m_cols(mat.cols())
 {
-	return m_cols * m_rows;
+	if (m_data.size())
+		tortoise_detail::gemm_pack(tortoise_detail::const_ref(mat), m_data.data());
 }
 
 template<typename T>
-TortoiseMatrix<T>& TortoiseMatrix<T>::operator=(const TortoiseMatrix<T>& mat)
+TortoisePackedMatrix<T> TortoiseMatrix<T>::pack() const
 {
-	m_rows = mat.m_rows;
-	m_cols = mat.m_cols;
+	return TortoisePackedMatrix<T>(*this);
+}
 
-	m_data = mat.m_data;
-	return *this;
+template<typename T>
+TortoiseMatrix<T> TortoiseMatrix<T>::dot(const TortoisePackedMatrix<T>& mat) const
+{
+	return tortoise_detail::multiply(tortoise_detail::const_ref(*this), tortoise_detail::packed_ref(mat));
 }
 
 template<typename T>
-TortoiseMatrix<T>& TortoiseMatrix<T>::operator=(const T& value)
+TortoiseMatrix<T> TortoiseMatrix<T>::dot(const TortoisePackedMatrix<T>& mat, const TortoiseMatrix<T>& bias, T alpha,
+                                         TortoiseActivation activation) const
 {
-	m_data = value;
-	return *this;
+	const tortoise_detail::BuiltinActivation<T> function = { activation };
+	return tortoise_detail::multiply(tortoise_detail::const_ref(*this), tortoise_detail::packed_ref(mat), bias, alpha, function);
 }
 
 template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::operator+(const TortoiseMatrix<T>& mat)
+template<typename F>
+TortoiseMatrix<T> TortoiseMatrix<T>::dot(const TortoisePackedMatrix<T>& mat, const TortoiseMatrix<T>& bias, T alpha,
+                                         F activation) const
 {
-	assert(m_rows == mat.m_rows);
-	assert(m_cols == mat.m_cols);
+	const tortoise_detail::ElementActivation<T, F> function = { activation };
+	return tortoise_detail::multiply(tortoise_detail::const_ref(*this), tortoise_detail::packed_ref(mat), bias, alpha, function);
+}
 
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = (m_data + mat.m_data);
-	return result;
+template<typename T>
+TortoiseMatrix<T> TortoiseBlockView<T>::dot(const TortoiseMatrix<T>& mat) const
+{
+	return tortoise_detail::multiply(tortoise_detail::const_ref(*this), tortoise_detail::const_ref(mat));
 }
 
 template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::broadcast(TortoiseMatrix<T>& mat)
+TortoiseMatrix<T> TortoiseBlockView<T>::dot(const TortoiseBlockView<T>& view) const
 {
-	assert(m_cols == mat.m_cols);
+	return tortoise_detail::multiply(tortoise_detail::const_ref(*this), tortoise_detail::const_ref(view));
+}
 
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = m_data;
+/*
+ * c = alpha * a * b + beta * c into the caller's matrix, without a result
+ * allocation or a separate accumulation pass; a and b are read transposed
+ * when asked for (as dotTN, dotNT and dotTT do). c must already have the
+ * shape of the product and must not be a or b. With beta 0, c is only
+ * written, so its previous values (even NaN) do not matter.
+ */
+template<typename T>
+void tortoiseGemm(double alpha, const TortoiseMatrix<T>& a, const TortoiseMatrix<T>& b, double beta,
+                  TortoiseMatrix<T>& c, bool transpose_a = false, bool transpose_b = false)
+{
+	assert(&c != &a && &c != &b);
 
-	auto broadcast_valarray = mat.m_data[std::slice(0, m_cols, 1)];
+	tortoise_detail::ConstMatrixRef<T> lhs = tortoise_detail::const_ref(a);
+	tortoise_detail::ConstMatrixRef<T> rhs = tortoise_detail::const_ref(b);
+	if (transpose_a)
+		lhs = tortoise_detail::transposed(lhs);
+	if (transpose_b)
+		rhs = tortoise_detail::transposed(rhs);
 
-	for (int i = 0; i < m_rows; i++) {
-		result.m_data[std::slice(i * m_cols, m_cols, 1)] += broadcast_valarray;
-	}
-	return result;
+	const tortoise_detail::MatrixRef<T> out = { c.data(), c.rows(), c.cols(), c.cols(), 1 };
+	tortoise_detail::gemm(T(alpha), lhs, rhs, T(beta), out);
 }
 
+/*
+ * Independent products of same shape matrices, such as per object
+ * transforms or attention heads: result i is a[i].dot(b[i]). Products of
+ * at most 64 rows, columns and inner dimension run as many at once as the
+ * SIMD width, one per vector lane, and the batch is split over the
+ * threads; larger ones run dot one by one, spread over the threads.
+ */
 template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::bSubtract(TortoiseMatrix<T>& mat)
+std::vector<TortoiseMatrix<T>> tortoiseBatchedDot(const std::vector<TortoiseMatrix<T>>& a,
+                                                  const std::vector<TortoiseMatrix<T>>& b)
 {
-	assert(m_cols == mat.m_cols);
-
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = m_data;
+	assert(a.size() == b.size());
 
-	auto broadcast_valarray = mat.m_data[std::slice(0, m_cols, 1)];
+	std::vector<TortoiseMatrix<T>> result;
+	if (a.empty())
+		return result;
 
-	for (int i = 0; i < m_rows; i++) {
-		result.m_data[std::slice(i * m_cols, m_cols, 1)] -= broadcast_valarray;
+	const int m = a[0].rows();
+	const int k = a[0].cols();
+	const int n = b[0].cols();
+	std::vector<const T*> lhs(a.size());
+	std::vector<const T*> rhs(a.size());
+	std::vector<T*> out(a.size());
+	result.reserve(a.size());
+	for (std::size_t i = 0; i < a.size(); i++) {
+		assert(a[i].rows() == m && a[i].cols() == k);
+		assert(b[i].rows() == k && b[i].cols() == n);
+		result.emplace_back(m, n);
+		lhs[i] = a[i].data();
+		rhs[i] = b[i].data();
+		out[i] = result[i].data();
 	}
+	tortoise_detail::gemm_batch((int)a.size(), m, n, k, lhs.data(), rhs.data(), out.data());
 	return result;
 }
 
+/*
+ * The strided form of tortoiseBatchedDot, without a matrix per item: a
+ * holds batch m x k matrices one under the other ([batch * m, k]), b
+ * batch k x n ones ([batch * k, n]) and the result their products
+ * ([batch * m, n]).
+ */
 template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::bMultiply(TortoiseMatrix<T>& mat)
+TortoiseMatrix<T> tortoiseBatchedDot(const TortoiseMatrix<T>& a, const TortoiseMatrix<T>& b, int batch)
 {
-	assert(m_cols == mat.m_cols);
+	assert(batch > 0 && a.rows() % batch == 0 && b.rows() % batch == 0);
 
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = m_data;
-
-	auto broadcast_valarray = mat.m_data[std::slice(0, m_cols, 1)];
+	const int m = a.rows() / batch;
+	const int k = a.cols();
+	const int n = b.cols();
+	assert(b.rows() / batch == k);
 
-	for (int i = 0; i < m_rows; i++) {
-		result.m_data[std::slice(i * m_cols, m_cols, 1)] *= broadcast_valarray;
+	TortoiseMatrix<T> result(a.rows(), n);
+	std::vector<const T*> lhs(batch);
+	std::vector<const T*> rhs(batch);
+	std::vector<T*> out(batch);
+	for (int i = 0; i < batch; i++) {
+		lhs[i] = a.data() + (long)i * m * k;
+		rhs[i] = b.data() + (long)i * k * n;
+		out[i] = result.data() + (long)i * m * n;
 	}
+	tortoise_detail::gemm_batch(batch, m, n, k, lhs.data(), rhs.data(), out.data());
 	return result;
 }
 
 template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::operator-(const TortoiseMatrix<T>& mat)
+TortoiseMatrix<T> TortoiseMatrix<T>::dot2(const TortoiseMatrix<T> &mat)
 {
-	assert(m_rows == mat.m_rows);
-	assert(m_cols == mat.m_cols);
 
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = (m_data - mat.m_data);
+	TortoiseMatrix<T> result = TortoiseMatrix(m_rows, mat.m_cols);
+	
+	for(auto r = 0; r < m_rows; r++) {
+		for(auto k = 0; k < m_cols; k++) {
+			double total = 0;
+			for(auto c = 0; c < mat.m_cols; c++) {
+				result.m_data[r * mat.m_cols + c] += (m_data[r * m_cols + k] * mat.m_data[k * mat.m_cols + c]);
+			}
+		}
+	}
 	return result;
 }
 
 template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::operator*(const TortoiseMatrix<T>& mat)
+TortoiseMatrix<T> TortoiseMatrix<T>::atan2() const
 {
-	assert(m_rows == mat.m_rows);
-	assert(m_cols == mat.m_cols);
-
 	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = (m_data * mat.m_data);
+	result.m_data = std::atan2(m_data);
 	return result;
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::operator/(const TortoiseMatrix<T>& mat)
+template<typename E, typename T>
+T TortoiseExpression<E, T>::operator()(int row, int col) const
 {
-	assert(m_rows == mat.m_rows);
-	assert(m_cols == mat.m_cols);
-
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = (m_data / mat.m_data);
-	return result;
+	T value;
+	return *derived().block((long)row * derived().cols() + col, 1, &value);
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::operator+(const T& value)
+template<typename E, typename T>
+TortoiseMatrix<T> TortoiseExpression<E, T>::eval() const &
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = (m_data + value);
-	return result;
+	return TortoiseMatrix<T>(derived());
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::operator-(const T& value)
+template<typename E, typename T>
+TortoiseMatrix<T> TortoiseExpression<E, T>::eval() &&
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = (m_data - value);
-	return result;
+	return TortoiseMatrix<T>(std::move(derived()));
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::operator*(const T& value)
+template<typename E, typename T>
+TortoiseMatrix<T> TortoiseExpression<E, T>::transpose() const
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = (m_data * value);
-	return result;
+	return eval().transpose();
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::operator/(const T& value)
+template<typename E, typename T>
+TortoiseMatrix<T> TortoiseExpression<E, T>::dot(const TortoiseMatrix<T>& mat) const
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = (m_data / value);
-	return result;
+	return eval().dot(mat);
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::div(double value)
+template<typename E, typename T>
+template<typename M>
+typename tortoise_detail::BroadcastResult<const E&, M, T, tortoise_detail::OP_ADD>::type TortoiseExpression<E, T>::broadcast(M&& mat) const &
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = (value / m_data);
-	return result;
+	typedef typename tortoise_detail::BroadcastResult<const E&, M, T, tortoise_detail::OP_ADD>::type Node;
+	return Node(derived(), std::forward<M>(mat));
 }
 
-template<typename T>
-TortoiseMatrix<T>& TortoiseMatrix<T>::operator+=(const TortoiseMatrix<T>& mat)
+template<typename E, typename T>
+template<typename M>
+typename tortoise_detail::BroadcastResult<E, M, T, tortoise_detail::OP_ADD>::type TortoiseExpression<E, T>::broadcast(M&& mat) &&
 {
-	assert(m_rows == mat.m_rows);
-	assert(m_cols == mat.m_cols);
-
-	m_data += mat.m_data;
-	return *this;
+	typedef typename tortoise_detail::BroadcastResult<E, M, T, tortoise_detail::OP_ADD>::type Node;
+	return Node(std::move(derived()), std::forward<M>(mat));
 }
 
-template<typename T>
-TortoiseMatrix<T>& TortoiseMatrix<T>::operator-=(const TortoiseMatrix<T>& mat)
+template<typename E, typename T>
+template<typename M>
+typename tortoise_detail::BroadcastResult<const E&, M, T, tortoise_detail::OP_SUB>::type TortoiseExpression<E, T>::bSubtract(M&& mat) const &
 {
-	assert(m_rows == mat.m_rows);
-	assert(m_cols == mat.m_cols);
-
-	m_data -= mat.m_data;
-	return *this;
+	typedef typename tortoise_detail::BroadcastResult<const E&, M, T, tortoise_detail::OP_SUB>::type Node;
+	return Node(derived(), std::forward<M>(mat));
 }
 
-template<typename T>
-TortoiseMatrix<T>& TortoiseMatrix<T>::operator*=(const TortoiseMatrix<T>& mat)
+template<typename E, typename T>
+template<typename M>
+typename tortoise_detail::BroadcastResult<E, M, T, tortoise_detail::OP_SUB>::type TortoiseExpression<E, T>::bSubtract(M&& mat) &&
 {
-	assert(m_rows == mat.m_rows);
-	assert(m_cols == mat.m_cols);
-
-	m_data *= mat.m_data;
-	return *this;
+	typedef typename tortoise_detail::BroadcastResult<E, M, T, tortoise_detail::OP_SUB>::type Node;
+	return Node(std::move(derived()), std::forward<M>(mat));
 }
 
-template<typename T>
-TortoiseMatrix<T>& TortoiseMatrix<T>::operator/=(const TortoiseMatrix<T>& mat)
+template<typename E, typename T>
+template<typename M>
+typename tortoise_detail::BroadcastResult<const E&, M, T, tortoise_detail::OP_MUL>::type TortoiseExpression<E, T>::bMultiply(M&& mat) const &
 {
-	assert(m_rows == mat.m_rows);
-	assert(m_cols == mat.m_cols);
-
-	m_data /= mat.m_data;
-	return *this;
+	typedef typename tortoise_detail::BroadcastResult<const E&, M, T, tortoise_detail::OP_MUL>::type Node;
+	return Node(derived(), std::forward<M>(mat));
 }
 
-template<typename T>
-void TortoiseMatrix<T>::resize(int rows, int cols)
+template<typename E, typename T>
+template<typename M>
+typename tortoise_detail::BroadcastResult<E, M, T, tortoise_detail::OP_MUL>::type TortoiseExpression<E, T>::bMultiply(M&& mat) &&
 {
-	m_rows = rows;
-	m_cols = cols;
-
-	m_data.resize(rows * cols);
+	typedef typename tortoise_detail::BroadcastResult<E, M, T, tortoise_detail::OP_MUL>::type Node;
+	return Node(std::move(derived()), std::forward<M>(mat));
 }
 
-template<typename T>
-void TortoiseMatrix<T>::set(int row, int col, const T& value)
+template<typename E, typename T>
+template<typename M>
+typename tortoise_detail::BroadcastResult<const E&, M, T, tortoise_detail::OP_DIV>::type TortoiseExpression<E, T>::bDivide(M&& mat) const &
 {
-	m_data[row * m_cols + col] = value;
+	typedef typename tortoise_detail::BroadcastResult<const E&, M, T, tortoise_detail::OP_DIV>::type Node;
+	return Node(derived(), std::forward<M>(mat));
 }
 
-template<typename T>
-void TortoiseMatrix<T>::set(const T& value)
+template<typename E, typename T>
+template<typename M>
+typename tortoise_detail::BroadcastResult<E, M, T, tortoise_detail::OP_DIV>::type TortoiseExpression<E, T>::bDivide(M&& mat) &&
 {
-	m_data.fill(value);
+	typedef typename tortoise_detail::BroadcastResult<E, M, T, tortoise_detail::OP_DIV>::type Node;
+	return Node(std::move(derived()), std::forward<M>(mat));
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::transpose() const
+template<typename E, typename T>
+typename tortoise_detail::ScalarNode<const E&, T, tortoise_detail::OP_DIV, true>::type TortoiseExpression<E, T>::div(double value) const &
 {
-	TortoiseMatrix<T> result(m_cols, m_rows);
-	for (auto r = 0; r < m_rows; r++)
-	{
-		for (auto c = 0; c < m_cols; c++)
-		{
-			//result.m_data[c * m_cols + r] = m_data[r * m_cols + c];
-			T value = operator()(r, c);
-			result.set(c, r, value);
-		}
-	}
-	return result;
+	typedef typename tortoise_detail::ScalarNode<const E&, T, tortoise_detail::OP_DIV, true>::type Node;
+	return Node(derived(), (T)value);
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::extract(int row_begin, int row_count) const
+template<typename E, typename T>
+typename tortoise_detail::ScalarNode<E, T, tortoise_detail::OP_DIV, true>::type TortoiseExpression<E, T>::div(double value) &&
 {
-	int index_begin = row_begin * m_cols;
-	int number_of_elements = row_count * m_cols;
-
-	TortoiseMatrix<T> result(row_count, m_cols);
-	result.m_data = m_data[std::slice(index_begin, number_of_elements, 1)];
-	return result;
+	typedef typename tortoise_detail::ScalarNode<E, T, tortoise_detail::OP_DIV, true>::type Node;
+	return Node(std::move(derived()), (T)value);
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::extract(int col) const
+template<typename E, typename T>
+typename tortoise_detail::UnaryResult<const E&, T, tortoise_detail::PowFunction>::type TortoiseExpression<E, T>::pow(double value) const &
 {
-	TortoiseMatrix<T> result(m_rows, 1);
-	result.m_data = m_data[std::slice(col, m_rows, m_cols)];
-	return result;
+	typedef typename tortoise_detail::UnaryResult<const E&, T, tortoise_detail::PowFunction>::type Node;
+	return Node(derived(), tortoise_detail::PowFunction(value));
 }
 
-template<typename T>
-void TortoiseMatrix<T>::normalize()
+template<typename E, typename T>
+typename tortoise_detail::UnaryResult<E, T, tortoise_detail::PowFunction>::type TortoiseExpression<E, T>::pow(double value) &&
 {
-	const T _min = min();
-	const T _max = max();
-	const T min_max_diff = _max - _min;
-	for (auto r = 0; r < m_rows; r++)
-	{
-		for (auto c = 0; c < m_cols; c++)
-		{
-			T value = operator()(r, c);
-			set(r, c, (value - _min)/min_max_diff);
-		}
-	}
+	typedef typename tortoise_detail::UnaryResult<E, T, tortoise_detail::PowFunction>::type Node;
+	return Node(std::move(derived()), tortoise_detail::PowFunction(value));
 }
 
-template<typename T>
-void TortoiseMatrix<T>::swap(int row1, int row2)
+template<typename E, typename T>
+TortoiseMatrix<T>& TortoiseExpression<E, T>::pow(TortoiseMatrix<T>& out, double value) const
 {
-	assert(m_rows > row1);
-	assert(m_rows > row2);
-
-	int ind_start = row1 * m_cols;
-	int ind_end = ind_start + m_cols;
-	int swp_ind_start = row2 * m_cols;
-	std::swap_ranges(std::begin(m_data) + ind_start, std::begin(m_data) + ind_end, std::begin(m_data) + swp_ind_start);
+	assert(out.rows() == derived().rows() && out.cols() == derived().cols());
+	return out = pow(value);
 }
 
-template<typename T>
-T TortoiseMatrix<T>::min() const
+template<typename E, typename T>
+T TortoiseExpression<E, T>::min() const
 {
-	return m_data.min();
+	assert(derived().size() > 0);
+	return tortoise_detail::reduce_expression<tortoise_detail::OP_MIN, T>(derived());
 }
 
-template<typename T>
-T TortoiseMatrix<T>::max() const
+template<typename E, typename T>
+T TortoiseExpression<E, T>::max() const
 {
-	return m_data.max();
+	assert(derived().size() > 0);
+	return tortoise_detail::reduce_expression<tortoise_detail::OP_MAX, T>(derived());
 }
 
-template<typename T>
-T TortoiseMatrix<T>::sum() const
+template<typename E, typename T>
+T TortoiseExpression<E, T>::sum() const
 {
-	return m_data.sum();
+	return tortoise_detail::reduce_expression<tortoise_detail::OP_ADD, T>(derived());
 }
 
-template<typename T>
-double TortoiseMatrix<T>::mean() const
+template<typename E, typename T>
+double TortoiseExpression<E, T>::mean() const
 {
-	return (double)sum() / m_data.size();
+	return (double)sum() / derived().size();
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::dotTemp(const TortoiseMatrix<T> &mat)
+template<typename E, typename T>
+TortoiseMatrix<T> TortoiseExpression<E, T>::sumRows() const
 {
-	TortoiseMatrix<T> result = TortoiseMatrix(m_rows, mat.m_cols);
-	for(auto r = 0; r < m_rows; r++) {
-		for(auto c = 0; c < mat.m_cols; c++) {
-			std::valarray<T> row = m_data[std::slice(r * m_cols, m_cols, 1)];
-			std::valarray<T> col = mat.m_data[std::slice(c, mat.m_rows, mat.m_cols)];
-			std::valarray<T> mul = row * col;
-			const T& sum = mul.sum();
-			result.set(r, c, sum);
-		}
-	}
+	TortoiseMatrix<T> result(derived().rows(), 1);
+	tortoise_detail::reduce_axis<tortoise_detail::OP_ADD, false>(derived(), TortoiseAxisRows, result.data(), 0);
 	return result;
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::dot(const TortoiseMatrix<T> &mat) const
+template<typename E, typename T>
+TortoiseMatrix<T> TortoiseExpression<E, T>::sumCols() const
 {
-	TortoiseMatrix<T> dest = TortoiseMatrix(m_rows, mat.m_cols);
-
-	TortoiseMatrix<T> tr = mat.transpose();
-	
-	for (int r = 0; r < dest.m_rows; r++) {
-		for (int c = 0; c < dest.m_cols; c++) {
-			T sum = 0;
-			for (int k = 0; k < m_cols; k++)
-				sum += m_data[r * m_cols + k] * tr.m_data[c * tr.m_cols + k];
-				//sum += m_data[r * m_cols + k] * tr(c, k);
-			dest.m_data[r * dest.m_cols + c] = sum;
-		}
-	}
-	return dest;
+	TortoiseMatrix<T> result(1, derived().cols());
+	tortoise_detail::reduce_axis<tortoise_detail::OP_ADD, false>(derived(), TortoiseAxisCols, result.data(), 0);
+	return result;
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::dot2(const TortoiseMatrix<T> &mat)
+template<typename E, typename T>
+TortoiseMatrix<T> TortoiseExpression<E, T>::minAxis(TortoiseAxis axis) const
 {
-
-	TortoiseMatrix<T> result = TortoiseMatrix(m_rows, mat.m_cols);
-	
-	for(auto r = 0; r < m_rows; r++) {
-		for(auto k = 0; k < m_cols; k++) {
-			double total = 0;
-			for(auto c = 0; c < mat.m_cols; c++) {
-				result.m_data[r * mat.m_cols + c] += (m_data[r * m_cols + k] * mat.m_data[k * mat.m_cols + c]);
-			}
-		}
-	}
+	assert(derived().size() > 0);
+	TortoiseMatrix<T> result = tortoise_detail::axis_result<T>(derived(), axis);
+	tortoise_detail::reduce_axis<tortoise_detail::OP_MIN, false>(derived(), axis, result.data(), 0);
 	return result;
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::abs() const
+template<typename E, typename T>
+TortoiseMatrix<T> TortoiseExpression<E, T>::maxAxis(TortoiseAxis axis) const
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = std::abs(m_data);
+	assert(derived().size() > 0);
+	TortoiseMatrix<T> result = tortoise_detail::axis_result<T>(derived(), axis);
+	tortoise_detail::reduce_axis<tortoise_detail::OP_MAX, false>(derived(), axis, result.data(), 0);
 	return result;
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::exp() const
+template<typename E, typename T>
+TortoiseMatrix<T> TortoiseExpression<E, T>::meanAxis(TortoiseAxis axis) const
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = std::exp(m_data);
-	return result;
+	assert(derived().size() > 0);
+	TortoiseMatrix<T> result = axis == TortoiseAxisRows ? sumRows() : sumCols();
+	return std::move(result) / (double)(axis == TortoiseAxisRows ? derived().cols() : derived().rows());
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::log() const
+template<typename E, typename T>
+TortoiseMatrix<int> TortoiseExpression<E, T>::argmin(TortoiseAxis axis) const
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = std::log(m_data);
+	assert(derived().size() > 0);
+	TortoiseMatrix<T> values = tortoise_detail::axis_result<T>(derived(), axis);
+	TortoiseMatrix<int> result = tortoise_detail::axis_result<int>(derived(), axis);
+	tortoise_detail::reduce_axis<tortoise_detail::OP_MIN, true>(derived(), axis, values.data(), result.data());
 	return result;
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::log10() const
+template<typename E, typename T>
+TortoiseMatrix<int> TortoiseExpression<E, T>::argmax(TortoiseAxis axis) const
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = std::log10(m_data);
+	assert(derived().size() > 0);
+	TortoiseMatrix<T> values = tortoise_detail::axis_result<T>(derived(), axis);
+	TortoiseMatrix<int> result = tortoise_detail::axis_result<int>(derived(), axis);
+	tortoise_detail::reduce_axis<tortoise_detail::OP_MAX, true>(derived(), axis, values.data(), result.data());
 	return result;
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::pow(double value) const
+template<typename T, int Rows, int Cols>
+TortoiseFixedMatrix<T, Rows, Cols>::TortoiseFixedMatrix()
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = std::pow(m_data, (T)value);
-	return result;
+	set(T());
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::sqrt() const
+template<typename T, int Rows, int Cols>
+TortoiseFixedMatrix<T, Rows, Cols>::TortoiseFixedMatrix(const T& value)
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = std::sqrt(m_data);
-	return result;
+	set(value);
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::sin() const
+template<typename T, int Rows, int Cols>
+TortoiseFixedMatrix<T, Rows, Cols>::TortoiseFixedMatrix(std::initializer_list<std::initializer_list<T>> mat)
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = std::sin(m_data);
-	return result;
+	assert(mat.size() == (size_t)Rows);
+	T* dst = m_data;
+	for (const std::initializer_list<T>& row : mat) {
+		assert(row.size() == (size_t)Cols);
+		dst = std::copy(row.begin(), row.end(), dst);
+	}
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::cos() const
+template<typename T, int Rows, int Cols>
+TortoiseFixedMatrix<T, Rows, Cols>::TortoiseFixedMatrix(const std::valarray<std::valarray<T>>& mat)
+{
+	assert(mat.size() == (size_t)Rows);
+	for (int r = 0; r < Rows; r++) {
+		assert(mat[r].size() == (size_t)Cols);
+		for (int c = 0; c < Cols; c++) {
+			set(r, c, mat[r][c]);
+		}
+	}
+}
 
+template<typename T, int Rows, int Cols>
+TortoiseFixedMatrix<T, Rows, Cols>::TortoiseFixedMatrix(const TortoiseMatrix<T>& mat)
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = std::cos(m_data);
-	return result;
+	assert(mat.rows() == Rows);
+	assert(mat.cols() == Cols);
+	std::copy(mat.data(), mat.data() + Rows * Cols, m_data);
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::tan() const
+template<typename T, int Rows, int Cols>
+void TortoiseFixedMatrix<T, Rows, Cols>::set(const T& value)
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = std::tan(m_data);
-	return result;
+	TT_UNROLL
+	for (int i = 0; i < Rows * Cols; i++)
+		m_data[i] = value;
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::asin() const
+template<typename T, int Rows, int Cols>
+TortoiseMatrix<T> TortoiseFixedMatrix<T, Rows, Cols>::matrix() const
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = std::asin(m_data);
+	TortoiseMatrix<T> result(Rows, Cols);
+	std::copy(m_data, m_data + Rows * Cols, result.data());
 	return result;
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::acos() const
+/*
+ * Each row of the result accumulates the rows of mat scaled by one
+ * element of this, so the innermost loop runs along contiguous rows and
+ * vectorizes once the fixed trip counts are unrolled
+ */
+template<typename T, int Rows, int Cols>
+template<int N>
+TortoiseFixedMatrix<T, Rows, N> TortoiseFixedMatrix<T, Rows, Cols>::dot(const TortoiseFixedMatrix<T, Cols, N>& mat) const
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = std::acos(m_data);
+	TortoiseFixedMatrix<T, Rows, N> result;
+	const T* b = mat.data();
+	T* c = result.data();
+	TT_UNROLL
+	for (int i = 0; i < Rows; i++) {
+		TT_UNROLL
+		for (int p = 0; p < Cols; p++) {
+			const T a = m_data[i * Cols + p];
+			TT_UNROLL
+			for (int j = 0; j < N; j++)
+				c[i * N + j] += a * b[p * N + j];
+		}
+	}
 	return result;
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::atan() const
+template<typename T, int Rows, int Cols>
+TortoiseFixedMatrix<T, Cols, Rows> TortoiseFixedMatrix<T, Rows, Cols>::transpose() const
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = std::atan(m_data);
+	TortoiseFixedMatrix<T, Cols, Rows> result;
+	T* dst = result.data();
+	TT_UNROLL
+	for (int r = 0; r < Rows; r++) {
+		TT_UNROLL
+		for (int c = 0; c < Cols; c++)
+			dst[c * Rows + r] = m_data[r * Cols + c];
+	}
 	return result;
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::atan2() const
+template<typename T, int Rows, int Cols>
+T TortoiseFixedMatrix<T, Rows, Cols>::min() const
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = std::atan2(m_data);
+	T result = m_data[0];
+	TT_UNROLL
+	for (int i = 1; i < Rows * Cols; i++)
+		result = std::min(result, m_data[i]);
 	return result;
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::sinh() const
+template<typename T, int Rows, int Cols>
+T TortoiseFixedMatrix<T, Rows, Cols>::max() const
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = std::sinh(m_data);
+	T result = m_data[0];
+	TT_UNROLL
+	for (int i = 1; i < Rows * Cols; i++)
+		result = std::max(result, m_data[i]);
 	return result;
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::cosh() const
+template<typename T, int Rows, int Cols>
+T TortoiseFixedMatrix<T, Rows, Cols>::sum() const
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = std::cosh(m_data);
+	T result = T();
+	TT_UNROLL
+	for (int i = 0; i < Rows * Cols; i++)
+		result += m_data[i];
 	return result;
 }
 
-template<typename T>
-TortoiseMatrix<T> TortoiseMatrix<T>::tanh() const
+template<typename T, int Rows, int Cols>
+double TortoiseFixedMatrix<T, Rows, Cols>::mean() const
 {
-	TortoiseMatrix<T> result(m_rows, m_cols);
-	result.m_data = std::tanh(m_data);
-	return result;
+	return (double)sum() / (Rows * Cols);
 }
 
+#define TT_FIXED_ASSIGN(OP)                                                                                              \
+	template<typename T, int Rows, int Cols>                                                                             \
+	TortoiseFixedMatrix<T, Rows, Cols>& TortoiseFixedMatrix<T, Rows, Cols>::operator OP(const TortoiseFixedMatrix& mat)  \
+	{                                                                                                                    \
+		TT_UNROLL                                                                                                        \
+		for (int i = 0; i < Rows * Cols; i++)                                                                            \
+			m_data[i] OP mat.m_data[i];                                                                                  \
+		return *this;                                                                                                    \
+	}                                                                                                                    \
+                                                                                                                         \
+	template<typename T, int Rows, int Cols>                                                                             \
+	TortoiseFixedMatrix<T, Rows, Cols>& TortoiseFixedMatrix<T, Rows, Cols>::operator OP(const T& value)                  \
+	{                                                                                                                    \
+		TT_UNROLL                                                                                                        \
+		for (int i = 0; i < Rows * Cols; i++)                                                                            \
+			m_data[i] OP value;                                                                                          \
+		return *this;                                                                                                    \
+	}
+
+TT_FIXED_ASSIGN(+=)
+TT_FIXED_ASSIGN(-=)
+TT_FIXED_ASSIGN(*=)
+TT_FIXED_ASSIGN(/=)
+
+#undef TT_FIXED_ASSIGN
+
 #endif